@@ -177,9 +177,9 @@ int main(int argc, char *argv[])
             std::vector<torch::Tensor> act_result;
             {
                 torch::NoGradGuard no_grad;
-                act_result = policy->act(storage.get_observations()[step],
-                                         storage.get_hidden_states()[step],
-                                         storage.get_masks()[step]);
+                act_result = policy->act(storage.get_observation(step),
+                                         storage.get_hidden_state(step),
+                                         storage.get_mask(step));
             }
             auto actions_tensor = act_result[1].cpu().to(torch::kFloat);
             float *actions_array = actions_tensor.data_ptr<float>();
@@ -267,9 +267,9 @@ int main(int argc, char *argv[])
         {
             torch::NoGradGuard no_grad;
             next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
         storage.compute_returns(next_value, use_gae, discount_factor, gae);
@@ -1,6 +1,9 @@
 #include <string.h>
 #include <chrono>
 #include <fstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
@@ -24,21 +27,31 @@ const float entropy_coef = 1e-3;
 const float gae = 0.9;
 const float kl_target = 0.5;
 const float learning_rate = 1e-3;
+const bool lagged_updates = false; // Collect the next rollout during each update
 const int log_interval = 10;
 const int max_frames = 10e+7;
 const int num_epoch = 3;
 const int num_mini_batch = 20;
+const bool prefetch_mini_batches = true;
 const int reward_average_window_size = 10;
+const int streaming_window_size = 0; // PPO only. Train on each window of this many steps while the envs take the next step
 const float reward_clip_value = 100; // Post scaling
 const bool use_gae = true;
 const bool use_lr_decay = false;
+const bool use_pop_art = false; // Normalize value targets with PopArt instead of scaling rewards
 const float value_loss_coef = 0.5;
 
 // Environment hyperparameters
 const std::string env_name = "LunarLander-v2";
+const int frame_stack_size = 4; // Raw frames only
 const int num_envs = 8;
+const bool raw_frames = true; // Atari only. Preprocess frames here instead of in the gym server
 const float render_reward_threshold = 160;
 
+// Profiling
+const int trace_updates = 0; // Saves a Chrome trace of this many updates to trace.json
+const bool trace_aten_ops = false;
+
 // Model hyperparameters
 const int hidden_size = 64;
 const bool recurrent = false;
@@ -82,6 +95,7 @@ int main(int argc, char *argv[])
     auto make_param = std::make_shared<MakeParam>();
     make_param->env_name = env_name;
     make_param->num_envs = num_envs;
+    make_param->raw_frames = raw_frames;
     Request<MakeParam> make_request("make", make_param);
     communicator.send_request(make_request);
     spdlog::info(communicator.get_response<MakeResponse>()->result);
@@ -99,11 +113,61 @@ int main(int argc, char *argv[])
     Request<ResetParam> reset_request("reset", reset_param);
     communicator.send_request(reset_request);
 
-    auto observation_shape = env_info->observation_space_shape;
+    // With raw frames, the two frames from each env's step are maxed,
+    // grayscaled, resized and stacked here, and go straight into uint8
+    // storage
+    auto env_observation_shape = env_info->observation_space_shape;
+    const auto frame_shape = env_info->observation_space_shape;
+    const int64_t frame_size = 84;
+    std::unique_ptr<ImagePreprocessor> preprocessor;
+    torch::Tensor frame_stack;
+    if (env_info->raw_frames)
+    {
+        preprocessor = std::make_unique<ImagePreprocessor>(frame_shape[0], frame_shape[1],
+                                                           frame_size, frame_size);
+        frame_stack = torch::zeros({num_envs, frame_stack_size * preprocessor->get_num_channels(),
+                                    frame_size, frame_size},
+                                   torch::kByte);
+        env_observation_shape = {frame_stack.size(1), frame_size, frame_size};
+    }
+    // Shifts each env's newest frame into its stack. The stacks of envs whose
+    // episodes just ended are cleared first.
+    auto push_frames = [&](std::vector<uint8_t> &raw_observation,
+                           const std::vector<std::vector<bool>> &dones) {
+        auto expected_size = num_envs * 2 * frame_shape[0] * frame_shape[1] * 3;
+        if (static_cast<int64_t>(raw_observation.size()) != expected_size)
+        {
+            throw std::runtime_error("Expected " + std::to_string(expected_size) +
+                                     " bytes of raw frames, got " +
+                                     std::to_string(raw_observation.size()));
+        }
+        auto frames = torch::from_blob(raw_observation.data(),
+                                       {num_envs, 2, frame_shape[0], frame_shape[1], 3},
+                                       torch::kByte);
+        auto channels = preprocessor->get_num_channels();
+        auto kept = frame_stack.size(1) - channels;
+        frame_stack.narrow(1, 0, kept).copy_(frame_stack.narrow(1, channels, kept).clone());
+        for (unsigned int i = 0; i < dones.size(); ++i)
+        {
+            if (dones[i][0])
+            {
+                frame_stack[i].zero_();
+            }
+        }
+        preprocessor->process(frames.select(1, 1), frames.select(1, 0),
+                              frame_stack.narrow(1, kept, channels));
+        return frame_stack.clone().to(device);
+    };
+
+    auto observation_shape = env_observation_shape;
     observation_shape.insert(observation_shape.begin(), num_envs);
     torch::Tensor observation;
     std::vector<float> observation_vec;
-    if (env_info->observation_space_shape.size() > 1)
+    if (env_info->raw_frames)
+    {
+        observation = push_frames(communicator.get_response<RawResetResponse>()->observation, {});
+    }
+    else if (env_observation_shape.size() > 1)
     {
         observation_vec = flatten_vector(communicator.get_response<CnnResetResponse>()->observation);
         observation = torch::from_blob(observation_vec.data(), observation_shape).to(device);
@@ -114,30 +178,27 @@ int main(int argc, char *argv[])
         observation = torch::from_blob(observation_vec.data(), observation_shape).to(device);
     }
 
-    std::shared_ptr<NNBase> base;
-    if (env_info->observation_space_shape.size() == 1)
-    {
-        base = std::make_shared<MlpBase>(env_info->observation_space_shape[0], recurrent, hidden_size);
-    }
-    else
-    {
-        base = std::make_shared<CnnBase>(env_info->observation_space_shape[0], recurrent, hidden_size);
-    }
-    base->to(device);
     ActionSpace space{env_info->action_space_type, env_info->action_space_shape};
-    Policy policy(nullptr);
-    if (env_info->observation_space_shape.size() == 1)
-    {
-        // With observation normalization
-        policy = Policy(space, base, true);
-    }
-    else
-    {
-        // Without observation normalization
-        policy = Policy(space, base, true);
-    }
-    policy->to(device);
-    RolloutStorage storage(batch_size, num_envs, env_info->observation_space_shape, space, hidden_size, device);
+    auto make_policy = [&] {
+        std::shared_ptr<NNBase> base;
+        if (env_observation_shape.size() == 1)
+        {
+            base = std::make_shared<MlpBase>(env_observation_shape[0], recurrent, hidden_size);
+        }
+        else
+        {
+            base = std::make_shared<CnnBase>(env_observation_shape[0], recurrent, hidden_size);
+        }
+        base->to(device);
+        // Image observations get per-channel normalization
+        Policy policy(space, base, true, use_pop_art);
+        policy->to(device);
+        return policy;
+    };
+    Policy policy = make_policy();
+    // Image observations are whole numbers from 0 to 255, so they fit in bytes
+    auto observation_dtype = env_observation_shape.size() > 1 ? torch::kByte : torch::kFloat;
+    RolloutStorage first_storage(batch_size, num_envs, env_observation_shape, space, hidden_size, device, observation_dtype);
     std::unique_ptr<Algorithm> algo;
     if (algorithm == "A2C")
     {
@@ -155,10 +216,31 @@ int main(int argc, char *argv[])
                                      learning_rate,
                                      1e-8,
                                      0.5,
-                                     kl_target);
+                                     kl_target,
+                                     prefetch_mini_batches);
     }
 
-    storage.set_first_observation(observation);
+    first_storage.set_first_observation(observation);
+    first_storage.set_incremental_gae(use_gae, discount_factor);
+
+    // In lagged mode, actors use their own copy of the policy that trails the
+    // learner by one update
+    Policy actor_policy = policy;
+    std::unique_ptr<RolloutStorage> second_storage;
+    std::unique_ptr<LaggedUpdater> lagged_updater;
+    if (lagged_updates)
+    {
+        actor_policy = make_policy();
+        second_storage = std::make_unique<RolloutStorage>(batch_size, num_envs, env_observation_shape, space, hidden_size, device, observation_dtype);
+        second_storage->set_incremental_gae(use_gae, discount_factor);
+        lagged_updater = std::make_unique<LaggedUpdater>(*algo, policy, actor_policy, first_storage, *second_storage);
+    }
+
+    auto streaming_ppo = dynamic_cast<PPO *>(algo.get());
+    if (streaming_window_size > 0 && (!streaming_ppo || lagged_updates))
+    {
+        throw std::runtime_error("Streaming updates need PPO without lagged updates");
+    }
 
     std::vector<float> running_rewards(num_envs);
     int episode_count = 0;
@@ -170,16 +252,52 @@ int main(int argc, char *argv[])
     auto start_time = std::chrono::high_resolution_clock::now();
 
     int num_updates = max_frames / (batch_size * num_envs);
+    if (trace_updates > 0)
+    {
+        Tracer::get().start(trace_aten_ops);
+    }
     for (int update = 0; update < num_updates; ++update)
     {
+        if (trace_updates > 0 && update == trace_updates)
+        {
+            Tracer::get().stop();
+            Tracer::get().save("trace.json");
+            spdlog::info("Saved a trace of {} updates to trace.json", trace_updates);
+        }
+
+        auto &storage = lagged_updater ? lagged_updater->get_storage() : first_storage;
+
+        float decay_level;
+        if (use_lr_decay)
+        {
+            decay_level = 1. - static_cast<float>(update) / num_updates;
+        }
+        else
+        {
+            decay_level = 1;
+        }
+
+        // A finished window waits for the next step request to be sent, so the
+        // envs step while it trains
+        int pending_window_start = -1;
+        auto train_pending_window = [&] {
+            storage.compute_returns(storage.get_value_prediction(pending_window_start + streaming_window_size),
+                                    use_gae, discount_factor, gae,
+                                    pending_window_start, streaming_window_size);
+            streaming_ppo->update_window(storage, pending_window_start, streaming_window_size,
+                                         decay_level);
+            pending_window_start = -1;
+        };
+
         for (int step = 0; step < batch_size; ++step)
         {
             std::vector<torch::Tensor> act_result;
             {
+                TraceSpan act_span("act");
                 torch::NoGradGuard no_grad;
-                act_result = policy->act(storage.get_observations()[step],
-                                         storage.get_hidden_states()[step],
-                                         storage.get_masks()[step]);
+                act_result = actor_policy->act(storage.get_observation(step),
+                                               storage.get_hidden_state(step),
+                                               storage.get_mask(step));
             }
             auto actions_tensor = act_result[1].cpu().to(torch::kFloat);
             float *actions_array = actions_tensor.data_ptr<float>();
@@ -203,38 +321,60 @@ int main(int argc, char *argv[])
             step_param->actions = actions;
             step_param->render = render;
             Request<StepParam> step_request("step", step_param);
+            TraceSpan send_span("send");
             communicator.send_request(step_request);
+            send_span.end();
+            if (pending_window_start >= 0)
+            {
+                train_pending_window();
+            }
             std::vector<float> rewards;
             std::vector<float> real_rewards;
             std::vector<std::vector<bool>> dones_vec;
-            if (env_info->observation_space_shape.size() > 1)
+            // Scales rewards by the running standard deviation of the returns
+            auto scale_rewards = [&](const std::vector<std::vector<float>> &real_reward) {
+                real_rewards = flatten_vector(real_reward);
+                auto reward_tensor = torch::from_blob(real_rewards.data(), {num_envs}, torch::kFloat).clone();
+                // PopArt normalizes the value targets instead
+                if (!use_pop_art)
+                {
+                    returns = returns * discount_factor + reward_tensor;
+                    returns_rms->update(returns);
+                    reward_tensor = torch::clamp(reward_tensor / torch::sqrt(returns_rms->get_variance() + 1e-8),
+                                                 -reward_clip_value, reward_clip_value);
+                }
+                rewards = std::vector<float>(reward_tensor.data_ptr<float>(), reward_tensor.data_ptr<float>() + reward_tensor.numel());
+            };
+            if (env_info->raw_frames)
             {
+                TraceSpan receive_span("receive");
+                auto step_result = communicator.get_response<RawStepResponse>();
+                receive_span.end();
+                TraceSpan decode_span("decode");
+                dones_vec = step_result->done;
+                observation = push_frames(step_result->observation, dones_vec);
+                scale_rewards(step_result->real_reward);
+            }
+            else if (env_observation_shape.size() > 1)
+            {
+                TraceSpan receive_span("receive");
                 auto step_result = communicator.get_response<CnnStepResponse>();
+                receive_span.end();
+                TraceSpan decode_span("decode");
                 observation_vec = flatten_vector(step_result->observation);
                 observation = torch::from_blob(observation_vec.data(), observation_shape).to(device);
-                auto raw_reward_vec = flatten_vector(step_result->real_reward);
-                auto reward_tensor = torch::from_blob(raw_reward_vec.data(), {num_envs}, torch::kFloat);
-                returns = returns * discount_factor + reward_tensor;
-                returns_rms->update(returns);
-                reward_tensor = torch::clamp(reward_tensor / torch::sqrt(returns_rms->get_variance() + 1e-8),
-                                             -reward_clip_value, reward_clip_value);
-                rewards = std::vector<float>(reward_tensor.data_ptr<float>(), reward_tensor.data_ptr<float>() + reward_tensor.numel());
-                real_rewards = flatten_vector(step_result->real_reward);
+                scale_rewards(step_result->real_reward);
                 dones_vec = step_result->done;
             }
             else
             {
+                TraceSpan receive_span("receive");
                 auto step_result = communicator.get_response<MlpStepResponse>();
+                receive_span.end();
+                TraceSpan decode_span("decode");
                 observation_vec = flatten_vector(step_result->observation);
                 observation = torch::from_blob(observation_vec.data(), observation_shape).to(device);
-                auto raw_reward_vec = flatten_vector(step_result->real_reward);
-                auto reward_tensor = torch::from_blob(raw_reward_vec.data(), {num_envs}, torch::kFloat);
-                returns = returns * discount_factor + reward_tensor;
-                returns_rms->update(returns);
-                reward_tensor = torch::clamp(reward_tensor / torch::sqrt(returns_rms->get_variance() + 1e-8),
-                                             -reward_clip_value, reward_clip_value);
-                rewards = std::vector<float>(reward_tensor.data_ptr<float>(), reward_tensor.data_ptr<float>() + reward_tensor.numel());
-                real_rewards = flatten_vector(step_result->real_reward);
+                scale_rewards(step_result->real_reward);
                 dones_vec = step_result->done;
             }
             for (int i = 0; i < num_envs; ++i)
@@ -254,6 +394,7 @@ int main(int argc, char *argv[])
                 dones[i][0] = static_cast<int>(dones_vec[i][0]);
             }
 
+            TraceSpan insert_span("insert");
             storage.insert(observation,
                            act_result[3],
                            act_result[1],
@@ -261,30 +402,84 @@ int main(int argc, char *argv[])
                            act_result[0],
                            torch::from_blob(rewards.data(), {num_envs, 1}).to(device),
                            1 - dones);
+            insert_span.end();
+
+            if (streaming_window_size > 0 && step > 0 && step % streaming_window_size == 0)
+            {
+                pending_window_start = step - streaming_window_size;
+            }
+        }
+        // A window finished on the last step has no next request to overlap with
+        if (pending_window_start >= 0)
+        {
+            train_pending_window();
         }
 
         torch::Tensor next_value;
         {
             torch::NoGradGuard no_grad;
-            next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+            next_value = actor_policy->get_values(
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
-        storage.compute_returns(next_value, use_gae, discount_factor, gae);
+        TraceSpan returns_span("compute_returns");
+        int last_window_start = 0;
+        if (streaming_window_size > 0)
+        {
+            last_window_start = (batch_size - 1) / streaming_window_size * streaming_window_size;
+            storage.compute_returns(next_value, use_gae, discount_factor, gae,
+                                    last_window_start, batch_size - last_window_start);
+        }
+        else
+        {
+            storage.compute_returns(next_value, use_gae, discount_factor, gae);
+        }
+        returns_span.end();
 
-        float decay_level;
-        if (use_lr_decay)
+        std::vector<UpdateDatum> update_data;
+        if (streaming_window_size > 0)
         {
-            decay_level = 1. - static_cast<float>(update) / num_updates;
+            update_data = streaming_ppo->update_window(storage, last_window_start,
+                                                       batch_size - last_window_start,
+                                                       decay_level);
+            storage.after_update();
+        }
+        else if (lagged_updater)
+        {
+            // Logs the previous update's data
+            update_data = lagged_updater->update(decay_level);
         }
         else
         {
-            decay_level = 1;
+            update_data = algo->update(storage, decay_level);
+            storage.after_update();
+        }
+
+        if (update == 0)
+        {
+            // Minibatch memory is only known once an update has run. Lagged
+            // updates run in the background, so wait for the first one to
+            // finish. Its data is the first update's, which isn't logged
+            // anyway.
+            if (lagged_updater)
+            {
+                update_data = lagged_updater->wait();
+            }
+            std::vector<std::pair<std::string, std::vector<MemoryUsage>>> reports{
+                {"Storage", storage.get_memory_usage()},
+                {"Policy", policy->get_memory_usage()},
+                {"Algorithm", algo->get_memory_usage()}};
+            for (const auto &report : reports)
+            {
+                spdlog::info("{} memory usage: {} bytes", report.first, get_total_bytes(report.second));
+                for (const auto &part : report.second)
+                {
+                    spdlog::info("  {}: {} bytes", part.name, part.bytes);
+                }
+            }
         }
-        auto update_data = algo->update(storage, decay_level);
-        storage.after_update();
 
         if (update % log_interval == 0 && update > 0)
         {
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include <msgpack.hpp>
 
@@ -22,11 +24,14 @@ struct InfoParam
     MSGPACK_DEFINE_MAP(x);
 };
 
+// raw_frames asks Atari environments for raw frames, to be preprocessed by
+// the client
 struct MakeParam
 {
     std::string env_name;
     int num_envs;
-    MSGPACK_DEFINE_MAP(env_name, num_envs);
+    bool raw_frames;
+    MSGPACK_DEFINE_MAP(env_name, num_envs, raw_frames);
 };
 
 struct ResetParam
@@ -48,8 +53,12 @@ struct InfoResponse
     std::vector<int64_t> action_space_shape;
     std::string observation_space_type;
     std::vector<int64_t> observation_space_shape;
+    // If set, observations are the last two {height, width, 3} RGB frames of
+    // each env's step, and observation_space_shape is the shape of one frame
+    bool raw_frames;
     MSGPACK_DEFINE_MAP(action_space_type, action_space_shape,
-                       observation_space_type, observation_space_shape);
+                       observation_space_type, observation_space_shape,
+                       raw_frames);
 };
 
 struct MakeResponse
@@ -64,6 +73,12 @@ struct CnnResetResponse
     MSGPACK_DEFINE_MAP(observation);
 };
 
+struct RawResetResponse
+{
+    std::vector<uint8_t> observation;
+    MSGPACK_DEFINE_MAP(observation);
+};
+
 struct MlpResetResponse
 {
     std::vector<std::vector<float>> observation;
@@ -83,6 +98,12 @@ struct CnnStepResponse : StepResponse
     MSGPACK_DEFINE_MAP(observation, reward, done, real_reward);
 };
 
+struct RawStepResponse : StepResponse
+{
+    std::vector<uint8_t> observation;
+    MSGPACK_DEFINE_MAP(observation, reward, done, real_reward);
+};
+
 struct MlpStepResponse : StepResponse
 {
     std::vector<std::vector<float>> observation;
@@ -9,7 +9,9 @@ from gym.spaces import Box
 import numpy as np
 
 from baselines.common.vec_env import VecEnvWrapper
-from baselines.common.atari_wrappers import make_atari, wrap_deepmind
+from baselines.common.atari_wrappers import (ClipRewardEnv, EpisodicLifeEnv,
+                                             FireResetEnv, NoopResetEnv,
+                                             make_atari, wrap_deepmind)
 from baselines.common.vec_env.subproc_vec_env import SubprocVecEnv
 from baselines.common.vec_env.dummy_vec_env import DummyVecEnv
 from baselines.common.vec_env.vec_normalize import (VecNormalize
@@ -30,6 +32,39 @@ class TransposeImage(gym.ObservationWrapper):
         return observation.transpose(2, 0, 1)
 
 
+class RawFrameSkipEnv(gym.Wrapper):
+    """
+    Repeats each action for `skip` frames like baselines' MaxAndSkipEnv, but
+    returns the last two raw frames instead of their max, so the client can
+    do the preprocessing.
+    """
+
+    def __init__(self, env, skip=4):
+        super(RawFrameSkipEnv, self).__init__(env)
+        shape = env.observation_space.shape
+        self.observation_space = Box(0, 255, (2,) + shape, dtype=np.uint8)
+        self._frames = np.zeros((2,) + shape, dtype=np.uint8)
+        self._skip = skip
+
+    def reset(self, **kwargs):
+        observation = self.env.reset(**kwargs)
+        self._frames[:] = observation
+        return self._frames.copy()
+
+    def step(self, action):
+        total_reward = 0.0
+        done = None
+        info = None
+        for i in range(self._skip):
+            observation, reward, done, info = self.env.step(action)
+            if i >= self._skip - 2:
+                self._frames[i - (self._skip - 2)] = observation
+            total_reward += reward
+            if done:
+                break
+        return self._frames.copy(), total_reward, done, info
+
+
 class VecFrameStack(VecEnvWrapper):
     def __init__(self, venv, nstack):
         self.venv = venv
@@ -107,12 +142,31 @@ class VecNormalize(VecNormalize_):
         return obs, rews, news, infos
 
 
-def make_env(env_id, seed, rank):
+def make_raw_atari(env_id):
+    """
+    Like make_atari() and wrap_deepmind(), but leaves the frames as they are,
+    two per step, for the client to max, grayscale, resize and stack.
+    """
+    env = gym.make(env_id)
+    assert 'NoFrameskip' in env.spec.id
+    env = NoopResetEnv(env, noop_max=30)
+    env = RawFrameSkipEnv(env, skip=4)
+    env = EpisodicLifeEnv(env)
+    if 'FIRE' in env.unwrapped.get_action_meanings():
+        env = FireResetEnv(env)
+    return ClipRewardEnv(env)
+
+
+def make_env(env_id, seed, rank, raw_frames=False):
     def _thunk():
         env = gym.make(env_id)
 
         is_atari = hasattr(gym.envs, 'atari') and isinstance(
             env.unwrapped, gym.envs.atari.atari_env.AtariEnv)
+        if is_atari and raw_frames:
+            env = make_raw_atari(env_id)
+            env.seed(seed + rank)
+            return env
         if is_atari:
             env = make_atari(env_id)
 
@@ -138,8 +192,14 @@ def make_env(env_id, seed, rank):
     return _thunk
 
 
-def make_vec_envs(env_name, seed, num_processes, num_frame_stack=None):
-    envs = [make_env(env_name, seed, i) for i in range(num_processes)]
+def make_vec_envs(env_name, seed, num_processes, num_frame_stack=None,
+                  raw_frames=False):
+    """
+    With raw_frames, Atari environments return the last two raw RGB frames of
+    each step, shaped (2, height, width, 3), and aren't frame stacked.
+    """
+    envs = [make_env(env_name, seed, i, raw_frames)
+            for i in range(num_processes)]
 
     if len(envs) > 1:
         envs = SubprocVecEnv(envs)
@@ -148,6 +208,10 @@ def make_vec_envs(env_name, seed, num_processes, num_frame_stack=None):
 
     envs = VecRewardInfo(envs)
 
+    if len(envs.observation_space.shape) == 4:
+        # Raw frames are stacked by the client
+        return envs
+
     if num_frame_stack is not None:
         envs = VecFrameStack(envs, num_frame_stack)
     elif len(envs.observation_space.shape) == 3:
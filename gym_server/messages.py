@@ -23,18 +23,21 @@ class InfoMessage(Message):
     """
 
     def __init__(self, action_space_type, action_space_shape,
-                 observation_space_type, observation_space_shape):
+                 observation_space_type, observation_space_shape,
+                 raw_frames=False):
         self.action_space_type = action_space_type
         self.action_space_shape = action_space_shape
         self.observation_space_type = observation_space_type
         self.observation_space_shape = observation_space_shape
+        self.raw_frames = raw_frames
 
     def to_msg(self) -> bytes:
         request = {
             "action_space_type": self.action_space_type,
             "action_space_shape": self.action_space_shape,
             "observation_space_type": self.observation_space_type,
-            "observation_space_shape": self.observation_space_shape
+            "observation_space_shape": self.observation_space_shape,
+            "raw_frames": self.raw_frames
         }
         return msgpack.packb(request)
 
@@ -51,17 +54,27 @@ class MakeMessage(Message):
         return msgpack.packb(request)
 
 
+def pack_observation(observation: np.ndarray, raw_frames: bool):
+    """
+    Raw frames are sent as bytes, which is much cheaper than nested lists.
+    """
+    if raw_frames:
+        return observation.astype(np.uint8).tobytes()
+    return observation.tolist()
+
+
 class ResetMessage(Message):
     """
     Builds the JSON for returning the result of an env.reset() action.
     """
 
-    def __init__(self, observation: np.ndarray):
+    def __init__(self, observation: np.ndarray, raw_frames: bool = False):
         self.observation = observation
+        self.raw_frames = raw_frames
 
     def to_msg(self) -> bytes:
         request = {
-            "observation": self.observation.tolist()
+            "observation": pack_observation(self.observation, self.raw_frames)
         }
         return msgpack.packb(request)
 
@@ -75,15 +88,17 @@ class StepMessage(Message):
                  observation: np.ndarray,
                  reward: np.ndarray,
                  done: np.ndarray,
-                 real_reward: np.ndarray):
+                 real_reward: np.ndarray,
+                 raw_frames: bool = False):
         self.observation = observation
         self.reward = reward
         self.done = done
         self.real_reward = real_reward
+        self.raw_frames = raw_frames
 
     def to_msg(self) -> bytes:
         request = {
-            "observation": self.observation.tolist(),
+            "observation": pack_observation(self.observation, self.raw_frames),
             "reward": self.reward.tolist(),
             "done": self.done.tolist(),
             "real_reward": self.real_reward.tolist()
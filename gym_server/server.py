@@ -24,6 +24,7 @@ class Server:
     def __init__(self, zmq_client: ZmqClient):
         self.zmq_client: ZmqClient = zmq_client
         self.env: gym.Env = None
+        self.raw_frames: bool = False
         logging.info("Gym server initialized")
 
     def serve(self):
@@ -50,15 +51,18 @@ class Server:
                 self.zmq_client.send(InfoMessage(action_space_type,
                                                  action_space_shape,
                                                  observation_space_type,
-                                                 observation_space_shape))
+                                                 observation_space_shape,
+                                                 self.raw_frames))
 
             elif method == 'make':
-                self.__make(param['env_name'], param['num_envs'])
+                self.__make(param['env_name'], param['num_envs'],
+                            param.get('raw_frames', False))
                 self.zmq_client.send(MakeMessage())
 
             elif method == 'reset':
                 observation = self.__reset()
-                self.zmq_client.send(ResetMessage(observation))
+                self.zmq_client.send(ResetMessage(observation,
+                                                  self.raw_frames))
 
             elif method == 'step':
                 if 'render' in param:
@@ -69,7 +73,8 @@ class Server:
                 self.zmq_client.send(StepMessage(result[0],
                                                  result[1],
                                                  result[2],
-                                                 result[3]['reward']))
+                                                 result[3]['reward'],
+                                                 self.raw_frames))
 
     def info(self):
         """
@@ -82,15 +87,21 @@ class Server:
             action_space_shape = self.env.action_space.shape
         observation_space_type = self.env.observation_space.__class__.__name__
         observation_space_shape = self.env.observation_space.shape
+        if self.raw_frames:
+            # The shape of one frame, rather than of the pair sent each step
+            observation_space_shape = observation_space_shape[1:]
         return (action_space_type, action_space_shape, observation_space_type,
                 observation_space_shape)
 
-    def make(self, env_name, num_envs):
+    def make(self, env_name, num_envs, raw_frames=False):
         """
         Makes a vectorized environment of the type and number specified.
+        With raw_frames, Atari environments send raw frames for the client to
+        preprocess. Other environments ignore it.
         """
         logging.info("Making %d %ss", num_envs, env_name)
-        self.env = make_vec_envs(env_name, 0, num_envs)
+        self.env = make_vec_envs(env_name, 0, num_envs, raw_frames=raw_frames)
+        self.raw_frames = len(self.env.observation_space.shape) == 4
 
     def reset(self) -> np.ndarray:
         """
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/hidden_state_cache.h"
+#include "cpprl/model/policy.h"
+
+namespace cpprl
+{
+// Queues act() requests from many clients and answers them in batches, for
+// serving a Policy. It knows nothing about the transport, so callers pass in
+// each request's arrival time and send back the responses themselves.
+//
+// A batch is ready once max_batch_size requests are queued or the oldest has
+// waited max_latency. Recurrent policies keep a hidden state per client in a
+// HiddenStateCache, so the least recently active clients are forgotten once
+// there are more than max_clients.
+class ActBatcher
+{
+  public:
+    struct Request
+    {
+        std::string client;
+        std::vector<float> observation;
+        // Resets the client's hidden state. Should be set on the first
+        // observation of every episode.
+        bool episode_start;
+        std::chrono::steady_clock::time_point received;
+        // Copied to the response, so the caller can tell where to send it
+        uint64_t tag;
+    };
+
+    // error is empty unless the request couldn't be served
+    struct Response
+    {
+        std::string client;
+        uint64_t tag;
+        std::vector<float> action;
+        float value;
+        std::string error;
+    };
+
+  private:
+    Policy &policy;
+    torch::Device device;
+    std::vector<int64_t> observation_shape;
+    int64_t observation_size;
+    int max_batch_size;
+    std::chrono::milliseconds max_latency;
+    std::vector<Request> pending;
+    HiddenStateCache hidden_states;
+
+  public:
+    ActBatcher(Policy &policy,
+               const std::vector<int64_t> &observation_shape,
+               int max_batch_size,
+               std::chrono::milliseconds max_latency,
+               int64_t max_clients,
+               torch::Device device);
+
+    // Queues request. If the queue is already full, or the client already
+    // has a request queued (its requests depend on each other's hidden
+    // states), the queue is acted on first and those responses are returned. Requests with the wrong
+    // observation size are answered with an error straight away.
+    std::vector<Response> add(Request request);
+    // Acts on every queued request
+    std::vector<Response> flush();
+    // Time left before the oldest request's deadline, or -1 ms if nothing is
+    // queued
+    std::chrono::milliseconds get_timeout(std::chrono::steady_clock::time_point now) const;
+    bool is_ready(std::chrono::steady_clock::time_point now) const;
+
+    inline bool is_full() const { return static_cast<int>(pending.size()) >= max_batch_size; }
+    inline int64_t size() const { return static_cast<int64_t>(pending.size()); }
+};
+}
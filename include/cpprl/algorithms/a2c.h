@@ -1,11 +1,13 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <torch/torch.h>
 
 #include "cpprl/algorithms/algorithm.h"
+#include "cpprl/optimizers/flat_optimizer.h"
 
 namespace cpprl
 {
@@ -17,7 +19,7 @@ class A2C : public Algorithm
   private:
     Policy &policy;
     float actor_loss_coef, value_loss_coef, entropy_coef, max_grad_norm, original_learning_rate;
-    std::unique_ptr<torch::optim::RMSprop> optimizer;
+    std::unique_ptr<FlatOptimizer> optimizer;
 
   public:
     A2C(Policy &policy,
@@ -27,8 +29,10 @@ class A2C : public Algorithm
         float learning_rate,
         float epsilon = 1e-8,
         float alpha = 0.99,
-        float max_grad_norm = 0.5);
+        float max_grad_norm = 0.5,
+        const std::string &optimizer_name = "RMSprop");
 
+    std::vector<MemoryUsage> get_memory_usage() const;
     std::vector<UpdateDatum> update(RolloutStorage &rollouts, float decay_level = 1);
 };
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 
+#include "cpprl/memory_usage.h"
 #include "cpprl/storage.h"
 
 namespace cpprl
@@ -18,6 +19,9 @@ class Algorithm
   public:
     virtual ~Algorithm() = 0;
 
+    // Memory the algorithm holds on to between updates, such as optimizer
+    // state
+    virtual std::vector<MemoryUsage> get_memory_usage() const { return {}; }
     virtual std::vector<UpdateDatum> update(RolloutStorage &rollouts, float decay_level = 1) = 0;
 };
 
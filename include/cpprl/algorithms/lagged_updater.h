@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <future>
+#include <vector>
+
+#include "cpprl/algorithms/algorithm.h"
+#include "cpprl/model/policy.h"
+#include "cpprl/parameter_publisher.h"
+#include "cpprl/storage.h"
+
+namespace cpprl
+{
+// Overlaps rollout collection with training by running the algorithm's updates
+// on a background thread.
+//
+// Two storages swap roles each update: one is filled by the actors while the
+// learner trains on the other. Actors act with actor_policy, which is kept one
+// update behind learner_policy, so collection never waits on an update unless
+// the update takes longer than the collection.
+class LaggedUpdater
+{
+  private:
+    Algorithm &algorithm;
+    Policy &learner_policy, &actor_policy;
+    std::array<RolloutStorage *, 2> storages;
+    int collecting_index;
+    ParameterPublisher publisher;
+    uint64_t actor_version;
+    std::future<std::vector<UpdateDatum>> pending_update;
+
+  public:
+    // learner_policy must be the policy algorithm was made with. actor_policy
+    // needs the same architecture, and has learner_policy's weights copied into
+    // it here.
+    LaggedUpdater(Algorithm &algorithm,
+                  Policy &learner_policy,
+                  Policy &actor_policy,
+                  RolloutStorage &first_storage,
+                  RolloutStorage &second_storage);
+
+    // Call once get_storage() is full and its returns are computed. Waits for
+    // the previous update, copies its weights to the actor policy, then starts
+    // training on the collected rollout in the background. get_storage()
+    // returns the other storage afterwards, already continued from the
+    // collected one. Returns the previous update's data, which is empty the
+    // first time.
+    std::vector<UpdateDatum> update(float decay_level = 1);
+    // Blocks until the running update (if any) finishes, and returns its data
+    std::vector<UpdateDatum> wait();
+
+    inline Policy &get_actor_policy() { return actor_policy; }
+    inline RolloutStorage &get_storage() { return *storages[collecting_index]; }
+};
+}
@@ -1,11 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
 #include <torch/torch.h>
 
 #include "cpprl/algorithms/algorithm.h"
+#include "cpprl/optimizers/flat_optimizer.h"
 
 namespace cpprl
 {
@@ -18,7 +20,9 @@ class PPO : public Algorithm
     Policy &policy;
     float actor_loss_coef, value_loss_coef, entropy_coef, max_grad_norm, original_learning_rate, original_clip_param, kl_target;
     int num_epoch, num_mini_batch;
-    std::unique_ptr<torch::optim::Adam> optimizer;
+    int64_t mini_batch_size, micro_batch_size, mini_batch_bytes;
+    bool prefetch_mini_batches;
+    std::unique_ptr<FlatOptimizer> optimizer;
 
   public:
     PPO(Policy &policy,
@@ -31,8 +35,38 @@ class PPO : public Algorithm
         float learning_rate,
         float epsilon = 1e-8,
         float max_grad_norm = 0.5,
-        float kl_target = 0.01);
+        float kl_target = 0.01,
+        bool prefetch_mini_batches = false,
+        const std::string &optimizer_name = "Adam");
 
+    // Splits each update into minibatches of mini_batch_size samples, instead
+    // of num_mini_batch minibatches, so the minibatch size stays the same
+    // whatever the number of processes. The last minibatch gets whatever is
+    // left over, so it can be smaller. Recurrent policies round down to a
+    // whole number of processes per minibatch. 0 goes back to using
+    // num_mini_batch.
+    void set_mini_batch_size(int64_t mini_batch_size);
+    // Evaluates each minibatch in micro-batches of at most micro_batch_size
+    // samples, accumulating their gradients before stepping, so large
+    // minibatches fit in memory. The update is the same as without. Recurrent
+    // policies round down to a whole number of processes per micro-batch. 0
+    // evaluates whole minibatches.
+    void set_micro_batch_size(int64_t micro_batch_size);
+    // Also reports the memory the last update took up, as "mini_batches". On
+    // CUDA, that's the CUDA caching allocator's peak during the update, above
+    // what was allocated when it started, which includes activations and
+    // gradients. On the CPU, it's only the most memory the minibatch tensors
+    // took up at once, so it's a lower bound.
+    std::vector<MemoryUsage> get_memory_usage() const;
     std::vector<UpdateDatum> update(RolloutStorage &rollouts, float decay_level = 1);
+    // Trains on steps [start, start + length) of the rollout only, so
+    // training can start on a window once its returns are computed, while
+    // the rest of the rollout is still being collected. Advantages are
+    // normalized per window. The observation normalizer is updated with the
+    // whole rollout once the last window is trained on.
+    std::vector<UpdateDatum> update_window(RolloutStorage &rollouts,
+                                           int64_t start,
+                                           int64_t length,
+                                           float decay_level = 1);
 };
 }
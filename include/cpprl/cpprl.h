@@ -1,16 +1,33 @@
+#include "cpprl/act_batcher.h"
 #include "cpprl/algorithms/a2c.h"
 #include "cpprl/algorithms/algorithm.h"
+#include "cpprl/algorithms/lagged_updater.h"
 #include "cpprl/algorithms/ppo.h"
 #include "cpprl/distributions/distribution.h"
 #include "cpprl/distributions/categorical.h"
 #include "cpprl/generators/generator.h"
 #include "cpprl/generators/feed_forward_generator.h"
+#include "cpprl/generators/prefetching_generator.h"
+#include "cpprl/hidden_state_cache.h"
+#include "cpprl/image_preprocessor.h"
+#include "cpprl/mapped_file.h"
+#include "cpprl/memory_usage.h"
 #include "cpprl/model/cnn_base.h"
+#include "cpprl/model/impala_cnn_base.h"
 #include "cpprl/model/mlp_base.h"
 #include "cpprl/model/model_utils.h"
 #include "cpprl/model/nn_base.h"
 #include "cpprl/model/output_layers.h"
 #include "cpprl/model/policy.h"
 #include "cpprl/observation_normalizer.h"
+#include "cpprl/optimizers/flat_optimizer.h"
+#include "cpprl/optimizers/fused_adam.h"
+#include "cpprl/optimizers/fused_lamb.h"
+#include "cpprl/optimizers/fused_lars.h"
+#include "cpprl/optimizers/fused_rmsprop.h"
+#include "cpprl/optimizers/make_optimizer.h"
+#include "cpprl/parameter_publisher.h"
+#include "cpprl/pop_art.h"
 #include "cpprl/spaces.h"
-#include "cpprl/storage.h"
\ No newline at end of file
+#include "cpprl/storage.h"
+#include "cpprl/tracer.h"
\ No newline at end of file
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <vector>
+
 #include <torch/torch.h>
 
 #include "cpprl/generators/generator.h"
@@ -10,10 +14,22 @@ class FeedForwardGenerator : public Generator
 {
   private:
     torch::Tensor observations, hidden_states, actions, value_predictions,
-        returns, masks, action_log_probs, advantages, indices;
+        returns, masks, action_log_probs, advantages, indices, rows;
+    // Where each minibatch starts in indices, plus one past the end
+    std::vector<int64_t> batch_starts;
     int index;
+    std::function<void(const torch::Tensor &)> prefetch_callback;
+
+    torch::Tensor get_step_indices(int mini_batch_index) const;
+    torch::Tensor get_stored_indices(int mini_batch_index) const;
 
   public:
+    // returns and advantages are in step order. The others can be stored in
+    // any order, with rows giving the row each step is stored in. If rows is
+    // undefined, they are in step order too.
+    //
+    // Minibatches are mini_batch_size samples each, except the last one, which
+    // gets whatever is left over.
     FeedForwardGenerator(int mini_batch_size,
                          torch::Tensor observations,
                          torch::Tensor hidden_states,
@@ -22,9 +38,27 @@ class FeedForwardGenerator : public Generator
                          torch::Tensor returns,
                          torch::Tensor masks,
                          torch::Tensor action_log_probs,
-                         torch::Tensor advantages);
+                         torch::Tensor advantages,
+                         torch::Tensor rows = torch::Tensor());
+    // One minibatch per element of mini_batch_sizes, which has to add up to
+    // the number of samples. See split_evenly() and split_by_size().
+    FeedForwardGenerator(const std::vector<int64_t> &mini_batch_sizes,
+                         torch::Tensor observations,
+                         torch::Tensor hidden_states,
+                         torch::Tensor actions,
+                         torch::Tensor value_predictions,
+                         torch::Tensor returns,
+                         torch::Tensor masks,
+                         torch::Tensor action_log_probs,
+                         torch::Tensor advantages,
+                         torch::Tensor rows = torch::Tensor());
 
     virtual bool done() const;
     virtual MiniBatch next();
+
+    // callback is given the flattened (row, process) indices the next
+    // minibatch will gather, once before each minibatch is assembled, so they
+    // can be paged in ahead of time
+    void set_prefetch_callback(std::function<void(const torch::Tensor &)> callback);
 };
 }
\ No newline at end of file
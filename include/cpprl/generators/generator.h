@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <torch/torch.h>
@@ -40,4 +43,32 @@ class Generator
 };
 
 inline Generator::~Generator() {}
+
+// Splits total into parts sizes that differ by at most one, largest first
+inline std::vector<int64_t> split_evenly(int64_t total, int64_t parts)
+{
+    std::vector<int64_t> sizes;
+    for (int64_t i = 0; i < parts; ++i)
+    {
+        sizes.push_back(total / parts + (i < total % parts ? 1 : 0));
+    }
+    return sizes;
+}
+
+// Splits total into as many parts of size as fit, plus one smaller part for
+// whatever is left over
+inline std::vector<int64_t> split_by_size(int64_t total, int64_t size)
+{
+    if (size <= 0)
+    {
+        throw std::runtime_error("Minibatch size must be positive, not " +
+                                 std::to_string(size));
+    }
+    std::vector<int64_t> sizes(total / size, size);
+    if (total % size != 0)
+    {
+        sizes.push_back(total % size);
+    }
+    return sizes;
+}
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <torch/torch.h>
+
+#include "cpprl/generators/generator.h"
+
+namespace cpprl
+{
+// Wraps other generators, assembling each minibatch on a background thread
+// while the previous one is being trained on. One worker thread makes every
+// minibatch for the generator's lifetime.
+//
+// It can go through a sequence of generators, such as one per epoch, in which
+// case done() and next() only cover the current one until next_generator()
+// is called. The worker makes each generator itself as soon as the previous
+// one runs out, so generators that do all their work up front, like
+// RecurrentGenerator, are made off the training thread while the last
+// minibatch of the previous one is trained on. Only the first generator's
+// setup isn't hidden.
+//
+// Minibatch tensors are made contiguous and staged onto device before they
+// are handed out. Copies from the CPU to a CUDA device go through pinned
+// memory, so they don't hold up the training thread.
+class PrefetchingGenerator : public Generator
+{
+  private:
+    std::function<std::unique_ptr<Generator>()> make_generator;
+    int num_generators;
+    // The generator being read from, and the one ready_mini_batch came from
+    int generator_index, ready_generator_index;
+    torch::Device device;
+    mutable std::mutex mutex;
+    mutable std::condition_variable ready_condition;
+    std::condition_variable taken_condition;
+    // The next minibatch, once the worker has made it
+    std::unique_ptr<MiniBatch> ready_mini_batch;
+    std::exception_ptr error;
+    bool finished, stopping;
+    std::thread worker;
+
+    void run();
+    MiniBatch stage(MiniBatch mini_batch) const;
+
+  public:
+    PrefetchingGenerator(std::unique_ptr<Generator> generator, torch::Device device);
+    // Goes through num_generators generators made by make_generator, which is
+    // called on the worker thread
+    PrefetchingGenerator(std::function<std::unique_ptr<Generator>()> make_generator,
+                         int num_generators,
+                         torch::Device device);
+    ~PrefetchingGenerator();
+
+    // Waits for the worker if it hasn't decided yet
+    virtual bool done() const;
+    virtual MiniBatch next();
+    // Moves on to the next generator's minibatches
+    void next_generator();
+};
+}
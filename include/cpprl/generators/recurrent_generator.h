@@ -1,17 +1,30 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include <torch/torch.h>
 
 #include "cpprl/generators/generator.h"
 
 namespace cpprl
 {
+// Splits the processes into num_mini_batch groups, which don't have to be the
+// same size if num_processes isn't divisible by num_mini_batch.
+//
+// The rollout is gathered once on construction into group-major order, with
+// each group stored as (timestep, process) rows. Every minibatch is then just
+// a contiguous slice of the gathered tensors.
 class RecurrentGenerator : public Generator
 {
   private:
     torch::Tensor observations, hidden_states, actions, value_predictions,
-        returns, masks, action_log_probs, advantages, indices;
-    int index, num_envs_per_batch;
+        returns, masks, action_log_probs, advantages;
+    // The first process of each group in the gathered tensors, plus one past
+    // the end
+    std::vector<int64_t> group_starts;
+    int index;
+    int64_t num_steps;
 
   public:
     RecurrentGenerator(int num_processes,
@@ -24,8 +37,19 @@ class RecurrentGenerator : public Generator
                        torch::Tensor masks,
                        torch::Tensor action_log_probs,
                        torch::Tensor advantages);
+    // One group per element of group_sizes, which has to add up to the number
+    // of processes
+    RecurrentGenerator(const std::vector<int64_t> &group_sizes,
+                       torch::Tensor observations,
+                       torch::Tensor hidden_states,
+                       torch::Tensor actions,
+                       torch::Tensor value_predictions,
+                       torch::Tensor returns,
+                       torch::Tensor masks,
+                       torch::Tensor action_log_probs,
+                       torch::Tensor advantages);
 
     virtual bool done() const;
     virtual MiniBatch next();
 };
-}
\ No newline at end of file
+}
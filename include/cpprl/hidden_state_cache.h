@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <torch/torch.h>
+
+namespace cpprl
+{
+// Keeps recurrent hidden states for many independent clients, such as
+// clients of a policy server, so they don't have to send them with every
+// request.
+//
+// States live in one {capacity, hidden_size} slab on the policy's device.
+// get_slots() maps a batch of client keys to rows of the slab, which can then
+// be gathered into a batch for act() and the new states scattered back, with
+// no per-client copies. When the slab is full, new clients take the slot of
+// the least recently used client.
+class HiddenStateCache
+{
+  private:
+    struct Entry
+    {
+        int64_t slot;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    torch::Tensor slab;
+    // Most recently used first
+    std::list<std::string> lru_keys;
+    std::unordered_map<std::string, Entry> entries;
+    std::vector<int64_t> free_slots;
+
+  public:
+    HiddenStateCache(int64_t capacity,
+                     int64_t hidden_size,
+                     torch::Device device = torch::kCPU);
+
+    void clear();
+    // Forgets key, e.g. when a client disconnects
+    void erase(const std::string &key);
+    torch::Tensor gather(const torch::Tensor &slots) const;
+    // Returns the slot of each key as a long tensor on the cache's device,
+    // marking them as most recently used. New keys start with a zeroed state,
+    // and so do keys whose element of resets is true. A key can appear more
+    // than once, but there can't be more different keys than the capacity.
+    torch::Tensor get_slots(const std::vector<std::string> &keys,
+                            const std::vector<bool> &resets = {});
+    void scatter(const torch::Tensor &slots, const torch::Tensor &hidden_states);
+
+    inline int64_t get_capacity() const { return slab.size(0); }
+    inline bool contains(const std::string &key) const { return entries.count(key) > 0; }
+    inline int64_t size() const { return static_cast<int64_t>(entries.size()); }
+};
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <torch/torch.h>
+
+namespace cpprl
+{
+// Elementwise max of a and b, for removing flickering between frames
+void elementwise_max(const uint8_t *a, const uint8_t *b, uint8_t *output, int64_t size);
+// Interleaved RGB to grayscale with the same weights as OpenCV
+void rgb_to_grayscale(const uint8_t *rgb, uint8_t *gray, int64_t num_pixels);
+
+// Turns raw RGB frames from an environment into CNN inputs, like the
+// DeepMind Atari wrappers do in Python: the max of the last two frames,
+// converted to grayscale, area resized to 84x84, and transposed to CHW.
+// Everything stays uint8, to go straight into a byte RolloutStorage.
+//
+// Uses SSE2, plus SSSE3 on CPUs that have it, and splits batches of frames
+// over ATen's threads.
+class ImagePreprocessor
+{
+  private:
+    // Input pixels that make up each output pixel along one axis
+    struct AreaWeight
+    {
+        int64_t source;
+        float weight;
+    };
+    std::vector<std::vector<AreaWeight>> row_weights, column_weights;
+    int64_t input_height, input_width, output_height, output_width;
+    bool grayscale;
+
+    void check_frames(const torch::Tensor &frames) const;
+    void process_frame(const uint8_t *frame,
+                       const uint8_t *previous_frame,
+                       uint8_t *output,
+                       std::vector<uint8_t> &max_buffer,
+                       std::vector<uint8_t> &gray_buffer,
+                       std::vector<float> &row_buffer) const;
+    // Resizes one channel of an image with pixel_stride channels per pixel
+    // into a planar output
+    void resize_channel(const uint8_t *input,
+                        int64_t pixel_stride,
+                        uint8_t *output,
+                        std::vector<float> &row_buffer) const;
+
+  public:
+    // Meant for downscaling. Upscaling works, but is closer to nearest
+    // neighbour than to OpenCV's bilinear.
+    ImagePreprocessor(int64_t input_height,
+                      int64_t input_width,
+                      int64_t output_height = 84,
+                      int64_t output_width = 84,
+                      bool grayscale = true);
+
+    // frames is a uint8 {batch, height, width, 3} tensor of RGB frames. If
+    // previous_frames is given, each pixel is the max of the two frames.
+    // Returns a uint8 {batch, channels, output height, output width} tensor.
+    torch::Tensor process(const torch::Tensor &frames,
+                          const torch::Tensor &previous_frames = torch::Tensor()) const;
+    // Like process(), but writes into output, which can be a view into a
+    // bigger tensor, such as one slot of a frame stack
+    void process(const torch::Tensor &frames,
+                 const torch::Tensor &previous_frames,
+                 torch::Tensor output) const;
+
+    inline int64_t get_num_channels() const { return grayscale ? 1 : 3; }
+};
+}
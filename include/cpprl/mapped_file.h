@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <c10/util/ArrayRef.h>
+#include <torch/torch.h>
+
+namespace cpprl
+{
+// A file mapped into memory, so tensors much larger than RAM can be paged in
+// and out by the OS.
+class MappedFile : public std::enable_shared_from_this<MappedFile>
+{
+  private:
+    void *data;
+    size_t size;
+
+    MappedFile(void *data, size_t size);
+
+  public:
+    // Creates (or truncates) the file at path, sized to hold size bytes. The
+    // file is unlinked once mapped, so it doesn't outlive the mapping.
+    static std::shared_ptr<MappedFile> create(const std::string &path, size_t size);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // A float tensor over the start of the file. Keeps the mapping alive for as
+    // long as the tensor (or any view of it) is.
+    torch::Tensor as_tensor(c10::IntArrayRef shape);
+    // Asks the OS to start reading [offset, offset + length) in, without
+    // waiting for it
+    void prefetch(size_t offset, size_t length) const;
+
+    inline size_t get_size() const { return size; }
+};
+}
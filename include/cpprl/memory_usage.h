@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// Bytes held by one named part of something, e.g. one tensor of a
+// RolloutStorage
+struct MemoryUsage
+{
+    std::string name;
+    int64_t bytes;
+};
+
+// Bytes optimizer's state (Adam moments, RMSprop averages, etc.) takes up.
+// libtorch optimizers create their state on the first step, so this is 0
+// before then. Fused optimizers create it up front.
+int64_t get_optimizer_state_bytes(const torch::optim::Adam &optimizer);
+int64_t get_optimizer_state_bytes(const torch::optim::RMSprop &optimizer);
+int64_t get_optimizer_state_bytes(const FlatOptimizer &optimizer);
+// Bytes the elements of tensor take up. Views only count the elements they
+// cover, and undefined tensors count as 0.
+int64_t get_tensor_bytes(const torch::Tensor &tensor);
+int64_t get_tensor_bytes(const std::vector<torch::Tensor> &tensors);
+int64_t get_total_bytes(const std::vector<MemoryUsage> &usage);
+}
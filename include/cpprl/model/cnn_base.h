@@ -14,15 +14,29 @@ class CnnBase : public NNBase
 {
   private:
     nn::Sequential main;
+    nn::Sequential actor;
+    nn::Sequential critic;
     nn::Sequential critic_linear;
+    unsigned int num_inputs;
+    unsigned int num_shared_layers;
 
   public:
+    // num_shared_layers is the number of layers (3 convolutions, then the
+    // hidden linear layer) that the actor and critic share. By default the
+    // whole trunk is shared. Recurrent bases have to share every layer, and
+    // throw otherwise.
     CnnBase(unsigned int num_inputs,
             bool recurrent = false,
-            unsigned int hidden_size = 512);
+            unsigned int hidden_size = 512,
+            int num_shared_layers = share_all_layers);
 
     std::vector<torch::Tensor> forward(torch::Tensor inputs,
                                        torch::Tensor hxs,
                                        torch::Tensor masks);
+    // Per-channel statistics
+    std::vector<int64_t> get_normalizer_shape() const;
+    bool transform_value_output(torch::Tensor scale, torch::Tensor shift);
+
+    inline unsigned int get_num_shared_layers() const { return num_shared_layers; }
 };
-}
\ No newline at end of file
+}
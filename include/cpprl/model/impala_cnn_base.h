@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/model/nn_base.h"
+
+using namespace torch;
+
+namespace cpprl
+{
+// Two 3x3 convolutions with a skip connection, as used in IMPALA
+class ResidualBlockImpl : public nn::Module
+{
+  private:
+    nn::Conv2d conv_1, conv_2;
+
+  public:
+    explicit ResidualBlockImpl(unsigned int channels);
+
+    torch::Tensor forward(torch::Tensor x);
+};
+TORCH_MODULE(ResidualBlock);
+
+// A convolution, a downsampling step and two residual blocks
+class ImpalaStageImpl : public nn::Module
+{
+  private:
+    nn::Conv2d conv;
+    ResidualBlock residual_block_1, residual_block_2;
+    bool use_max_pool;
+
+  public:
+    ImpalaStageImpl(unsigned int in_channels,
+                    unsigned int out_channels,
+                    bool use_max_pool = true);
+
+    torch::Tensor forward(torch::Tensor x);
+};
+TORCH_MODULE(ImpalaStage);
+
+// https://arxiv.org/abs/1802.01561
+class ImpalaCnnBase : public NNBase
+{
+  private:
+    nn::Sequential stages;
+    nn::Linear linear;
+    nn::Linear critic_linear;
+    std::vector<int64_t> observation_shape;
+    bool channels_last;
+
+  public:
+    // observation_shape is {channels, height, width}. Any resolution is
+    // supported, the size of the flattened convolution output is worked out at
+    // construction. Without max pooling, each stage downsamples with a strided
+    // convolution instead. channels_last stores activations in NHWC order,
+    // which is usually faster for small batches on CPU.
+    ImpalaCnnBase(std::vector<int64_t> observation_shape,
+                  bool recurrent = false,
+                  unsigned int hidden_size = 256,
+                  std::vector<int64_t> stage_channels = {16, 32, 32},
+                  bool use_max_pool = true,
+                  bool channels_last = false);
+
+    std::vector<torch::Tensor> forward(torch::Tensor inputs,
+                                       torch::Tensor hxs,
+                                       torch::Tensor masks);
+    // Per-channel statistics
+    std::vector<int64_t> get_normalizer_shape() const;
+    bool transform_value_output(torch::Tensor scale, torch::Tensor shift);
+
+    inline const std::vector<int64_t> &get_observation_shape() const
+    {
+        return observation_shape;
+    }
+};
+}
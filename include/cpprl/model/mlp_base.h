@@ -13,20 +13,40 @@ namespace cpprl
 class MlpBase : public NNBase
 {
   private:
+    nn::Sequential trunk;
     nn::Sequential actor;
     nn::Sequential critic;
     nn::Linear critic_linear;
     unsigned int num_inputs;
+    unsigned int num_shared_layers;
+    // First layer weights with an input transform folded in, one per entry in
+    // get_input_towers()
+    std::vector<torch::Tensor> folded_weights, folded_biases;
+
+    torch::Tensor forward_tower(nn::Sequential &tower,
+                                torch::Tensor x,
+                                int folded_index);
+    std::vector<nn::Sequential> get_input_towers() const;
 
   public:
+    // num_shared_layers is the number of hidden layers (counting from the
+    // input) that the actor and critic share. 0 gives fully separate towers,
+    // share_all_layers gives a single trunk feeding both heads.
     MlpBase(unsigned int num_inputs,
             bool recurrent = false,
-            unsigned int hidden_size = 64);
+            unsigned int hidden_size = 64,
+            int num_shared_layers = 0);
 
+    void clear_input_transform();
+    // Only supported for non-recurrent bases, where the first layer is Linear
+    bool fold_input_transform(torch::Tensor scale, torch::Tensor shift);
     std::vector<torch::Tensor> forward(torch::Tensor inputs,
                                        torch::Tensor hxs,
                                        torch::Tensor masks);
+    std::vector<int64_t> get_normalizer_shape() const;
+    bool transform_value_output(torch::Tensor scale, torch::Tensor shift);
 
     inline unsigned int get_num_inputs() const { return num_inputs; }
+    inline unsigned int get_num_shared_layers() const { return num_shared_layers; }
 };
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <utility>
 #include <vector>
 
 #include <torch/torch.h>
@@ -14,7 +15,42 @@ struct FlattenImpl : nn::Module
 };
 TORCH_MODULE(Flatten);
 
+// Orthogonally initializes many weights at once, with one batched QR
+// factorization per weight shape rather than one per weight. add() only
+// records the weight, which isn't touched until run().
+class OrthogonalInitializer
+{
+  private:
+    std::vector<std::pair<torch::Tensor, double>> weights;
+
+  public:
+    void add(torch::Tensor weight, double gain);
+    void add(const OrthogonalInitializer &other);
+    void run();
+
+    inline bool empty() const { return weights.empty(); }
+};
+
+// While one of these is alive, init_weights() calls on the same thread leave
+// their weights to initializer instead of initializing them straight away
+class DeferOrthogonalInit
+{
+  private:
+    OrthogonalInitializer *previous;
+
+  public:
+    explicit DeferOrthogonalInit(OrthogonalInitializer &initializer);
+    ~DeferOrthogonalInit();
+
+    DeferOrthogonalInit(const DeferOrthogonalInit &) = delete;
+    DeferOrthogonalInit &operator=(const DeferOrthogonalInit &) = delete;
+};
+
 void init_weights(torch::OrderedDict<std::string, torch::Tensor> parameters,
                   double weight_gain,
                   double bias_gain);
+// Changes linear's weights in place, so its output y becomes y * scale + shift
+void transform_linear_output(nn::LinearImpl &linear,
+                             torch::Tensor scale,
+                             torch::Tensor shift);
 }
\ No newline at end of file
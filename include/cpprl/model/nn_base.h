@@ -8,6 +8,10 @@ using namespace torch;
 
 namespace cpprl
 {
+// Pass as num_shared_layers to a base to share every hidden layer between the
+// actor and the critic.
+constexpr int share_all_layers = -1;
+
 class NNBase : public nn::Module
 {
   private:
@@ -15,18 +19,39 @@ class NNBase : public nn::Module
     unsigned int hidden_size;
     bool recurrent;
 
+  protected:
+    // Set when inputs arrive already standardized by an observation
+    // normalizer, in which case bases skip their own input scaling
+    bool normalized_inputs;
+
   public:
     NNBase(bool recurrent,
            unsigned int recurrent_input_size,
            unsigned int hidden_size);
 
+    virtual void clear_input_transform();
+    // Folds an elementwise affine transform of the inputs (inputs * scale +
+    // shift) into the base's first layer, which forward() then uses whenever
+    // gradients are disabled. Returns false if the base can't do this.
+    virtual bool fold_input_transform(torch::Tensor scale, torch::Tensor shift);
     virtual std::vector<torch::Tensor> forward(torch::Tensor inputs,
                                                torch::Tensor hxs,
                                                torch::Tensor masks);
+    // Rescales the critic's last layer so its value output v becomes
+    // v * scale + shift. Returns false if the base can't do this.
+    virtual bool transform_value_output(torch::Tensor scale, torch::Tensor shift);
     std::vector<torch::Tensor> forward_gru(torch::Tensor x,
                                            torch::Tensor hxs,
                                            torch::Tensor masks);
     unsigned int get_hidden_size() const;
+    // Shape of the statistics an observation normalizer should keep for this
+    // base's inputs
+    virtual std::vector<int64_t> get_normalizer_shape() const;
+
+    inline void set_normalized_inputs(bool normalized_inputs)
+    {
+        this->normalized_inputs = normalized_inputs;
+    }
 
     inline int get_output_size() const { return hidden_size; }
     inline bool is_recurrent() const { return recurrent; }
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <memory>
 
 #include <torch/torch.h>
 
+#include "cpprl/memory_usage.h"
 #include "cpprl/model/nn_base.h"
 #include "cpprl/model/output_layers.h"
 #include "cpprl/observation_normalizer.h"
+#include "cpprl/pop_art.h"
 #include "cpprl/spaces.h"
 
 using namespace torch;
@@ -20,16 +24,24 @@ class PolicyImpl : public nn::Module
     ActionSpace action_space;
     std::shared_ptr<NNBase> base;
     ObservationNormalizer observation_normalizer;
+    PopArt pop_art;
     std::shared_ptr<OutputLayer> output_layer;
+    bool fold_observation_normalizer, fold_clip;
+    torch::Tensor fold_lower_bound, fold_upper_bound;
 
     std::vector<torch::Tensor> forward_gru(torch::Tensor x,
                                            torch::Tensor hxs,
                                            torch::Tensor masks);
+    torch::Tensor denormalize_value(torch::Tensor value) const;
+    torch::Tensor normalize_observation(torch::Tensor observation) const;
 
   public:
+    // With use_pop_art, the critic learns PopArt normalized values. The
+    // values the policy outputs are still unnormalized.
     PolicyImpl(ActionSpace action_space,
                std::shared_ptr<NNBase> base,
-               bool normalize_observations = false);
+               bool normalize_observations = false,
+               bool use_pop_art = false);
 
     std::vector<torch::Tensor> act(torch::Tensor inputs,
                                    torch::Tensor rnn_hxs,
@@ -38,13 +50,41 @@ class PolicyImpl : public nn::Module
                                                 torch::Tensor rnn_hxs,
                                                 torch::Tensor masks,
                                                 torch::Tensor actions) const;
+    // Parameters, their gradients, and buffers such as the observation
+    // normalizer's statistics
+    std::vector<MemoryUsage> get_memory_usage() const;
     torch::Tensor get_probs(torch::Tensor inputs,
                             torch::Tensor rnn_hxs,
                             torch::Tensor masks) const;
     torch::Tensor get_values(torch::Tensor inputs,
                              torch::Tensor rnn_hxs,
                              torch::Tensor masks) const;
+    // Scales errors between returns and values into the critic's normalized
+    // space, for the value loss. Does nothing without PopArt.
+    torch::Tensor normalize_value_errors(torch::Tensor errors) const;
+    // Also republishes and refolds the loaded observation normalizer
+    void load(torch::serialize::InputArchive &archive) override;
+    // Republishes the normalizer's statistics and refolds them. Needed if the
+    // normalizer's buffers are overwritten directly, e.g. by
+    // ParameterPublisher::fetch().
+    void refresh_observation_normalizer();
+    // Recomputes the base's folded first layer. Done automatically by
+    // update_observation_normalizer(), but needs to be called by hand if the
+    // weights change any other way while folding is enabled.
+    void refresh_observation_normalizer_folding();
+    // While enabled, act() and get_values() under a NoGradGuard skip the
+    // normalization pass, with the normalizer folded into the base's first
+    // layer instead. Clipping is kept as a clamp on the raw observations unless
+    // clip is false, in which case outlying observations aren't clipped.
+    void set_observation_normalizer_folding(bool enabled, bool clip = true);
+    // Also refolds the observation normalizer onto the new device
+    void to(torch::Device device, torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Device device, bool non_blocking = false) override;
     void update_observation_normalizer(torch::Tensor observations);
+    // Adds returns to PopArt's statistics, rescaling the critic so the values
+    // it outputs don't change. Call before training on them.
+    void update_pop_art(torch::Tensor returns);
 
     inline bool is_recurrent() const { return base->is_recurrent(); }
     inline unsigned int get_hidden_size() const
@@ -55,6 +95,22 @@ class PolicyImpl : public nn::Module
     {
         return !observation_normalizer.is_empty();
     }
+    inline bool is_folding_observation_normalizer() const
+    {
+        return fold_observation_normalizer;
+    }
+    inline bool using_pop_art() const { return !pop_art.is_empty(); }
 };
 TORCH_MODULE(Policy);
+
+// Calls make_policy(i) for each i in [0, count) in parallel. Orthogonal
+// weight initialization is deferred until every policy has been made, then
+// done in one go with a batched QR factorization per weight shape.
+//
+// make_policy is called from several threads at once, so it has to be
+// thread-safe. The orthogonal weights are drawn in index order, so which
+// policy gets which of them doesn't depend on thread scheduling. Anything
+// else make_policy draws from the global RNG does.
+std::vector<Policy> make_policies(int64_t count,
+                                  const std::function<Policy(int64_t)> &make_policy);
 }
\ No newline at end of file
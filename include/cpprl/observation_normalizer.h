@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <vector>
 
+#include <c10/util/ArrayRef.h>
 #include <torch/torch.h>
 
 #include "cpprl/running_mean_std.h"
@@ -10,26 +13,61 @@ namespace cpprl
 {
 class ObservationNormalizer;
 
+// Frozen copy of a normalizer's statistics. Snapshots are never modified after
+// they are published, so actors can keep using one while the normalizer is
+// being updated on another thread.
+struct ObservationNormalizerSnapshot
+{
+    torch::Tensor scale, shift;
+    float clip;
+    uint64_t version;
+
+    torch::Tensor process_observation(torch::Tensor observation) const;
+};
+
 class ObservationNormalizerImpl : public torch::nn::Module
 {
   private:
     torch::Tensor clip;
     RunningMeanStd rms;
+    std::shared_ptr<const ObservationNormalizerSnapshot> snapshot;
+    uint64_t version;
 
   public:
     explicit ObservationNormalizerImpl(int size, float clip = 10.);
+    // See RunningMeanStd for how shape determines which statistics are kept
+    explicit ObservationNormalizerImpl(c10::IntArrayRef shape, float clip = 10.);
     ObservationNormalizerImpl(const std::vector<float> &means,
                               const std::vector<float> &variances,
                               float clip = 10.);
     explicit ObservationNormalizerImpl(const std::vector<ObservationNormalizer> &others);
 
+    // Uses the latest snapshot, so it is safe to call while another thread
+    // calls update()
     torch::Tensor process_observation(torch::Tensor observation) const;
+    // The normalization (before clipping) as observation * scale + shift.
+    // Returns {scale, shift}.
+    std::vector<torch::Tensor> get_affine_transform() const;
     std::vector<float> get_mean() const;
+    std::vector<int64_t> get_shape() const;
+    // Atomically grabs the latest published statistics, without locking
+    std::shared_ptr<const ObservationNormalizerSnapshot> get_snapshot() const;
     std::vector<float> get_variance() const;
+    void load(torch::serialize::InputArchive &archive) override;
+    // Publishes a new snapshot of the current statistics. Only needs calling
+    // by hand if the statistics are changed other than through update() or
+    // load(). Not safe to call from more than one thread at once.
+    void publish_snapshot();
+    // Moving the normalizer republishes its snapshot, so the statistics
+    // aren't copied to the observations' device on every call
+    void to(torch::Device device, torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Device device, bool non_blocking = false) override;
     void update(torch::Tensor observations);
 
     inline float get_clip_value() const { return clip.item().toFloat(); }
     inline int get_step_count() const { return rms->get_count(); }
+    inline uint64_t get_version() const { return get_snapshot()->version; }
 };
 TORCH_MODULE(ObservationNormalizer);
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <torch/torch.h>
+
+namespace cpprl
+{
+// Base for optimizers that keep all their parameters, gradients and state in
+// flat buffers, so a step is one multithreaded loop over every element
+// instead of several kernels per parameter tensor.
+//
+// The parameters and their gradients are turned into views of the flat
+// buffers. If any of them are replaced, e.g. by loading a model or moving it
+// to another device, the buffers are rebuilt on the next zero_grad() or
+// step(), keeping the optimizer state.
+class FlatOptimizer
+{
+  private:
+    std::vector<torch::Tensor> parameters;
+    std::vector<int64_t> offsets;
+    std::vector<torch::Tensor> state;
+
+    void check_flat();
+    void flatten();
+
+  protected:
+    torch::Tensor flat_parameters, flat_gradients;
+    float learning_rate;
+    int64_t step_count;
+
+    // Each state buffer has one element per parameter element
+    FlatOptimizer(std::vector<torch::Tensor> parameters,
+                  float learning_rate,
+                  int num_state_buffers);
+
+    // Updates flat_parameters from flat_gradients. step_count has already
+    // been incremented.
+    virtual void update() = 0;
+
+    // Squared L2 norm of each parameter's part of buffer, which is laid out
+    // like flat_parameters. For layer-wise optimizers.
+    std::vector<double> get_squared_norms(const torch::Tensor &buffer) const;
+    // Calls function(parameter index, begin, end) in parallel on ranges of
+    // flat buffer elements. No range crosses from one parameter into another.
+    // CPU only.
+    void parallel_for_parameters(const std::function<void(int64_t, int64_t, int64_t)> &function) const;
+
+    // Where each parameter starts in the flat buffers, plus the total size at
+    // the end
+    inline const std::vector<int64_t> &get_offsets() const { return offsets; }
+    inline torch::Tensor &get_state(int index) { return state[index]; }
+
+  public:
+    virtual ~FlatOptimizer() = default;
+
+    void step();
+    void zero_grad();
+
+    inline float get_learning_rate() const { return learning_rate; }
+    inline const std::vector<torch::Tensor> &get_state() const { return state; }
+    inline int64_t get_step_count() const { return step_count; }
+    inline void set_learning_rate(float learning_rate) { this->learning_rate = learning_rate; }
+};
+}
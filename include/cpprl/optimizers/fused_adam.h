@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// Adam, as in torch::optim::Adam without AMSGrad or weight decay, with all
+// parameters updated in one pass
+class FusedAdam : public FlatOptimizer
+{
+  private:
+    float beta1, beta2, epsilon;
+
+  protected:
+    void update() override;
+
+  public:
+    FusedAdam(std::vector<torch::Tensor> parameters,
+              float learning_rate,
+              float beta1 = 0.9,
+              float beta2 = 0.999,
+              float epsilon = 1e-8);
+};
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// https://arxiv.org/abs/1904.00962
+//
+// Adam with a layer-wise trust ratio. Each parameter tensor's update is
+// rescaled to ||weights|| / ||update||, so the step size relative to each
+// layer's weights is the same, which keeps large batches stable.
+class FusedLamb : public FlatOptimizer
+{
+  private:
+    float beta1, beta2, epsilon, weight_decay;
+
+  protected:
+    void update() override;
+
+  public:
+    FusedLamb(std::vector<torch::Tensor> parameters,
+              float learning_rate,
+              float beta1 = 0.9,
+              float beta2 = 0.999,
+              float epsilon = 1e-6,
+              float weight_decay = 0);
+};
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// https://arxiv.org/abs/1708.03888
+//
+// SGD with momentum and a layer-wise learning rate. Each parameter tensor's
+// learning rate is scaled by trust_coefficient * ||weights|| / ||gradient||.
+class FusedLars : public FlatOptimizer
+{
+  private:
+    float momentum, weight_decay, trust_coefficient, epsilon;
+
+  protected:
+    void update() override;
+
+  public:
+    FusedLars(std::vector<torch::Tensor> parameters,
+              float learning_rate,
+              float momentum = 0.9,
+              float weight_decay = 0,
+              float trust_coefficient = 0.001,
+              float epsilon = 1e-8);
+};
+}
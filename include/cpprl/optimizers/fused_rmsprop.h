@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// RMSprop, as in torch::optim::RMSprop without centering or weight decay,
+// with all parameters updated in one pass
+class FusedRMSprop : public FlatOptimizer
+{
+  private:
+    float alpha, epsilon, momentum;
+
+  protected:
+    void update() override;
+
+  public:
+    FusedRMSprop(std::vector<torch::Tensor> parameters,
+                 float learning_rate,
+                 float alpha = 0.99,
+                 float epsilon = 1e-8,
+                 float momentum = 0);
+};
+}
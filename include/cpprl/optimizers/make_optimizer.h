@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+
+namespace cpprl
+{
+// Makes a fused optimizer by name: "Adam", "LAMB", "LARS" or "RMSprop". Any
+// other hyperparameters are left at their defaults.
+//
+// LARS's learning rate is on a different scale from the others. With its
+// default trust coefficient of 0.001, each step moves a layer's weights by
+// about learning_rate * 0.001 of their norm, so it needs learning rates
+// around 1, where Adam would use around 1e-3.
+std::unique_ptr<FlatOptimizer> make_optimizer(const std::string &name,
+                                              std::vector<torch::Tensor> parameters,
+                                              float learning_rate,
+                                              float epsilon = 1e-8);
+}
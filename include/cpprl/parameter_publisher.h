@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/model/policy.h"
+
+namespace cpprl
+{
+// Broadcasts a learner's Policy weights to actor threads.
+//
+// The learner calls publish() after each update. Actors each keep their own
+// Policy copy and call fetch() at step boundaries, so act() never touches
+// shared state. Parameters and buffers (including the observation normalizer's
+// statistics) are flattened into one of two CPU slots. Each slot is guarded
+// by a sequence lock, and publishing alternates between them, so readers only
+// retry if the learner publishes twice during a single fetch().
+//
+// Only one thread may publish at a time. Any number of threads can fetch.
+class ParameterPublisher
+{
+  private:
+    struct Slot
+    {
+        torch::Tensor data;
+        std::atomic<uint64_t> sequence;
+    };
+
+    std::array<Slot, 2> slots;
+    std::atomic<uint64_t> version;
+    std::vector<int64_t> tensor_sizes;
+
+    static std::vector<torch::Tensor> get_tensors(const Policy &policy);
+    void check_layout(const std::vector<torch::Tensor> &tensors) const;
+
+  public:
+    // Sizes the slots to fit policy, and publishes its current weights
+    explicit ParameterPublisher(const Policy &policy);
+
+    // Copies the latest weights into policy if they are newer than
+    // current_version, which is then updated to match what was copied.
+    // Returns whether anything was copied.
+    bool fetch(Policy &policy, uint64_t &current_version) const;
+    void publish(const Policy &policy);
+
+    inline uint64_t get_version() const { return version.load(std::memory_order_acquire); }
+};
+}
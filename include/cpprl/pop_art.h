@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/running_mean_std.h"
+
+namespace cpprl
+{
+// https://arxiv.org/abs/1602.07714
+//
+// Adaptive value target normalization. The critic learns normalized values,
+// which denormalize() turns back into returns. update() adds a batch of
+// returns to the running statistics, and gives the transform the critic's
+// last layer needs to keep its denormalized outputs the same.
+class PopArtImpl : public torch::nn::Module
+{
+  private:
+    RunningMeanStd rms;
+    float min_scale;
+
+  public:
+    explicit PopArtImpl(float min_scale = 1e-4);
+
+    torch::Tensor denormalize(torch::Tensor values) const;
+    // The standard deviation of the returns, no smaller than min_scale
+    torch::Tensor get_scale() const;
+    torch::Tensor normalize(torch::Tensor returns) const;
+    // Returns {scale, shift}. The critic's normalized output v has to become
+    // v * scale + shift after this to denormalize to the same value.
+    std::vector<torch::Tensor> update(torch::Tensor returns);
+
+    inline torch::Tensor get_mean() const { return rms->get_mean(); }
+};
+TORCH_MODULE(PopArt);
+}
@@ -2,11 +2,16 @@
 
 #include <vector>
 
+#include <c10/util/ArrayRef.h>
 #include <torch/torch.h>
 
 namespace cpprl
 {
 // https://github.com/openai/baselines/blob/master/baselines/common/running_mean_std.py
+//
+// Statistics are kept for the trailing dimensions of whatever is passed to
+// update(). Size 1 dimensions of the statistics are reduced over as well, so a
+// {channels, 1, 1} shape keeps per-channel statistics for images.
 class RunningMeanStdImpl : public torch::nn::Module
 {
   private:
@@ -18,12 +23,16 @@ class RunningMeanStdImpl : public torch::nn::Module
 
   public:
     explicit RunningMeanStdImpl(int size);
-    RunningMeanStdImpl(std::vector<float> means, std::vector<float> variances);
+    explicit RunningMeanStdImpl(c10::IntArrayRef shape);
+    RunningMeanStdImpl(std::vector<float> means,
+                       std::vector<float> variances,
+                       c10::IntArrayRef shape = {});
 
     void update(torch::Tensor observation);
 
     inline int get_count() const { return static_cast<int>(count.item().toFloat()); }
     inline torch::Tensor get_mean() const { return mean.clone(); }
+    inline std::vector<int64_t> get_shape() const { return mean.sizes().vec(); }
     inline torch::Tensor get_variance() const { return variance.clone(); }
     inline void set_count(int count) { this->count[0] = count + 1e-8; }
 };
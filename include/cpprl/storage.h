@@ -1,23 +1,69 @@
 #pragma once
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <c10/util/ArrayRef.h>
 #include <torch/torch.h>
 
 #include "cpprl/generators/generator.h"
+#include "cpprl/mapped_file.h"
+#include "cpprl/memory_usage.h"
 #include "cpprl/spaces.h"
 
 namespace cpprl
 {
+// Everything but the returns is packed into one {num_steps + 1, processes,
+// record size} buffer. Each row holds the observation, hidden state and mask
+// for that step, followed by the action, action log prob, value prediction
+// and reward, so insert() only needs two copies. The per-field tensors are
+// views into it.
+//
+// Byte observations, such as preprocessed images, are kept in their own uint8
+// tensor instead, which takes a quarter of the memory. Policies convert them
+// to floats on the way in.
+//
+// The buffer is circular. Step 0 is stored in row first_row, and after_update()
+// just moves first_row to the last step's row instead of copying it back. The
+// get_*s() getters return the rollout in step order, which copies the whole
+// field once the rollout wraps around the end of the buffer, so treat them as
+// read-only: writes through them are lost after the first after_update(). Use
+// the per-step getters while collecting.
 class RolloutStorage
 {
   private:
-    torch::Tensor observations, hidden_states, rewards, value_predictions,
-        returns, action_log_probs, actions, masks;
+    torch::Tensor records, observations, hidden_states, rewards,
+        value_predictions, returns, action_log_probs, actions, masks,
+        td_residuals;
     torch::Device device;
-    int64_t num_steps;
-    int64_t step;
+    std::vector<int64_t> observation_shape;
+    int64_t num_steps, observation_size, hidden_state_size, num_actions;
+    int64_t step, first_row;
+    bool byte_observations, discrete_actions, incremental_gae;
+    float incremental_gamma;
+    std::shared_ptr<MappedFile> mapped_file;
+
+    void check_window(int64_t start, int64_t length) const;
+    // Rows [start, start + length) of field in step order
+    torch::Tensor get_steps(const torch::Tensor &field, int64_t start, int64_t length) const;
+    void make_field_views();
+    // The buffer rows that steps [start, start + length) are stored in
+    torch::Tensor rows(int64_t start, int64_t length) const;
+    void set_steps(torch::Tensor &field, const torch::Tensor &values);
+
+    // How much of each record the observation takes up
+    inline int64_t get_packed_observation_size() const
+    {
+        return byte_observations ? 0 : observation_size;
+    }
+
+    // Negative steps count back from the end of the rollout, like tensor indices
+    inline int64_t row(int64_t step) const
+    {
+        auto num_rows = num_steps + 1;
+        return (first_row + (step % num_rows) + num_rows) % num_rows;
+    }
 
   public:
     RolloutStorage(int64_t num_steps,
@@ -25,17 +71,55 @@ class RolloutStorage
                    c10::ArrayRef<int64_t> obs_shape,
                    ActionSpace action_space,
                    int64_t hidden_state_size,
-                   torch::Device device);
+                   torch::Device device,
+                   torch::Dtype observation_dtype = torch::kFloat);
 
     RolloutStorage(std::vector<RolloutStorage *> individual_storages, torch::Device device);
 
+    // What get_memory_usage() would report for a storage made with these
+    // arguments, without making one
+    static std::vector<MemoryUsage> estimate_memory_usage(int64_t num_steps,
+                                                          int64_t num_processes,
+                                                          c10::ArrayRef<int64_t> obs_shape,
+                                                          ActionSpace action_space,
+                                                          int64_t hidden_state_size,
+                                                          torch::Dtype observation_dtype = torch::kFloat,
+                                                          bool incremental_gae = false);
+
     void after_update();
     void compute_returns(torch::Tensor next_value,
                          bool use_gae,
                          float gamma,
                          float tau);
+    // Computes the returns for steps [start, start + length) only, treating
+    // the window as if the rollout ended there. next_value is the value
+    // prediction for step start + length, so windows can be finalized as soon
+    // as that step is inserted, before the rest of the rollout is collected.
+    void compute_returns(torch::Tensor next_value,
+                         bool use_gae,
+                         float gamma,
+                         float tau,
+                         int64_t start,
+                         int64_t length);
+    // Like after_update(), but starts this storage from where previous left
+    // off. For alternating between storages.
+    void continue_from(const RolloutStorage &previous);
     std::unique_ptr<Generator> feed_forward_generator(torch::Tensor advantages,
                                                       int num_mini_batch);
+    // Generates minibatches from steps [start, start + length) only.
+    // advantages should only cover the window.
+    std::unique_ptr<Generator> feed_forward_generator(torch::Tensor advantages,
+                                                      int num_mini_batch,
+                                                      int64_t start,
+                                                      int64_t length);
+    // One minibatch per element of mini_batch_sizes, which has to add up to
+    // the number of samples in the window. See split_by_size().
+    std::unique_ptr<Generator> feed_forward_generator(torch::Tensor advantages,
+                                                      const std::vector<int64_t> &mini_batch_sizes,
+                                                      int64_t start,
+                                                      int64_t length);
+    // Bytes held by each field. The packed fields add up to the whole buffer.
+    std::vector<MemoryUsage> get_memory_usage() const;
     void insert(torch::Tensor observation,
                 torch::Tensor hidden_state,
                 torch::Tensor action,
@@ -45,30 +129,67 @@ class RolloutStorage
                 torch::Tensor mask);
     std::unique_ptr<Generator> recurrent_generator(torch::Tensor advantages,
                                                    int num_mini_batch);
+    std::unique_ptr<Generator> recurrent_generator(torch::Tensor advantages,
+                                                   int num_mini_batch,
+                                                   int64_t start,
+                                                   int64_t length);
+    // One minibatch per element of group_sizes, each that many whole
+    // processes. They have to add up to the number of processes.
+    std::unique_ptr<Generator> recurrent_generator(torch::Tensor advantages,
+                                                   const std::vector<int64_t> &group_sizes,
+                                                   int64_t start,
+                                                   int64_t length);
+    // Moves the buffer into a memory mapped file at path, so the OS can page
+    // out parts of the rollout that aren't being used. Byte observations stay
+    // in memory. CPU storages only.
+    //
+    // Only the feed-forward generator prefetches the rows each minibatch
+    // needs ahead of time. The recurrent generator gathers the whole window
+    // when it's made, faulting pages in one at a time as it goes.
+    void map_to_file(const std::string &path);
     void set_first_observation(torch::Tensor observation);
+    // While enabled, insert() computes each step's TD residual as soon as the
+    // next step's value prediction arrives, leaving only the backward pass for
+    // compute_returns(). Only used by compute_returns() with GAE and the same
+    // gamma, otherwise the returns are computed from scratch as usual.
+    void set_incremental_gae(bool enabled, float gamma = 0.99);
     void to(torch::Device device);
 
-    inline const torch::Tensor &get_actions() const { return actions; }
-    inline const torch::Tensor &get_action_log_probs() const { return action_log_probs; }
-    inline const torch::Tensor &get_hidden_states() const { return hidden_states; }
-    inline const torch::Tensor &get_masks() const { return masks; }
-    inline const torch::Tensor &get_observations() const { return observations; }
+    // Discrete actions are stored as floats, and converted back here
+    inline torch::Tensor get_actions() const
+    {
+        auto step_actions = get_steps(actions, 0, num_steps);
+        return discrete_actions ? step_actions.to(torch::kLong) : step_actions;
+    }
+    inline int64_t get_num_steps() const { return num_steps; }
+    inline torch::Tensor get_action_log_probs() const { return get_steps(action_log_probs, 0, num_steps); }
+    inline torch::Tensor get_hidden_states() const { return get_steps(hidden_states, 0, num_steps + 1); }
+    inline torch::Tensor get_masks() const { return get_steps(masks, 0, num_steps + 1); }
+    inline torch::Tensor get_observations() const { return get_steps(observations, 0, num_steps + 1); }
     inline const torch::Tensor &get_returns() const { return returns; }
-    inline const torch::Tensor &get_rewards() const { return rewards; }
-    inline const torch::Tensor &get_value_predictions() const
+    inline torch::Tensor get_rewards() const { return get_steps(rewards, 0, num_steps); }
+    inline torch::Tensor get_value_predictions() const
     {
-        return value_predictions;
+        return get_steps(value_predictions, 0, num_steps + 1);
     }
-    inline void set_actions(torch::Tensor actions) { this->actions = actions; }
-    inline void set_action_log_probs(torch::Tensor action_log_probs) { this->action_log_probs = action_log_probs; }
-    inline void set_hidden_states(torch::Tensor hidden_states) { this->hidden_states = hidden_states; }
-    inline void set_masks(torch::Tensor masks) { this->masks = masks; }
-    inline void set_observations(torch::Tensor observations) { this->observations = observations; }
+
+    // Views of a single step, without copying
+    inline torch::Tensor get_hidden_state(int64_t step) const { return hidden_states[row(step)]; }
+    inline torch::Tensor get_mask(int64_t step) const { return masks[row(step)]; }
+    inline torch::Tensor get_observation(int64_t step) const { return observations[row(step)]; }
+    inline torch::Tensor get_value_prediction(int64_t step) const { return value_predictions[row(step)]; }
+
+    // The setters copy into the packed buffer, so shapes have to match
+    inline void set_actions(torch::Tensor actions) { set_steps(this->actions, actions); }
+    inline void set_action_log_probs(torch::Tensor action_log_probs) { set_steps(this->action_log_probs, action_log_probs); }
+    inline void set_hidden_states(torch::Tensor hidden_states) { set_steps(this->hidden_states, hidden_states); }
+    inline void set_masks(torch::Tensor masks) { set_steps(this->masks, masks); }
+    inline void set_observations(torch::Tensor observations) { set_steps(this->observations, observations); }
     inline void set_returns(torch::Tensor returns) { this->returns = returns; }
-    inline void set_rewards(torch::Tensor rewards) { this->rewards = rewards; }
+    inline void set_rewards(torch::Tensor rewards) { set_steps(this->rewards, rewards); }
     inline void set_value_predictions(torch::Tensor value_predictions)
     {
-        this->value_predictions = value_predictions;
+        set_steps(this->value_predictions, value_predictions);
     }
 };
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace cpprl
+{
+// Records a timeline of what each thread was doing, to save as a Chrome trace
+// (open it in chrome://tracing or Perfetto). Spans are recorded with
+// TraceSpan, and optionally every ATen op through the autograd profiler.
+//
+// Off until start() is called. While off, a TraceSpan only costs an atomic
+// load.
+class Tracer
+{
+  private:
+    struct Event
+    {
+        std::string name, category;
+        int64_t start_us, duration_us;
+        // ATen ops go in their own process, since the profiler numbers
+        // threads differently
+        int process, thread;
+    };
+
+    std::atomic<bool> enabled;
+    // Guarded by control_mutex, along with aten_start, so start() and stop()
+    // can be called from any thread
+    bool tracing_aten_ops;
+    std::chrono::steady_clock::time_point origin, aten_start;
+    std::mutex control_mutex;
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+    std::unordered_map<std::thread::id, int> thread_numbers;
+
+    Tracer();
+
+    int get_thread_number(std::thread::id id);
+    void record_aten_ops();
+
+  public:
+    static Tracer &get();
+
+    // Drops everything recorded so far
+    void clear();
+    void record(const std::string &name,
+                const std::string &category,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end);
+    // Writes everything recorded so far to path as Chrome trace JSON
+    void save(const std::string &path) const;
+    // ATen op tracing slows everything down a lot, so trace short periods
+    void start(bool trace_aten_ops = false);
+    void stop();
+
+    inline bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+    inline std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return events.size();
+    }
+};
+
+// Records a span on the global Tracer from construction until end() or
+// destruction, whichever comes first
+class TraceSpan
+{
+  private:
+    const char *name, *category;
+    std::chrono::steady_clock::time_point start;
+    bool active;
+
+  public:
+    explicit TraceSpan(const char *name, const char *category = "cpprl");
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    void end();
+};
+}
@@ -0,0 +1,65 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+#include <torch/torch.h>
+
+#include <cpprl/cpprl.h>
+
+#include "server.h"
+
+using namespace cpprl;
+using namespace policy_server;
+
+// Server hyperparameters
+const std::string url = "tcp://*:10202";
+const int max_batch_size = 256;
+const std::chrono::milliseconds max_latency(5);
+const int64_t max_clients = 100000; // Recurrent policies only
+
+// Model hyperparameters. Have to match the model being served.
+const std::vector<int64_t> observation_shape{8};
+const std::string action_space_type = "Discrete";
+const std::vector<int64_t> action_space_shape{4};
+const int hidden_size = 64;
+const bool recurrent = false;
+const bool use_cuda = false;
+const bool use_pop_art = false;
+
+int main(int argc, char *argv[])
+{
+    spdlog::set_level(spdlog::level::debug);
+    spdlog::set_pattern("%^[%T %7l] %v%$");
+
+    torch::Device device = use_cuda ? torch::kCUDA : torch::kCPU;
+
+    std::shared_ptr<NNBase> base;
+    if (observation_shape.size() == 1)
+    {
+        base = std::make_shared<MlpBase>(observation_shape[0], recurrent, hidden_size);
+    }
+    else
+    {
+        base = std::make_shared<CnnBase>(observation_shape[0], recurrent, hidden_size);
+    }
+    Policy policy(ActionSpace{action_space_type, action_space_shape}, base, true, use_pop_art);
+    if (argc > 1)
+    {
+        spdlog::info("Loading model from {}", argv[1]);
+        torch::load(policy, argv[1]);
+    }
+    else
+    {
+        spdlog::warn("No model given, serving an untrained policy");
+    }
+    policy->to(device);
+    policy->eval();
+
+    spdlog::info("Serving on {}", url);
+    Server server(policy, url, observation_shape, max_batch_size, max_latency,
+                  max_clients, device);
+    server.run();
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+namespace policy_server
+{
+// One observation from one client. episode_start resets the client's hidden
+// state, and should be set on the first observation of every episode.
+struct ActRequest
+{
+    std::vector<float> observation;
+    bool episode_start;
+    MSGPACK_DEFINE_MAP(observation, episode_start);
+};
+
+// error is empty unless the request couldn't be served
+struct ActResponse
+{
+    std::vector<float> action;
+    float value;
+    std::string error;
+    MSGPACK_DEFINE_MAP(action, value, error);
+};
+}
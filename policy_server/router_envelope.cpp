@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "router_envelope.h"
+#include "third_party/doctest.h"
+
+namespace policy_server
+{
+RouterEnvelope RouterEnvelope::from_frames(const std::vector<std::string> &frames,
+                                           std::string &payload)
+{
+    if (frames.size() < 2)
+    {
+        throw std::runtime_error("Expected an identity frame and a payload, got " +
+                                 std::to_string(frames.size()) + " frames");
+    }
+
+    RouterEnvelope envelope;
+    envelope.identity = frames.front();
+    envelope.delimited = std::any_of(frames.begin() + 1, frames.end() - 1,
+                                     [](const std::string &frame) { return frame.empty(); });
+    payload = frames.back();
+    return envelope;
+}
+
+std::vector<std::string> RouterEnvelope::to_frames(const std::string &payload) const
+{
+    if (delimited)
+    {
+        return {identity, "", payload};
+    }
+    return {identity, payload};
+}
+
+TEST_CASE("RouterEnvelope")
+{
+    std::string payload;
+
+    SUBCASE("REQ clients' messages are delimited")
+    {
+        auto envelope = RouterEnvelope::from_frames({"client", "", "data"}, payload);
+
+        CHECK(envelope.identity == "client");
+        CHECK(envelope.delimited);
+        CHECK(payload == "data");
+        CHECK(envelope.to_frames("reply") == std::vector<std::string>{"client", "", "reply"});
+    }
+
+    SUBCASE("DEALER clients' messages aren't delimited")
+    {
+        auto envelope = RouterEnvelope::from_frames({"client", "data"}, payload);
+
+        CHECK(envelope.identity == "client");
+        CHECK(!envelope.delimited);
+        CHECK(payload == "data");
+        CHECK(envelope.to_frames("reply") == std::vector<std::string>{"client", "reply"});
+    }
+
+    SUBCASE("Throws without a payload")
+    {
+        CHECK_THROWS(RouterEnvelope::from_frames({"client"}, payload));
+    }
+}
+}
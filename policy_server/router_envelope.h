@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace policy_server
+{
+// The frames a ZMQ ROUTER socket sees for one message. REQ clients put an
+// empty delimiter frame between their identity and the payload and expect one
+// in the reply, DEALER clients don't.
+struct RouterEnvelope
+{
+    std::string identity;
+    bool delimited;
+
+    // Returns the envelope, and sets payload to the last frame
+    static RouterEnvelope from_frames(const std::vector<std::string> &frames,
+                                      std::string &payload);
+    std::vector<std::string> to_frames(const std::string &payload) const;
+};
+}
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+#include <spdlog/spdlog.h>
+#include <torch/torch.h>
+
+#include "server.h"
+#include "requests.h"
+#include "third_party/zmq.hpp"
+
+namespace policy_server
+{
+Server::Server(cpprl::Policy &policy,
+               const std::string &url,
+               const std::vector<int64_t> &observation_shape,
+               int max_batch_size,
+               std::chrono::milliseconds max_latency,
+               int64_t max_clients,
+               torch::Device device)
+    : batcher(policy, observation_shape, max_batch_size, max_latency, max_clients, device),
+      next_tag(0),
+      running(false)
+{
+    context = std::make_unique<zmq::context_t>(1);
+    socket = std::make_unique<zmq::socket_t>(*context, ZMQ_ROUTER);
+    socket->bind(url.c_str());
+}
+
+bool Server::receive_request()
+{
+    zmq::message_t frame;
+    if (!socket->recv(&frame, ZMQ_DONTWAIT))
+    {
+        return false;
+    }
+    auto received = std::chrono::steady_clock::now();
+    std::vector<std::string> frames{std::string(static_cast<char *>(frame.data()), frame.size())};
+    while (frame.more())
+    {
+        socket->recv(&frame);
+        frames.emplace_back(static_cast<char *>(frame.data()), frame.size());
+    }
+
+    RouterEnvelope envelope;
+    std::string payload;
+    ActRequest request;
+    try
+    {
+        envelope = RouterEnvelope::from_frames(frames, payload);
+        auto object_handle = msgpack::unpack(payload.data(), payload.size());
+        object_handle.get().convert(request);
+    }
+    catch (const std::exception &exception)
+    {
+        spdlog::error("Couldn't read request: {}", exception.what());
+        if (frames.size() < 2)
+        {
+            // Nowhere to send a reply
+            return true;
+        }
+        ActResponse response;
+        response.value = 0;
+        response.error = "Couldn't read request";
+        send_message(envelope, response);
+        return true;
+    }
+
+    auto tag = next_tag++;
+    envelopes[tag] = envelope;
+    send_responses(batcher.add({envelope.identity,
+                                std::move(request.observation),
+                                request.episode_start,
+                                received,
+                                tag}));
+    return true;
+}
+
+void Server::run()
+{
+    running = true;
+    while (running)
+    {
+        // Sleep until the oldest request's deadline, or until a request
+        // arrives if there aren't any. Wake up regularly to check for stop().
+        auto timeout = batcher.get_timeout(std::chrono::steady_clock::now()).count();
+        timeout = timeout < 0 ? 100 : std::min<long>(timeout, 100);
+        zmq::pollitem_t items[] = {{static_cast<void *>(*socket), 0, ZMQ_POLLIN, 0}};
+        zmq::poll(items, 1, timeout);
+
+        // The batcher would flush a full batch itself once the next request
+        // arrives, but stopping here answers it without waiting for one
+        while (!batcher.is_full() && receive_request())
+        {
+        }
+
+        if (batcher.is_ready(std::chrono::steady_clock::now()))
+        {
+            send_responses(batcher.flush());
+        }
+    }
+}
+
+void Server::send_message(const RouterEnvelope &envelope,
+                          const ActResponse &response)
+{
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, response);
+
+    auto frames = envelope.to_frames(std::string(buffer.data(), buffer.size()));
+    for (unsigned int i = 0; i < frames.size(); ++i)
+    {
+        zmq::message_t message(frames[i].size());
+        std::memcpy(message.data(), frames[i].data(), frames[i].size());
+        socket->send(message, i + 1 < frames.size() ? ZMQ_SNDMORE : 0);
+    }
+}
+
+void Server::send_responses(const std::vector<cpprl::ActBatcher::Response> &responses)
+{
+    for (const auto &batch_response : responses)
+    {
+        auto envelope = envelopes.find(batch_response.tag);
+        ActResponse response;
+        response.action = batch_response.action;
+        response.value = batch_response.value;
+        response.error = batch_response.error;
+        send_message(envelope->second, response);
+        envelopes.erase(envelope);
+    }
+}
+
+void Server::stop()
+{
+    running = false;
+}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprl/cpprl.h>
+
+#include "requests.h"
+#include "router_envelope.h"
+#include "third_party/zmq.hpp"
+
+namespace policy_server
+{
+// Serves actions from a Policy to many clients over a ZMQ ROUTER socket.
+//
+// Clients connect with REQ or DEALER sockets and send one msgpacked
+// ActRequest at a time. The batching itself is done by a cpprl::ActBatcher,
+// this class only moves messages between it and the socket.
+class Server
+{
+  private:
+    std::unique_ptr<zmq::context_t> context;
+    std::unique_ptr<zmq::socket_t> socket;
+    cpprl::ActBatcher batcher;
+    // Where to send the reply to each request the batcher hasn't answered
+    std::unordered_map<uint64_t, RouterEnvelope> envelopes;
+    uint64_t next_tag;
+    std::atomic<bool> running;
+
+    bool receive_request();
+    void send_message(const RouterEnvelope &envelope, const ActResponse &response);
+    void send_responses(const std::vector<cpprl::ActBatcher::Response> &responses);
+
+  public:
+    Server(cpprl::Policy &policy,
+           const std::string &url,
+           const std::vector<int64_t> &observation_shape,
+           int max_batch_size,
+           std::chrono::milliseconds max_latency,
+           int64_t max_clients,
+           torch::Device device);
+
+    // Serves requests until stop() is called
+    void run();
+    void stop();
+};
+}
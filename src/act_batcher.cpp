@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/act_batcher.h"
+#include "cpprl/hidden_state_cache.h"
+#include "cpprl/model/mlp_base.h"
+#include "cpprl/model/policy.h"
+#include "cpprl/spaces.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+ActBatcher::ActBatcher(Policy &policy,
+                       const std::vector<int64_t> &observation_shape,
+                       int max_batch_size,
+                       std::chrono::milliseconds max_latency,
+                       int64_t max_clients,
+                       torch::Device device)
+    : policy(policy),
+      device(device),
+      observation_shape(observation_shape),
+      observation_size(1),
+      max_batch_size(max_batch_size),
+      max_latency(max_latency),
+      // Feed-forward policies still need zeroed hidden states for act()
+      hidden_states(policy->is_recurrent()
+                        ? std::max<int64_t>(max_clients, max_batch_size)
+                        : max_batch_size,
+                    policy->get_hidden_size(),
+                    device)
+{
+    for (const auto dimension : observation_shape)
+    {
+        observation_size *= dimension;
+    }
+}
+
+std::vector<ActBatcher::Response> ActBatcher::add(Request request)
+{
+    auto size = static_cast<int64_t>(request.observation.size());
+    if (size != observation_size)
+    {
+        Response response;
+        response.client = request.client;
+        response.tag = request.tag;
+        response.value = 0;
+        response.error = "Expected an observation of size " +
+                         std::to_string(observation_size) + ", got " +
+                         std::to_string(size);
+        return {response};
+    }
+
+    std::vector<Response> responses;
+    auto same_client = [&request](const Request &other) {
+        return other.client == request.client;
+    };
+    if (is_full() || std::any_of(pending.begin(), pending.end(), same_client))
+    {
+        responses = flush();
+    }
+    pending.push_back(std::move(request));
+    return responses;
+}
+
+std::vector<ActBatcher::Response> ActBatcher::flush()
+{
+    if (pending.empty())
+    {
+        return {};
+    }
+    std::vector<Request> batch;
+    batch.swap(pending);
+
+    // Gather the batch
+    auto batch_size = static_cast<int64_t>(batch.size());
+    auto shape = observation_shape;
+    shape.insert(shape.begin(), batch_size);
+    auto observations = torch::empty(shape);
+    auto masks = torch::ones({batch_size, 1});
+    auto flat_observations = observations.view({batch_size, -1});
+    std::vector<std::string> clients;
+    std::vector<bool> episode_starts;
+    for (int64_t i = 0; i < batch_size; ++i)
+    {
+        const auto &request = batch[i];
+        std::memcpy(flat_observations[i].data_ptr<float>(),
+                    request.observation.data(),
+                    observation_size * sizeof(float));
+        if (request.episode_start)
+        {
+            masks[i] = 0;
+        }
+        clients.push_back(request.client);
+        episode_starts.push_back(request.episode_start);
+    }
+    auto slots = hidden_states.get_slots(clients, episode_starts);
+    auto hidden = hidden_states.gather(slots);
+
+    std::vector<torch::Tensor> act_result;
+    {
+        torch::NoGradGuard no_grad;
+        act_result = policy->act(observations.to(device),
+                                 hidden,
+                                 masks.to(device));
+    }
+    auto values = act_result[0].cpu();
+    auto actions = act_result[1].to(torch::kCPU, torch::kFloat).view({batch_size, -1});
+
+    // Scatter the results
+    if (policy->is_recurrent())
+    {
+        hidden_states.scatter(slots, act_result[3]);
+    }
+    std::vector<Response> responses(batch_size);
+    for (int64_t i = 0; i < batch_size; ++i)
+    {
+        auto &response = responses[i];
+        response.client = batch[i].client;
+        response.tag = batch[i].tag;
+        auto action = actions[i];
+        response.action.assign(action.data_ptr<float>(),
+                               action.data_ptr<float>() + action.numel());
+        response.value = values[i][0].item().toFloat();
+    }
+    return responses;
+}
+
+std::chrono::milliseconds ActBatcher::get_timeout(std::chrono::steady_clock::time_point now) const
+{
+    if (pending.empty())
+    {
+        return std::chrono::milliseconds(-1);
+    }
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        pending.front().received + max_latency - now);
+    return std::max(std::chrono::milliseconds(0), remaining);
+}
+
+bool ActBatcher::is_ready(std::chrono::steady_clock::time_point now) const
+{
+    return !pending.empty() &&
+           (is_full() || now >= pending.front().received + max_latency);
+}
+
+TEST_CASE("ActBatcher")
+{
+    auto base = std::make_shared<MlpBase>(3, true, 4);
+    Policy policy(ActionSpace{"Discrete", {2}}, base);
+    ActBatcher batcher(policy, {3}, 3, std::chrono::milliseconds(5), 10, torch::kCPU);
+    auto start = std::chrono::steady_clock::now();
+    auto make_request = [&](const std::string &client, uint64_t tag, bool episode_start = false) {
+        return ActBatcher::Request{client, {0.1f, 0.2f, 0.3f}, episode_start, start, tag};
+    };
+
+    SUBCASE("Acts on a whole batch at once")
+    {
+        CHECK(batcher.add(make_request("a", 0)).empty());
+        CHECK(batcher.add(make_request("b", 1)).empty());
+        CHECK(!batcher.is_ready(start));
+        CHECK(batcher.add(make_request("c", 2)).empty());
+        CHECK(batcher.is_full());
+        CHECK(batcher.is_ready(start));
+
+        auto responses = batcher.flush();
+
+        REQUIRE(responses.size() == 3);
+        for (uint64_t i = 0; i < responses.size(); ++i)
+        {
+            CHECK(responses[i].tag == i);
+            CHECK(responses[i].action.size() == 1);
+            CHECK(responses[i].error.empty());
+        }
+        CHECK(responses[1].client == "b");
+        CHECK(batcher.size() == 0);
+    }
+
+    SUBCASE("Batches are ready once the oldest request's deadline passes")
+    {
+        CHECK(batcher.get_timeout(start) == std::chrono::milliseconds(-1));
+
+        batcher.add(make_request("a", 0));
+        batcher.add(make_request("b", 1));
+
+        CHECK(batcher.get_timeout(start) == std::chrono::milliseconds(5));
+        CHECK(batcher.get_timeout(start + std::chrono::milliseconds(2)) == std::chrono::milliseconds(3));
+        CHECK(!batcher.is_ready(start + std::chrono::milliseconds(4)));
+        CHECK(batcher.is_ready(start + std::chrono::milliseconds(5)));
+        CHECK(batcher.get_timeout(start + std::chrono::milliseconds(8)) == std::chrono::milliseconds(0));
+    }
+
+    SUBCASE("A second request from the same client flushes the queue first")
+    {
+        batcher.add(make_request("a", 0));
+        batcher.add(make_request("b", 1));
+        auto responses = batcher.add(make_request("a", 2));
+
+        REQUIRE(responses.size() == 2);
+        CHECK(responses[0].tag == 0);
+        CHECK(responses[1].tag == 1);
+        CHECK(batcher.size() == 1);
+    }
+
+    SUBCASE("Adding to a full batch flushes it first")
+    {
+        auto feed_forward_base = std::make_shared<MlpBase>(3, false, 4);
+        Policy feed_forward_policy(ActionSpace{"Discrete", {2}}, feed_forward_base);
+        ActBatcher feed_forward_batcher(feed_forward_policy, {3}, 2,
+                                        std::chrono::milliseconds(5), 10, torch::kCPU);
+        feed_forward_batcher.add(make_request("a", 0));
+        feed_forward_batcher.add(make_request("b", 1));
+        auto responses = feed_forward_batcher.add(make_request("c", 2));
+
+        REQUIRE(responses.size() == 2);
+        CHECK(responses[0].tag == 0);
+        CHECK(responses[1].tag == 1);
+        CHECK(feed_forward_batcher.size() == 1);
+    }
+
+    SUBCASE("Requests with the wrong observation size get an error straight away")
+    {
+        auto responses = batcher.add(ActBatcher::Request{"a", {1, 2}, false, start, 7});
+
+        REQUIRE(responses.size() == 1);
+        CHECK(responses[0].tag == 7);
+        CHECK(responses[0].error == "Expected an observation of size 3, got 2");
+        CHECK(batcher.size() == 0);
+    }
+
+    SUBCASE("Keeps each client's hidden state between batches")
+    {
+        batcher.add(make_request("a", 0, true));
+        auto first_value = batcher.flush()[0].value;
+        batcher.add(make_request("a", 1));
+        auto second_value = batcher.flush()[0].value;
+        batcher.add(make_request("a", 2, true));
+        auto reset_value = batcher.flush()[0].value;
+
+        CHECK(second_value != doctest::Approx(first_value));
+        CHECK(reset_value == doctest::Approx(first_value));
+    }
+
+    SUBCASE("Flushing an empty queue does nothing")
+    {
+        CHECK(batcher.flush().empty());
+    }
+}
+}
+}
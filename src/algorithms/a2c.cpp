@@ -5,14 +5,35 @@
 
 #include "cpprl/algorithms/a2c.h"
 #include "cpprl/algorithms/algorithm.h"
+#include "cpprl/memory_usage.h"
 #include "cpprl/model/mlp_base.h"
 #include "cpprl/model/policy.h"
+#include "cpprl/optimizers/fused_rmsprop.h"
+#include "cpprl/optimizers/make_optimizer.h"
 #include "cpprl/storage.h"
 #include "cpprl/spaces.h"
+#include "cpprl/tracer.h"
 #include "third_party/doctest.h"
 
 namespace cpprl
 {
+namespace
+{
+// RMSprop is the only optimizer that uses alpha
+std::unique_ptr<FlatOptimizer> make_a2c_optimizer(const std::string &name,
+                                                  std::vector<torch::Tensor> parameters,
+                                                  float learning_rate,
+                                                  float epsilon,
+                                                  float alpha)
+{
+    if (name == "RMSprop")
+    {
+        return std::make_unique<FusedRMSprop>(parameters, learning_rate, alpha, epsilon);
+    }
+    return make_optimizer(name, parameters, learning_rate, epsilon);
+}
+}
+
 A2C::A2C(Policy &policy,
          float actor_loss_coef,
          float value_loss_coef,
@@ -20,23 +41,31 @@ A2C::A2C(Policy &policy,
          float learning_rate,
          float epsilon,
          float alpha,
-         float max_grad_norm)
+         float max_grad_norm,
+         const std::string &optimizer_name)
     : policy(policy),
       actor_loss_coef(actor_loss_coef),
       value_loss_coef(value_loss_coef),
       entropy_coef(entropy_coef),
       max_grad_norm(max_grad_norm),
       original_learning_rate(learning_rate),
-      optimizer(std::make_unique<torch::optim::RMSprop>(
-          policy->parameters(),
-          torch::optim::RMSpropOptions(learning_rate)
-              .eps(epsilon)
-              .alpha(alpha))) {}
+      optimizer(make_a2c_optimizer(optimizer_name,
+                                   policy->parameters(),
+                                   learning_rate,
+                                   epsilon,
+                                   alpha)) {}
+
+std::vector<MemoryUsage> A2C::get_memory_usage() const
+{
+    return {{"optimizer_state", get_optimizer_state_bytes(*optimizer)}};
+}
 
 std::vector<UpdateDatum> A2C::update(RolloutStorage &rollouts, float decay_level)
 {
+    TraceSpan update_span("a2c_update");
+
     // Decay learning rate
-    optimizer->options.learning_rate(original_learning_rate * decay_level);
+    optimizer->set_learning_rate(original_learning_rate * decay_level);
 
     // Prep work
     auto full_obs_shape = rollouts.get_observations().sizes();
@@ -54,6 +83,13 @@ std::vector<UpdateDatum> A2C::update(RolloutStorage &rollouts, float decay_level
         policy->update_observation_normalizer(rollouts.get_observations());
     }
 
+    // Update PopArt's statistics before the critic trains on the returns
+    auto returns = rollouts.get_returns().slice(0, 0, -1);
+    if (policy->using_pop_art())
+    {
+        policy->update_pop_art(returns);
+    }
+
     // Run evaluation on rollouts
     auto evaluate_result = policy->evaluate_actions(
         rollouts.get_observations().slice(0, 0, -1).view(obs_shape),
@@ -65,8 +101,8 @@ std::vector<UpdateDatum> A2C::update(RolloutStorage &rollouts, float decay_level
         {num_steps, num_processes, 1});
 
     // Calculate advantages
-    // Advantages aren't normalized (they are in PPO)
-    auto advantages = rollouts.get_returns().slice(0, 0, -1) - values;
+    // Advantages aren't normalized (they are in PPO), except by PopArt
+    auto advantages = policy->normalize_value_errors(returns - values);
 
     // Value loss
     auto value_loss = advantages.pow(2).mean();
@@ -84,6 +120,10 @@ std::vector<UpdateDatum> A2C::update(RolloutStorage &rollouts, float decay_level
     loss.backward();
     optimizer->step();
 
+    // The observation normalizer was updated before the optimizer step, so any
+    // folded copy of the first layer is out of date
+    policy->refresh_observation_normalizer_folding();
+
     return {{"Value loss", value_loss.item().toFloat()},
             {"Action loss", action_loss.item().toFloat()},
             {"Entropy", evaluate_result[2].item().toFloat()}};
@@ -120,9 +160,9 @@ static void learn_pattern(Policy &policy, RolloutStorage &storage, A2C &a2c)
         {
             torch::NoGradGuard no_grad;
             next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
         storage.compute_returns(next_value, false, 0., 0.9);
@@ -166,9 +206,9 @@ static void learn_game(Policy &policy, RolloutStorage &storage, A2C &a2c)
         {
             torch::NoGradGuard no_grad;
             next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
         storage.compute_returns(next_value, false, 0.1, 0.9);
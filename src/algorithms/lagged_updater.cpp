@@ -0,0 +1,165 @@
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/algorithms/lagged_updater.h"
+#include "cpprl/algorithms/algorithm.h"
+#include "cpprl/algorithms/ppo.h"
+#include "cpprl/model/mlp_base.h"
+#include "cpprl/model/policy.h"
+#include "cpprl/parameter_publisher.h"
+#include "cpprl/storage.h"
+#include "cpprl/spaces.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+LaggedUpdater::LaggedUpdater(Algorithm &algorithm,
+                             Policy &learner_policy,
+                             Policy &actor_policy,
+                             RolloutStorage &first_storage,
+                             RolloutStorage &second_storage)
+    : algorithm(algorithm),
+      learner_policy(learner_policy),
+      actor_policy(actor_policy),
+      storages{{&first_storage, &second_storage}},
+      collecting_index(0),
+      publisher(learner_policy),
+      actor_version(0)
+{
+    publisher.fetch(actor_policy, actor_version);
+}
+
+std::vector<UpdateDatum> LaggedUpdater::update(float decay_level)
+{
+    auto previous_data = wait();
+    publisher.fetch(actor_policy, actor_version);
+
+    auto &collected_storage = *storages[collecting_index];
+    collecting_index = 1 - collecting_index;
+    storages[collecting_index]->continue_from(collected_storage);
+
+    pending_update = std::async(std::launch::async,
+                                [this, &collected_storage, decay_level] {
+                                    auto data = algorithm.update(collected_storage,
+                                                                 decay_level);
+                                    publisher.publish(learner_policy);
+                                    return data;
+                                });
+
+    return previous_data;
+}
+
+std::vector<UpdateDatum> LaggedUpdater::wait()
+{
+    if (!pending_update.valid())
+    {
+        return {};
+    }
+    return pending_update.get();
+}
+
+static void collect(Policy &policy, RolloutStorage &storage)
+{
+    // The reward is the action
+    for (int step = 0; step < 5; ++step)
+    {
+        auto observation = torch::randint(0, 2, {2, 1});
+
+        std::vector<torch::Tensor> act_result;
+        {
+            torch::NoGradGuard no_grad;
+            act_result = policy->act(observation,
+                                     torch::Tensor(),
+                                     torch::ones({2, 1}));
+        }
+        storage.insert(observation,
+                       torch::zeros({2, 5}),
+                       act_result[1],
+                       act_result[2],
+                       act_result[0],
+                       act_result[1],
+                       torch::ones({2, 1}));
+    }
+
+    torch::Tensor next_value;
+    {
+        torch::NoGradGuard no_grad;
+        next_value = policy->get_values(storage.get_observation(-1),
+                                        storage.get_hidden_state(-1),
+                                        storage.get_mask(-1))
+                         .detach();
+    }
+    storage.compute_returns(next_value, false, 0., 0.9);
+}
+
+TEST_CASE("LaggedUpdater")
+{
+    torch::manual_seed(0);
+    ActionSpace space{"Discrete", {2}};
+    Policy learner_policy(space, std::make_shared<MlpBase>(1, false, 5));
+    Policy actor_policy(space, std::make_shared<MlpBase>(1, false, 5));
+    RolloutStorage first_storage(5, 2, {1}, space, 5, torch::kCPU);
+    RolloutStorage second_storage(5, 2, {1}, space, 5, torch::kCPU);
+    PPO ppo(learner_policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+    LaggedUpdater updater(ppo, learner_policy, actor_policy, first_storage, second_storage);
+
+    SUBCASE("Swaps storages, carrying over the last step")
+    {
+        CHECK(&updater.get_storage() == &first_storage);
+        collect(updater.get_actor_policy(), updater.get_storage());
+        updater.update();
+
+        CHECK(&updater.get_storage() == &second_storage);
+        CHECK(torch::equal(second_storage.get_observation(0),
+                           first_storage.get_observations()[-1]));
+        updater.wait();
+    }
+
+    SUBCASE("Actor policy is one update behind")
+    {
+        auto initial_parameters = learner_policy->parameters()[0].clone();
+        CHECK(torch::equal(actor_policy->parameters()[0], initial_parameters));
+
+        collect(updater.get_actor_policy(), updater.get_storage());
+        CHECK(updater.update().empty());
+        collect(updater.get_actor_policy(), updater.get_storage());
+        CHECK(torch::equal(actor_policy->parameters()[0], initial_parameters));
+
+        // Wait for the first update's weights before they change again
+        auto first_update_data = updater.wait();
+        CHECK(!first_update_data.empty());
+        auto first_update_parameters = learner_policy->parameters()[0].clone();
+        updater.update();
+        CHECK(torch::equal(actor_policy->parameters()[0], first_update_parameters));
+        CHECK(!torch::equal(actor_policy->parameters()[0], initial_parameters));
+        updater.wait();
+    }
+
+    SUBCASE("Learns basic pattern")
+    {
+        auto pre_training_probs = learner_policy->get_probs(torch::ones({2, 1}),
+                                                            torch::zeros({2, 5}),
+                                                            torch::ones({2, 1}));
+
+        for (int i = 0; i < 10; ++i)
+        {
+            collect(updater.get_actor_policy(), updater.get_storage());
+            updater.update();
+        }
+        updater.wait();
+
+        auto post_training_probs = learner_policy->get_probs(torch::ones({2, 1}),
+                                                             torch::zeros({2, 5}),
+                                                             torch::ones({2, 1}));
+        INFO("Pre-training probabilities: \n"
+             << pre_training_probs << "\n");
+        INFO("Post-training probabilities: \n"
+             << post_training_probs << "\n");
+        CHECK(post_training_probs[0][1].item().toDouble() >
+              pre_training_probs[0][1].item().toDouble());
+    }
+}
+}
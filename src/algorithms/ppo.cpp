@@ -1,19 +1,89 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include <torch/torch.h>
+#ifdef CPPRL_CUDA
+#include <c10/cuda/CUDACachingAllocator.h>
+#endif
 
 #include "cpprl/algorithms/ppo.h"
 #include "cpprl/algorithms/algorithm.h"
 #include "cpprl/generators/generator.h"
+#include "cpprl/generators/prefetching_generator.h"
+#include "cpprl/memory_usage.h"
 #include "cpprl/model/mlp_base.h"
 #include "cpprl/model/policy.h"
+#include "cpprl/optimizers/make_optimizer.h"
 #include "cpprl/storage.h"
 #include "cpprl/spaces.h"
+#include "cpprl/tracer.h"
 #include "third_party/doctest.h"
 
 namespace cpprl
 {
+namespace
+{
+// Splits mini_batch into micro-batches of at most micro_batch_size samples.
+// Recurrent minibatches are (timestep, process) ordered rows, so they are
+// split by process instead, keeping each sequence whole.
+std::vector<MiniBatch> split_mini_batch(const MiniBatch &mini_batch,
+                                        int64_t micro_batch_size,
+                                        bool recurrent)
+{
+    auto num_rows = mini_batch.returns.size(0);
+    if (micro_batch_size <= 0 || micro_batch_size >= num_rows)
+    {
+        return {mini_batch};
+    }
+
+    std::vector<MiniBatch> micro_batches;
+    if (!recurrent)
+    {
+        for (int64_t start = 0; start < num_rows; start += micro_batch_size)
+        {
+            auto size = std::min(micro_batch_size, num_rows - start);
+            micro_batches.emplace_back(mini_batch.observations.narrow(0, start, size),
+                                       mini_batch.hidden_states.narrow(0, start, size),
+                                       mini_batch.actions.narrow(0, start, size),
+                                       mini_batch.value_predictions.narrow(0, start, size),
+                                       mini_batch.returns.narrow(0, start, size),
+                                       mini_batch.masks.narrow(0, start, size),
+                                       mini_batch.action_log_probs.narrow(0, start, size),
+                                       mini_batch.advantages.narrow(0, start, size));
+        }
+        return micro_batches;
+    }
+
+    auto num_processes = mini_batch.hidden_states.size(0);
+    auto num_steps = num_rows / num_processes;
+    auto processes_per_batch = std::max<int64_t>(1, micro_batch_size / num_steps);
+    auto select_processes = [&](const torch::Tensor &tensor, int64_t first, int64_t count) {
+        auto shape = tensor.sizes().vec();
+        shape[0] = num_processes;
+        shape.insert(shape.begin(), num_steps);
+        auto selected_shape = tensor.sizes().vec();
+        selected_shape[0] = num_steps * count;
+        return tensor.reshape(shape).narrow(1, first, count).reshape(selected_shape);
+    };
+    for (int64_t first = 0; first < num_processes; first += processes_per_batch)
+    {
+        auto count = std::min(processes_per_batch, num_processes - first);
+        micro_batches.emplace_back(select_processes(mini_batch.observations, first, count),
+                                   mini_batch.hidden_states.narrow(0, first, count),
+                                   select_processes(mini_batch.actions, first, count),
+                                   select_processes(mini_batch.value_predictions, first, count),
+                                   select_processes(mini_batch.returns, first, count),
+                                   select_processes(mini_batch.masks, first, count),
+                                   select_processes(mini_batch.action_log_probs, first, count),
+                                   select_processes(mini_batch.advantages, first, count));
+    }
+    return micro_batches;
+}
+}
 
 PPO::PPO(Policy &policy,
          float clip_param,
@@ -25,7 +95,9 @@ PPO::PPO(Policy &policy,
          float learning_rate,
          float epsilon,
          float max_grad_norm,
-         float kl_target)
+         float kl_target,
+         bool prefetch_mini_batches,
+         const std::string &optimizer_name)
     : policy(policy),
       actor_loss_coef(actor_loss_coef),
       value_loss_coef(value_loss_coef),
@@ -36,26 +108,91 @@ PPO::PPO(Policy &policy,
       kl_target(kl_target),
       num_epoch(num_epoch),
       num_mini_batch(num_mini_batch),
-      optimizer(std::make_unique<torch::optim::Adam>(
-          policy->parameters(),
-          torch::optim::AdamOptions(learning_rate)
-              .eps(epsilon))) {}
+      mini_batch_size(0),
+      micro_batch_size(0),
+      mini_batch_bytes(0),
+      prefetch_mini_batches(prefetch_mini_batches),
+      optimizer(make_optimizer(optimizer_name, policy->parameters(), learning_rate, epsilon)) {}
+
+std::vector<MemoryUsage> PPO::get_memory_usage() const
+{
+    return {{"optimizer_state", get_optimizer_state_bytes(*optimizer)},
+            {"mini_batches", mini_batch_bytes}};
+}
+
+void PPO::set_micro_batch_size(int64_t micro_batch_size)
+{
+    if (micro_batch_size < 0)
+    {
+        throw std::runtime_error("Micro-batch size can't be negative");
+    }
+    this->micro_batch_size = micro_batch_size;
+}
+
+void PPO::set_mini_batch_size(int64_t mini_batch_size)
+{
+    if (mini_batch_size < 0)
+    {
+        throw std::runtime_error("Minibatch size can't be negative");
+    }
+    this->mini_batch_size = mini_batch_size;
+}
 
 std::vector<UpdateDatum> PPO::update(RolloutStorage &rollouts, float decay_level)
 {
+    return update_window(rollouts, 0, rollouts.get_num_steps(), decay_level);
+}
+
+std::vector<UpdateDatum> PPO::update_window(RolloutStorage &rollouts,
+                                            int64_t start,
+                                            int64_t length,
+                                            float decay_level)
+{
+    TraceSpan update_span("ppo_update");
+    auto device = policy->parameters()[0].device();
+#ifdef CPPRL_CUDA
+    int64_t start_allocated_bytes = 0;
+    if (device.is_cuda())
+    {
+        c10::cuda::CUDACachingAllocator::resetMaxMemoryAllocated(device.index());
+        start_allocated_bytes = c10::cuda::CUDACachingAllocator::currentMemoryAllocated(device.index());
+    }
+#endif
+
     // Decay lr and clip parameter
     float clip_param = original_clip_param * decay_level;
-    optimizer->options.learning_rate(original_learning_rate * decay_level);
+    optimizer->set_learning_rate(original_learning_rate * decay_level);
 
     // Calculate advantages
     auto returns = rollouts.get_returns();
+    if (policy->using_pop_art())
+    {
+        policy->update_pop_art(returns.narrow(0, start, length));
+    }
     auto value_preds = rollouts.get_value_predictions();
-    auto advantages = (returns.narrow(0, 0, returns.size(0) - 1) -
-                       value_preds.narrow(0, 0, value_preds.size(0) - 1));
+    auto advantages = (returns.narrow(0, start, length) -
+                       value_preds.narrow(0, start, length));
 
     // Normalize advantages
     advantages = (advantages - advantages.mean()) / (advantages.std() + 1e-5);
 
+    // With a minibatch size, every minibatch is that size except the last,
+    // which gets whatever is left over
+    std::vector<int64_t> mini_batch_sizes;
+    if (mini_batch_size > 0)
+    {
+        auto num_processes = advantages.size(1);
+        if (policy->is_recurrent())
+        {
+            auto processes_per_batch = std::max<int64_t>(1, mini_batch_size / length);
+            mini_batch_sizes = split_by_size(num_processes, processes_per_batch);
+        }
+        else
+        {
+            mini_batch_sizes = split_by_size(length * num_processes, mini_batch_size);
+        }
+    }
+
     float total_value_loss = 0;
     float total_action_loss = 0;
     float total_entropy = 0;
@@ -63,100 +200,245 @@ std::vector<UpdateDatum> PPO::update(RolloutStorage &rollouts, float decay_level
     float kl_early_stopped = -1;
     float clip_fraction = 0;
     int num_updates = 0;
+    mini_batch_bytes = 0;
 
-    // Epoch loop
-    for (int epoch = 0; epoch < num_epoch; ++epoch)
-    {
-        // Shuffle rollouts
-        std::unique_ptr<Generator> data_generator;
+    // Shuffle rollouts
+    auto make_generator = [&]() -> std::unique_ptr<Generator> {
         if (policy->is_recurrent())
         {
-            data_generator = rollouts.recurrent_generator(advantages,
-                                                          num_mini_batch);
+            if (!mini_batch_sizes.empty())
+            {
+                return rollouts.recurrent_generator(advantages,
+                                                    mini_batch_sizes,
+                                                    start,
+                                                    length);
+            }
+            return rollouts.recurrent_generator(advantages,
+                                                num_mini_batch,
+                                                start,
+                                                length);
         }
-        else
+        if (!mini_batch_sizes.empty())
+        {
+            return rollouts.feed_forward_generator(advantages,
+                                                   mini_batch_sizes,
+                                                   start,
+                                                   length);
+        }
+        return rollouts.feed_forward_generator(advantages,
+                                               num_mini_batch,
+                                               start,
+                                               length);
+    };
+    // One worker makes every epoch's minibatches, starting on the next epoch
+    // while the last minibatch of the current one is trained on. They're
+    // staged onto the policy's device, which can differ from a storage kept
+    // in host memory.
+    std::unique_ptr<PrefetchingGenerator> prefetcher;
+    if (prefetch_mini_batches)
+    {
+        prefetcher = std::make_unique<PrefetchingGenerator>(make_generator, num_epoch, device);
+    }
+
+    // Epoch loop
+    for (int epoch = 0; epoch < num_epoch; ++epoch)
+    {
+        int64_t epoch_bytes = 0;
+        int64_t largest_mini_batch_bytes = 0;
+
+        std::unique_ptr<Generator> epoch_generator;
+        Generator *data_generator = prefetcher.get();
+        if (!prefetcher)
         {
-            data_generator = rollouts.feed_forward_generator(advantages,
-                                                             num_mini_batch);
+            epoch_generator = make_generator();
+            data_generator = epoch_generator.get();
         }
 
         // Loop through shuffled rollout
         while (!data_generator->done())
         {
+            TraceSpan next_span("next_mini_batch");
             MiniBatch mini_batch = data_generator->next();
+            next_span.end();
+
+            // Recurrent generators gather the whole epoch up front, and the
+            // next epoch's gather overlaps with this one while prefetching.
+            // Feed-forward ones assemble one minibatch at a time, plus the
+            // next one while prefetching.
+            auto bytes = get_tensor_bytes({mini_batch.observations,
+                                           mini_batch.hidden_states,
+                                           mini_batch.actions,
+                                           mini_batch.value_predictions,
+                                           mini_batch.returns,
+                                           mini_batch.masks,
+                                           mini_batch.action_log_probs,
+                                           mini_batch.advantages});
+            epoch_bytes += bytes;
+            largest_mini_batch_bytes = std::max(largest_mini_batch_bytes, bytes);
+            mini_batch_bytes = std::max(mini_batch_bytes,
+                                        (policy->is_recurrent() ? epoch_bytes
+                                                                : largest_mini_batch_bytes) *
+                                            (prefetch_mini_batches ? 2 : 1));
+            TraceSpan mini_batch_span("mini_batch");
+
+            // Gradients are accumulated over micro-batches, each weighted by
+            // its share of the minibatch, so the step is the same as if the
+            // whole minibatch had been evaluated at once
+            auto num_samples = static_cast<float>(mini_batch.returns.size(0));
+            float mini_batch_kl_divergence = 0;
+            float mini_batch_clip_fraction = 0;
+            float mini_batch_value_loss = 0;
+            float mini_batch_action_loss = 0;
+            float mini_batch_entropy = 0;
+            auto micro_batches = split_mini_batch(mini_batch,
+                                                  micro_batch_size,
+                                                  policy->is_recurrent());
+
+            // With several micro-batches, the minibatch's KL divergence is only
+            // known once all of them are evaluated, so it gets a forward-only
+            // pass first rather than wasting backward passes on a minibatch
+            // that stops the update early
+            if (micro_batches.size() > 1)
+            {
+                torch::NoGradGuard no_grad;
+                for (const auto &micro_batch : micro_batches)
+                {
+                    auto weight = micro_batch.returns.size(0) / num_samples;
+                    auto action_log_probs = policy->evaluate_actions(
+                        micro_batch.observations,
+                        micro_batch.hidden_states,
+                        micro_batch.masks,
+                        micro_batch.actions)[1];
+                    mini_batch_kl_divergence += weight *
+                                                (micro_batch.action_log_probs - action_log_probs)
+                                                    .mean()
+                                                    .item()
+                                                    .toFloat();
+                }
+                if (mini_batch_kl_divergence > kl_target * 1.5)
+                {
+                    kl_divergence = mini_batch_kl_divergence;
+                    kl_early_stopped = num_updates;
+                    goto finish_update;
+                }
+            }
 
-            // Run evaluation on minibatch
-            auto evaluate_result = policy->evaluate_actions(
-                mini_batch.observations,
-                mini_batch.hidden_states,
-                mini_batch.masks,
-                mini_batch.actions);
-
-            // Calculate approximate KL divergence for info and early stopping
-            kl_divergence = (mini_batch.action_log_probs - evaluate_result[1])
-                                .mean()
-                                .item()
-                                .toFloat();
-            if (kl_divergence > kl_target * 1.5)
+            optimizer->zero_grad();
+            for (const auto &micro_batch : micro_batches)
             {
-                kl_early_stopped = num_updates;
-                goto finish_update;
+                auto weight = micro_batch.returns.size(0) / num_samples;
+
+                // Run evaluation on micro-batch
+                auto evaluate_result = policy->evaluate_actions(
+                    micro_batch.observations,
+                    micro_batch.hidden_states,
+                    micro_batch.masks,
+                    micro_batch.actions);
+
+                // Calculate approximate KL divergence for info and early
+                // stopping, before the backward pass
+                if (micro_batches.size() == 1)
+                {
+                    mini_batch_kl_divergence = (micro_batch.action_log_probs - evaluate_result[1])
+                                                   .mean()
+                                                   .item()
+                                                   .toFloat();
+                    if (mini_batch_kl_divergence > kl_target * 1.5)
+                    {
+                        kl_divergence = mini_batch_kl_divergence;
+                        kl_early_stopped = num_updates;
+                        goto finish_update;
+                    }
+                }
+
+                // Calculate difference ratio between old and new action probabilites
+                auto ratio = torch::exp(evaluate_result[1] -
+                                        micro_batch.action_log_probs);
+
+                // PPO loss formula
+                auto surr_1 = ratio * micro_batch.advantages;
+                auto surr_2 = (torch::clamp(ratio,
+                                            1.0 - clip_param,
+                                            1.0 + clip_param) *
+                               micro_batch.advantages);
+                mini_batch_clip_fraction += weight * (ratio - 1.0)
+                                                         .abs()
+                                                         .gt(clip_param)
+                                                         .to(torch::kFloat)
+                                                         .mean()
+                                                         .item()
+                                                         .toFloat();
+                auto action_loss = -torch::min(surr_1, surr_2).mean();
+
+                // Value loss
+                auto value_errors = policy->normalize_value_errors(
+                    micro_batch.returns - evaluate_result[0]);
+                auto value_loss = 0.5 * value_errors.pow(2).mean();
+                // TODO: Implement clipped value loss
+
+                // Total loss
+                auto loss = (value_loss * value_loss_coef +
+                             action_loss * actor_loss_coef -
+                             evaluate_result[2] * entropy_coef);
+                (loss * weight).backward();
+
+                mini_batch_value_loss += weight * value_loss.item().toFloat();
+                mini_batch_action_loss += weight * action_loss.item().toFloat();
+                mini_batch_entropy += weight * evaluate_result[2].item().toFloat();
             }
 
-            // Calculate difference ratio between old and new action probabilites
-            auto ratio = torch::exp(evaluate_result[1] -
-                                    mini_batch.action_log_probs);
-
-            // PPO loss formula
-            auto surr_1 = ratio * mini_batch.advantages;
-            auto surr_2 = (torch::clamp(ratio,
-                                        1.0 - clip_param,
-                                        1.0 + clip_param) *
-                           mini_batch.advantages);
-            clip_fraction += (ratio - 1.0)
-                                 .abs()
-                                 .gt(clip_param)
-                                 .to(torch::kFloat)
-                                 .mean()
-                                 .item()
-                                 .toFloat();
-            auto action_loss = -torch::min(surr_1, surr_2).mean();
-
-            // Value loss
-            auto value_loss = 0.5 * (mini_batch.returns - evaluate_result[0])
-                                        .pow(2)
-                                        .mean();
-            // TODO: Implement clipped value loss
-
-            // Total loss
-            auto loss = (value_loss * value_loss_coef +
-                         action_loss * actor_loss_coef -
-                         evaluate_result[2] * entropy_coef);
+            kl_divergence = mini_batch_kl_divergence;
 
             // Step optimizer
-            optimizer->zero_grad();
-            loss.backward();
             // TODO: Implement gradient norm clipping
             optimizer->step();
             num_updates++;
 
-            total_value_loss += value_loss.item().toFloat();
-            total_action_loss += action_loss.item().toFloat();
-            total_entropy += evaluate_result[2].item().toFloat();
+            clip_fraction += mini_batch_clip_fraction;
+            total_value_loss += mini_batch_value_loss;
+            total_action_loss += mini_batch_action_loss;
+            total_entropy += mini_batch_entropy;
+        }
+
+        if (prefetcher)
+        {
+            prefetcher->next_generator();
         }
     }
 
 finish_update:
-    // Update observation normalizer
-    if (policy->using_observation_normalizer())
+    // Stops the worker before the rollout is touched again
+    prefetcher.reset();
+#ifdef CPPRL_CUDA
+    if (device.is_cuda())
+    {
+        // Counts everything the update allocated, not just the minibatches
+        mini_batch_bytes = static_cast<int64_t>(
+                               c10::cuda::CUDACachingAllocator::maxMemoryAllocated(device.index())) -
+                           start_allocated_bytes;
+    }
+#endif
+    // Update observation normalizer once the whole rollout has been seen
+    if (policy->using_observation_normalizer() &&
+        start + length == rollouts.get_num_steps())
     {
         policy->update_observation_normalizer(rollouts.get_observations());
     }
+    else
+    {
+        // The rest of the rollout is still being collected with this policy,
+        // so any folded copy of the first layer has to follow the new weights
+        policy->refresh_observation_normalizer_folding();
+    }
 
-    total_value_loss /= num_updates;
-    total_action_loss /= num_updates;
-    total_entropy /= num_updates;
-    clip_fraction /= num_updates;
+    // The first minibatch can stop the update before any step
+    if (num_updates > 0)
+    {
+        total_value_loss /= num_updates;
+        total_action_loss /= num_updates;
+        total_entropy /= num_updates;
+        clip_fraction /= num_updates;
+    }
 
     if (kl_early_stopped > -1)
     {
@@ -208,9 +490,9 @@ static void learn_pattern(Policy &policy, RolloutStorage &storage, PPO &ppo)
         {
             torch::NoGradGuard no_grad;
             next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
         storage.compute_returns(next_value, false, 0., 0.9);
@@ -254,9 +536,9 @@ static void learn_game(Policy &policy, RolloutStorage &storage, PPO &ppo)
         {
             torch::NoGradGuard no_grad;
             next_value = policy->get_values(
-                                   storage.get_observations()[-1],
-                                   storage.get_hidden_states()[-1],
-                                   storage.get_masks()[-1])
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
                              .detach();
         }
         storage.compute_returns(next_value, false, 0.1, 0.9);
@@ -266,10 +548,211 @@ static void learn_game(Policy &policy, RolloutStorage &storage, PPO &ppo)
     }
 }
 
+static void learn_pattern_streaming(Policy &policy, RolloutStorage &storage, PPO &ppo)
+{
+    // Trains on each 5 step window as soon as the step after it is inserted
+    const int window_size = 5;
+    for (int i = 0; i < 5; ++i)
+    {
+        for (int step = 0; step < storage.get_num_steps(); ++step)
+        {
+            auto observation = torch::randint(0, 2, {2, 1});
+
+            std::vector<torch::Tensor> act_result;
+            {
+                torch::NoGradGuard no_grad;
+                act_result = policy->act(observation,
+                                         torch::Tensor(),
+                                         torch::ones({2, 1}));
+            }
+            auto actions = act_result[1];
+
+            auto rewards = actions;
+            storage.insert(observation,
+                           torch::zeros({2, 5}),
+                           actions,
+                           act_result[2],
+                           act_result[0],
+                           rewards,
+                           torch::ones({2, 1}));
+
+            if (step > 0 && step % window_size == 0)
+            {
+                storage.compute_returns(storage.get_value_prediction(step),
+                                        false, 0., 0.9, step - window_size, window_size);
+                ppo.update_window(storage, step - window_size, window_size);
+            }
+        }
+
+        torch::Tensor next_value;
+        {
+            torch::NoGradGuard no_grad;
+            next_value = policy->get_values(
+                                   storage.get_observation(-1),
+                                   storage.get_hidden_state(-1),
+                                   storage.get_mask(-1))
+                             .detach();
+        }
+        auto last_start = storage.get_num_steps() - window_size;
+        storage.compute_returns(next_value, false, 0., 0.9, last_start, window_size);
+        ppo.update_window(storage, last_start, window_size);
+        storage.after_update();
+    }
+}
+
+// Trains ppo with learn on a game where the reward is the action, and checks
+// that the policy comes to prefer the rewarded action
+static void check_learns_pattern(Policy &policy,
+                                 PPO &ppo,
+                                 void (*learn)(Policy &, RolloutStorage &, PPO &) = learn_pattern)
+{
+    RolloutStorage storage(20, 2, {1}, ActionSpace{"Discrete", {2}}, 5, torch::kCPU);
+    auto get_probs = [&policy] {
+        return policy->get_probs(torch::ones({2, 1}),
+                                 torch::zeros({2, 5}),
+                                 torch::ones({2, 1}));
+    };
+    auto pre_game_probs = get_probs();
+
+    learn(policy, storage, ppo);
+
+    auto post_game_probs = get_probs();
+    INFO("Pre-training probabilities: \n"
+         << pre_game_probs << "\n");
+    INFO("Post-training probabilities: \n"
+         << post_game_probs << "\n");
+    CHECK(post_game_probs[0][1].item().toDouble() >
+          pre_game_probs[0][1].item().toDouble());
+}
+
+// Fills storage with a rollout of random observations and rewards equal to
+// the actions, and computes its returns
+static void collect_rollout(Policy &policy, RolloutStorage &storage)
+{
+    auto num_processes = storage.get_rewards().size(1);
+    storage.set_first_observation(torch::randint(0, 2, {num_processes, 1}));
+    for (int step = 0; step < storage.get_num_steps(); ++step)
+    {
+        std::vector<torch::Tensor> act_result;
+        {
+            torch::NoGradGuard no_grad;
+            act_result = policy->act(storage.get_observation(step),
+                                     storage.get_hidden_state(step),
+                                     storage.get_mask(step));
+        }
+        storage.insert(torch::randint(0, 2, {num_processes, 1}),
+                       act_result[3],
+                       act_result[1],
+                       act_result[2],
+                       act_result[0],
+                       act_result[1].to(torch::kFloat),
+                       torch::ones({num_processes, 1}));
+    }
+    storage.compute_returns(torch::zeros({num_processes, 1}), false, 0.9, 0.9);
+}
+
+static void copy_parameters(Policy &source, Policy &destination)
+{
+    torch::NoGradGuard no_grad;
+    auto source_parameters = source->parameters();
+    auto destination_parameters = destination->parameters();
+    for (unsigned int i = 0; i < source_parameters.size(); ++i)
+    {
+        destination_parameters[i].copy_(source_parameters[i]);
+    }
+}
+
+// Updates both policies on storage with the same shuffling, and checks that
+// they end up with the same weights and update data
+static void check_same_updates(Policy &policy,
+                               PPO &ppo,
+                               Policy &other_policy,
+                               PPO &other_ppo,
+                               RolloutStorage &storage)
+{
+    torch::manual_seed(1);
+    auto data = ppo.update(storage);
+    torch::manual_seed(1);
+    auto other_data = other_ppo.update(storage);
+
+    auto parameters = policy->parameters();
+    auto other_parameters = other_policy->parameters();
+    for (unsigned int i = 0; i < parameters.size(); ++i)
+    {
+        CHECK(torch::allclose(parameters[i], other_parameters[i], 1e-4, 1e-6));
+    }
+    REQUIRE(other_data.size() == data.size());
+    for (unsigned int i = 0; i < data.size(); ++i)
+    {
+        CHECK(other_data[i].value == doctest::Approx(data[i].value).epsilon(1e-4));
+    }
+}
+
 TEST_CASE("PPO")
 {
     torch::manual_seed(0);
+    ActionSpace space{"Discrete", {2}};
+    auto make_policy = [&space](bool recurrent = false) {
+        return Policy(space, std::make_shared<MlpBase>(1, recurrent, 5), false);
+    };
+
     SUBCASE("update() learns basic pattern")
+    {
+        auto policy = make_policy();
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+
+        check_learns_pattern(policy, ppo);
+    }
+
+    SUBCASE("Micro-batches give the same update as whole minibatches")
+    {
+        for (const bool recurrent : {false, true})
+        {
+            CAPTURE(recurrent);
+            auto whole_policy = make_policy(recurrent);
+            auto micro_policy = make_policy(recurrent);
+            copy_parameters(whole_policy, micro_policy);
+            RolloutStorage storage(20, 4, {1}, space, 5, torch::kCPU);
+            collect_rollout(whole_policy, storage);
+
+            PPO whole_ppo(whole_policy, 0.2, 2, 2, 1, 0.5, 1e-3, 0.001);
+            PPO micro_ppo(micro_policy, 0.2, 2, 2, 1, 0.5, 1e-3, 0.001);
+            // 40 sample minibatches in chunks of 7, or 2 process minibatches
+            // one process at a time
+            micro_ppo.set_micro_batch_size(recurrent ? 20 : 7);
+            CHECK_THROWS(micro_ppo.set_micro_batch_size(-1));
+
+            check_same_updates(whole_policy, whole_ppo, micro_policy, micro_ppo, storage);
+        }
+    }
+
+    SUBCASE("Stopping early on the first minibatch doesn't step or divide by zero")
+    {
+        for (const int64_t micro_batch_size : {0, 7})
+        {
+            CAPTURE(micro_batch_size);
+            auto policy = make_policy();
+            RolloutStorage storage(20, 2, {1}, space, 5, torch::kCPU);
+            collect_rollout(policy, storage);
+            auto parameters = policy->parameters()[0].clone();
+
+            // Any KL divergence is over a negative target
+            PPO ppo(policy, 0.2, 3, 2, 1, 0.5, 1e-3, 0.001, 1e-8, 0.5, -1);
+            ppo.set_micro_batch_size(micro_batch_size);
+            auto data = ppo.update(storage);
+
+            CHECK(torch::equal(policy->parameters()[0], parameters));
+            for (const auto &datum : data)
+            {
+                CAPTURE(datum.name);
+                CHECK(std::isfinite(datum.value));
+            }
+            CHECK(data.back().name == "KL divergence early stop update");
+            CHECK(data.back().value == 0);
+        }
+    }
+
+    SUBCASE("Reports its memory usage")
     {
         auto base = std::make_shared<MlpBase>(1, false, 5);
         ActionSpace space{"Discrete", {2}};
@@ -277,27 +760,130 @@ TEST_CASE("PPO")
         RolloutStorage storage(20, 2, {1}, space, 5, torch::kCPU);
         PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
 
-        // The reward is the action
-        auto pre_game_probs = policy->get_probs(
-            torch::ones({2, 1}),
-            torch::zeros({2, 5}),
-            torch::ones({2, 1}));
-
         learn_pattern(policy, storage, ppo);
+        auto usage = ppo.get_memory_usage();
+
+        REQUIRE(usage.size() == 2);
+        CHECK(usage[0].name == "optimizer_state");
+        // Two Adam moments per parameter
+        CHECK(usage[0].bytes == 2 * get_tensor_bytes(policy->parameters()));
+        CHECK(usage[1].name == "mini_batches");
+        CHECK(usage[1].bytes > 0);
+    }
+
+    SUBCASE("Prefetched minibatches give the same update as without")
+    {
+        auto policy = make_policy();
+        auto prefetched_policy = make_policy();
+        copy_parameters(policy, prefetched_policy);
+        RolloutStorage storage(20, 2, {1}, space, 5, torch::kCPU);
+        collect_rollout(policy, storage);
+
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+        PPO prefetched_ppo(prefetched_policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001, 1e-8, 0.5, 0.01, true);
+
+        check_same_updates(policy, ppo, prefetched_policy, prefetched_ppo, storage);
+    }
+
+    SUBCASE("update() learns basic pattern with LAMB")
+    {
+        auto policy = make_policy();
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.01, 1e-6, 0.5, 0.01, false, "LAMB");
+
+        check_learns_pattern(policy, ppo);
+    }
+
+    SUBCASE("update() learns basic pattern with LARS")
+    {
+        auto policy = make_policy();
+        // LARS steps are scaled by its trust coefficient of 0.001
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 1, 1e-8, 0.5, 0.01, false, "LARS");
+
+        check_learns_pattern(policy, ppo);
+    }
+
+    SUBCASE("update() learns basic pattern with a minibatch size in samples")
+    {
+        auto policy = make_policy();
+        // 2 processes * 20 steps don't divide into minibatches of 7
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+        ppo.set_mini_batch_size(7);
+        CHECK_THROWS(ppo.set_mini_batch_size(-1));
+
+        check_learns_pattern(policy, ppo);
+    }
+
+    SUBCASE("update_window() learns basic pattern")
+    {
+        auto policy = make_policy();
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+
+        check_learns_pattern(policy, ppo, learn_pattern_streaming);
+    }
+
+    SUBCASE("update_window() only trains on its window")
+    {
+        auto policy = make_policy();
+        RolloutStorage storage(20, 2, {1}, space, 5, torch::kCPU);
+        collect_rollout(policy, storage);
+        // Anything read from outside the window would make the update NaN
+        auto returns = storage.get_returns();
+        returns.narrow(0, 5, returns.size(0) - 5).fill_(NAN);
+        storage.compute_returns(storage.get_value_prediction(5), false, 0.9, 0.9, 0, 5);
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-3, 0.001);
+
+        ppo.update_window(storage, 0, 5);
+
+        for (const auto &parameter : policy->parameters())
+        {
+            CHECK(!torch::isnan(parameter).any().item().toBool());
+        }
+    }
+
+    SUBCASE("update_window() keeps a folded observation normalizer up to date")
+    {
+        auto base = std::make_shared<MlpBase>(1, false, 5);
+        ActionSpace space{"Discrete", {2}};
+        Policy policy(space, base, true);
+        policy->set_observation_normalizer_folding(true);
+        RolloutStorage storage(20, 2, {1}, space, 5, torch::kCPU);
+        PPO ppo(policy, 0.2, 3, 5, 1, 0.5, 1e-2, 0.001);
+
+        for (int step = 0; step <= 5; ++step)
+        {
+            auto observation = torch::randint(0, 2, {2, 1});
+            std::vector<torch::Tensor> act_result;
+            {
+                torch::NoGradGuard no_grad;
+                act_result = policy->act(observation,
+                                         torch::Tensor(),
+                                         torch::ones({2, 1}));
+            }
+            storage.insert(observation,
+                           torch::zeros({2, 5}),
+                           act_result[1],
+                           act_result[2],
+                           act_result[0],
+                           act_result[1],
+                           torch::ones({2, 1}));
+        }
+        storage.compute_returns(storage.get_value_prediction(5), false, 0., 0.9, 0, 5);
+        ppo.update_window(storage, 0, 5);
+
+        // Grad mode uses the unfolded layer
+        auto observations = torch::randint(0, 2, {4, 1});
+        auto unfolded_values = policy->get_values(observations,
+                                                  torch::zeros({4, 5}),
+                                                  torch::ones({4, 1}));
+        torch::Tensor folded_values;
+        {
+            torch::NoGradGuard no_grad;
+            folded_values = policy->get_values(observations,
+                                               torch::zeros({4, 5}),
+                                               torch::ones({4, 1}));
+        }
 
-        auto post_game_probs = policy->get_probs(
-            torch::ones({2, 1}),
-            torch::zeros({2, 5}),
-            torch::ones({2, 1}));
-
-        INFO("Pre-training probabilities: \n"
-             << pre_game_probs << "\n");
-        INFO("Post-training probabilities: \n"
-             << post_game_probs << "\n");
-        CHECK(post_game_probs[0][0].item().toDouble() <
-              pre_game_probs[0][0].item().toDouble());
-        CHECK(post_game_probs[0][1].item().toDouble() >
-              pre_game_probs[0][1].item().toDouble());
+        CHECK(torch::allclose(folded_values, unfolded_values, 1e-4, 1e-5));
     }
 
     SUBCASE("update() learns basic game")
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <torch/torch.h>
@@ -17,7 +20,29 @@ FeedForwardGenerator::FeedForwardGenerator(int mini_batch_size,
                                            torch::Tensor returns,
                                            torch::Tensor masks,
                                            torch::Tensor action_log_probs,
-                                           torch::Tensor advantages)
+                                           torch::Tensor advantages,
+                                           torch::Tensor rows)
+    : FeedForwardGenerator(split_by_size(advantages.numel(), mini_batch_size),
+                           observations,
+                           hidden_states,
+                           actions,
+                           value_predictions,
+                           returns,
+                           masks,
+                           action_log_probs,
+                           advantages,
+                           rows) {}
+
+FeedForwardGenerator::FeedForwardGenerator(const std::vector<int64_t> &mini_batch_sizes,
+                                           torch::Tensor observations,
+                                           torch::Tensor hidden_states,
+                                           torch::Tensor actions,
+                                           torch::Tensor value_predictions,
+                                           torch::Tensor returns,
+                                           torch::Tensor masks,
+                                           torch::Tensor action_log_probs,
+                                           torch::Tensor advantages,
+                                           torch::Tensor rows)
     : observations(observations),
       hidden_states(hidden_states),
       actions(actions),
@@ -26,59 +51,96 @@ FeedForwardGenerator::FeedForwardGenerator(int mini_batch_size,
       masks(masks),
       action_log_probs(action_log_probs),
       advantages(advantages),
+      rows(rows),
       index(0)
 {
-    int batch_size = advantages.numel();
-    indices = torch::randperm(batch_size,
-                              torch::TensorOptions(torch::kLong))
-                  .view({-1, mini_batch_size});
+    int64_t batch_size = advantages.numel();
+    batch_starts.push_back(0);
+    for (const auto size : mini_batch_sizes)
+    {
+        batch_starts.push_back(batch_starts.back() + size);
+    }
+    if (batch_starts.back() != batch_size)
+    {
+        throw std::runtime_error("Minibatch sizes add up to " +
+                                 std::to_string(batch_starts.back()) +
+                                 ", but there are " +
+                                 std::to_string(batch_size) + " samples");
+    }
+    indices = torch::randperm(batch_size, torch::TensorOptions(torch::kLong));
+}
+
+torch::Tensor FeedForwardGenerator::get_step_indices(int mini_batch_index) const
+{
+    return indices.narrow(0, batch_starts[mini_batch_index],
+                          batch_starts[mini_batch_index + 1] -
+                              batch_starts[mini_batch_index]);
+}
+
+torch::Tensor FeedForwardGenerator::get_stored_indices(int mini_batch_index) const
+{
+    // Indices are into the flattened (step, process) batch, so they have to be
+    // mapped to buffer rows for tensors not stored in step order
+    auto step_indices = get_step_indices(mini_batch_index);
+    if (!rows.defined())
+    {
+        return step_indices;
+    }
+    auto num_processes = advantages.size(1);
+    return (rows.index(step_indices / num_processes) * num_processes +
+            step_indices.remainder(num_processes));
 }
 
 bool FeedForwardGenerator::done() const
 {
-    return index >= indices.size(0);
+    return index >= static_cast<int>(batch_starts.size()) - 1;
 }
 
 MiniBatch FeedForwardGenerator::next()
 {
-    if (index >= indices.size(0))
+    if (done())
     {
         throw std::runtime_error("No minibatches left in generator.");
     }
 
     MiniBatch mini_batch;
 
-    int timesteps = observations.size(0) - 1;
-
-    auto observations_shape = observations.sizes().vec();
-    observations_shape.erase(observations_shape.begin());
-    observations_shape[0] = -1;
-    mini_batch.observations = observations.narrow(0, 0, timesteps)
-                                  .view(observations_shape)
-                                  .index(indices[index]);
-    mini_batch.hidden_states = hidden_states.narrow(0, 0, timesteps)
-                                   .view({-1, hidden_states.size(-1)})
-                                   .index(indices[index]);
-    mini_batch.actions = actions.view({-1, actions.size(-1)})
-                             .index(indices[index]);
-    mini_batch.value_predictions = value_predictions.narrow(0, 0, timesteps)
-                                       .view({-1, 1})
-                                       .index(indices[index]);
-    mini_batch.returns = returns.narrow(0, 0, timesteps)
-                             .view({-1, 1})
-                             .index(indices[index]);
-    mini_batch.masks = masks.narrow(0, 0, timesteps)
-                           .view({-1, 1})
-                           .index(indices[index]);
-    mini_batch.action_log_probs = action_log_probs.view({-1, 1})
-                                      .index(indices[index]);
-    mini_batch.advantages = advantages.view({-1, 1})
-                                .index(indices[index]);
+    auto step_indices = get_step_indices(index);
+    auto stored_indices = get_stored_indices(index);
+    if (prefetch_callback && index + 2 < static_cast<int>(batch_starts.size()))
+    {
+        prefetch_callback(get_stored_indices(index + 1));
+    }
+
+    auto flatten = [](const torch::Tensor &tensor) {
+        auto shape = tensor.sizes().vec();
+        shape.erase(shape.begin());
+        shape[0] = -1;
+        return tensor.view(shape);
+    };
+    mini_batch.observations = flatten(observations).index(stored_indices);
+    mini_batch.hidden_states = flatten(hidden_states).index(stored_indices);
+    mini_batch.actions = flatten(actions).index(stored_indices);
+    mini_batch.value_predictions = flatten(value_predictions).index(stored_indices);
+    mini_batch.returns = flatten(returns).index(step_indices);
+    mini_batch.masks = flatten(masks).index(stored_indices);
+    mini_batch.action_log_probs = flatten(action_log_probs).index(stored_indices);
+    mini_batch.advantages = flatten(advantages).index(step_indices);
 
     index++;
     return mini_batch;
 }
 
+void FeedForwardGenerator::set_prefetch_callback(
+    std::function<void(const torch::Tensor &)> callback)
+{
+    prefetch_callback = callback;
+    if (prefetch_callback && !done())
+    {
+        prefetch_callback(get_stored_indices(index));
+    }
+}
+
 TEST_CASE("FeedForwardGenerator")
 {
     FeedForwardGenerator generator(5, torch::rand({6, 3, 4}), torch::rand({6, 3, 3}),
@@ -100,6 +162,72 @@ TEST_CASE("FeedForwardGenerator")
         CHECK(minibatch.advantages.sizes().vec() == std::vector<int64_t>{5, 1});
     }
 
+    SUBCASE("Maps steps to rows")
+    {
+        // Steps 0 and 1 are stored in rows 1 and 0
+        auto observations = torch::arange(3, torch::kFloat).view({3, 1, 1});
+        FeedForwardGenerator mapped_generator(
+            2, observations, torch::zeros({3, 1, 1}), torch::zeros({3, 1, 1}),
+            torch::zeros({3, 1, 1}), torch::zeros({3, 1, 1}), torch::ones({3, 1, 1}),
+            torch::zeros({3, 1, 1}), torch::arange(2, torch::kFloat).view({2, 1, 1}),
+            torch::tensor({1, 0}, torch::kLong));
+        auto minibatch = mapped_generator.next();
+
+        CHECK(torch::equal(minibatch.observations.view({-1}),
+                           1 - minibatch.advantages.view({-1})));
+    }
+
+    SUBCASE("Prefetch callback is given each minibatch's indices ahead of time")
+    {
+        std::vector<torch::Tensor> prefetched;
+        generator.set_prefetch_callback(
+            [&prefetched](const torch::Tensor &indices) { prefetched.push_back(indices); });
+        CHECK(prefetched.size() == 1);
+
+        generator.next();
+        CHECK(prefetched.size() == 2);
+        generator.next();
+        generator.next();
+        CHECK(prefetched.size() == 3);
+    }
+
+    SUBCASE("Last minibatch gets whatever is left over")
+    {
+        FeedForwardGenerator uneven_generator(
+            4, torch::rand({6, 3, 4}), torch::rand({6, 3, 3}),
+            torch::rand({5, 3, 1}), torch::rand({6, 3, 1}),
+            torch::rand({6, 3, 1}), torch::ones({6, 3, 1}),
+            torch::rand({5, 3, 1}), torch::rand({5, 3, 1}));
+        std::vector<int64_t> sizes;
+        while (!uneven_generator.done())
+        {
+            sizes.push_back(uneven_generator.next().advantages.size(0));
+        }
+
+        CHECK(sizes == std::vector<int64_t>{4, 4, 4, 3});
+    }
+
+    SUBCASE("Can be given the size of each minibatch")
+    {
+        FeedForwardGenerator sized_generator(
+            split_evenly(15, 4), torch::rand({6, 3, 4}), torch::rand({6, 3, 3}),
+            torch::rand({5, 3, 1}), torch::rand({6, 3, 1}),
+            torch::rand({6, 3, 1}), torch::ones({6, 3, 1}),
+            torch::rand({5, 3, 1}), torch::rand({5, 3, 1}));
+        auto advantages = torch::zeros({0, 1});
+        while (!sized_generator.done())
+        {
+            advantages = torch::cat({advantages, sized_generator.next().advantages});
+        }
+
+        CHECK(advantages.size(0) == 15);
+        CHECK_THROWS(FeedForwardGenerator(
+            std::vector<int64_t>{4, 4}, torch::rand({6, 3, 4}), torch::rand({6, 3, 3}),
+            torch::rand({5, 3, 1}), torch::rand({6, 3, 1}),
+            torch::rand({6, 3, 1}), torch::ones({6, 3, 1}),
+            torch::rand({5, 3, 1}), torch::rand({5, 3, 1})));
+    }
+
     SUBCASE("done() indicates whether the generator has finished")
     {
         CHECK(!generator.done());
@@ -0,0 +1,266 @@
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/generators/prefetching_generator.h"
+#include "cpprl/generators/feed_forward_generator.h"
+#include "cpprl/generators/generator.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+PrefetchingGenerator::PrefetchingGenerator(std::unique_ptr<Generator> generator,
+                                           torch::Device device)
+    // std::function needs a copyable callable
+    : PrefetchingGenerator(
+          [generator = std::make_shared<std::unique_ptr<Generator>>(std::move(generator))] {
+              return std::move(*generator);
+          },
+          1,
+          device) {}
+
+PrefetchingGenerator::PrefetchingGenerator(std::function<std::unique_ptr<Generator>()> make_generator,
+                                           int num_generators,
+                                           torch::Device device)
+    : make_generator(std::move(make_generator)),
+      num_generators(num_generators),
+      generator_index(0),
+      ready_generator_index(0),
+      device(device),
+      finished(false),
+      stopping(false),
+      worker(&PrefetchingGenerator::run, this) {}
+
+PrefetchingGenerator::~PrefetchingGenerator()
+{
+    // The worker uses make_generator and the generators it makes
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taken_condition.notify_one();
+    worker.join();
+}
+
+bool PrefetchingGenerator::done() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready_condition.wait(lock, [this] { return ready_mini_batch || finished; });
+    // Errors are rethrown by next()
+    if (ready_mini_batch)
+    {
+        return ready_generator_index != generator_index;
+    }
+    return !error;
+}
+
+MiniBatch PrefetchingGenerator::next()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready_condition.wait(lock, [this] { return ready_mini_batch || finished; });
+    if (!ready_mini_batch || ready_generator_index != generator_index)
+    {
+        if (error && !ready_mini_batch)
+        {
+            std::rethrow_exception(error);
+        }
+        throw std::runtime_error("No minibatches left in generator.");
+    }
+
+    auto mini_batch = std::move(*ready_mini_batch);
+    ready_mini_batch.reset();
+    lock.unlock();
+    taken_condition.notify_one();
+    return mini_batch;
+}
+
+void PrefetchingGenerator::next_generator()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    generator_index++;
+}
+
+void PrefetchingGenerator::run()
+{
+    torch::NoGradGuard no_grad;
+    try
+    {
+        for (int index = 0; index < num_generators; ++index)
+        {
+            auto generator = make_generator();
+            while (true)
+            {
+                // Only start on a minibatch once the last one has been
+                // taken, so at most two are held at once
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    taken_condition.wait(lock, [this] { return !ready_mini_batch || stopping; });
+                    if (stopping)
+                    {
+                        return;
+                    }
+                }
+                if (generator->done())
+                {
+                    break;
+                }
+
+                auto mini_batch = stage(generator->next());
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready_mini_batch = std::make_unique<MiniBatch>(std::move(mini_batch));
+                    ready_generator_index = index;
+                }
+                ready_condition.notify_one();
+            }
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    ready_condition.notify_one();
+}
+
+MiniBatch PrefetchingGenerator::stage(MiniBatch mini_batch) const
+{
+    for (auto tensor : {&mini_batch.observations,
+                        &mini_batch.hidden_states,
+                        &mini_batch.actions,
+                        &mini_batch.value_predictions,
+                        &mini_batch.returns,
+                        &mini_batch.masks,
+                        &mini_batch.action_log_probs,
+                        &mini_batch.advantages})
+    {
+        auto staged = tensor->contiguous();
+        if (device.is_cuda() && staged.device().is_cpu())
+        {
+            // Host to device copies are only asynchronous from pinned memory
+            staged = staged.pin_memory();
+        }
+        *tensor = staged.to(device, true);
+    }
+    return mini_batch;
+}
+
+namespace
+{
+class ThrowingGenerator : public Generator
+{
+  public:
+    bool done() const { return false; }
+    MiniBatch next() { throw std::runtime_error("Couldn't make minibatch"); }
+};
+}
+
+TEST_CASE("PrefetchingGenerator")
+{
+    auto observations = torch::rand({6, 3, 4});
+    auto make_generator = [&] {
+        torch::manual_seed(0);
+        return std::make_unique<FeedForwardGenerator>(
+            5, observations, torch::rand({6, 3, 3}),
+            torch::rand({5, 3, 1}), torch::rand({6, 3, 1}),
+            torch::rand({6, 3, 1}), torch::ones({6, 3, 1}),
+            torch::rand({5, 3, 1}), torch::rand({5, 3, 1}));
+    };
+
+    SUBCASE("Gives the same minibatches as the wrapped generator")
+    {
+        auto plain_generator = make_generator();
+        PrefetchingGenerator generator(make_generator(), torch::kCPU);
+
+        int num_mini_batches = 0;
+        while (!generator.done())
+        {
+            REQUIRE(!plain_generator->done());
+            auto mini_batch = generator.next();
+            auto expected_mini_batch = plain_generator->next();
+            CHECK(torch::equal(mini_batch.observations, expected_mini_batch.observations));
+            CHECK(mini_batch.observations.is_contiguous());
+            num_mini_batches++;
+        }
+        CHECK(plain_generator->done());
+        CHECK(num_mini_batches == 3);
+    }
+
+    SUBCASE("Calling a generator after it has finished throws an exception")
+    {
+        PrefetchingGenerator generator(make_generator(), torch::kCPU);
+        generator.next();
+        generator.next();
+        generator.next();
+        CHECK_THROWS(generator.next());
+    }
+
+    SUBCASE("Stages minibatches onto the target device")
+    {
+        auto device = torch::cuda::is_available() ? torch::Device(torch::kCUDA)
+                                                  : torch::Device(torch::kCPU);
+        PrefetchingGenerator generator(make_generator(), device);
+
+        auto mini_batch = generator.next();
+        CHECK(mini_batch.observations.device() == device);
+        CHECK(mini_batch.advantages.device() == device);
+    }
+
+    SUBCASE("Rethrows errors from the wrapped generator")
+    {
+        PrefetchingGenerator generator(std::make_unique<ThrowingGenerator>(), torch::kCPU);
+
+        CHECK(!generator.done());
+        CHECK_THROWS_WITH(generator.next(), "Couldn't make minibatch");
+    }
+
+    SUBCASE("Goes through a sequence of generators one at a time")
+    {
+        // Made up front, as make_generator() reseeds the global RNG
+        std::vector<std::unique_ptr<Generator>> plain_generators;
+        plain_generators.push_back(make_generator());
+        plain_generators.push_back(make_generator());
+        int num_made = 0;
+        PrefetchingGenerator generator(
+            [&] {
+                num_made++;
+                return make_generator();
+            },
+            2, torch::kCPU);
+
+        for (int index = 0; index < 2; ++index)
+        {
+            auto &plain_generator = plain_generators[index];
+            while (!generator.done())
+            {
+                REQUIRE(!plain_generator->done());
+                auto mini_batch = generator.next();
+                CHECK(torch::equal(mini_batch.observations,
+                                   plain_generator->next().observations));
+            }
+            CHECK(plain_generator->done());
+            CHECK_THROWS(generator.next());
+            generator.next_generator();
+        }
+        CHECK(generator.done());
+        CHECK(num_made == 2);
+    }
+
+    SUBCASE("Can be destroyed before it has finished")
+    {
+        PrefetchingGenerator generator(make_generator(), torch::kCPU);
+        generator.next();
+    }
+}
+}
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <torch/torch.h>
@@ -9,12 +12,21 @@
 
 namespace cpprl
 {
-torch::Tensor flatten_helper(int timesteps, int processes, torch::Tensor tensor)
+namespace
 {
-    auto tensor_shape = tensor.sizes().vec();
-    tensor_shape.erase(tensor_shape.begin());
-    tensor_shape[0] = timesteps * processes;
-    return tensor.view(tensor_shape);
+// Gathers the first num_steps timesteps of tensor, shaped (timestep, process,
+// *whatever), into (timestep * process, *whatever) rows in the given order
+torch::Tensor gather_rows(int64_t num_steps,
+                          const torch::Tensor &tensor,
+                          const torch::Tensor &row_indices)
+{
+    auto shape = tensor.sizes().vec();
+    shape.erase(shape.begin());
+    shape[0] *= num_steps;
+    return tensor.narrow(0, 0, num_steps)
+        .reshape(shape)
+        .index_select(0, row_indices);
+}
 }
 
 RecurrentGenerator::RecurrentGenerator(int num_processes,
@@ -27,70 +39,107 @@ RecurrentGenerator::RecurrentGenerator(int num_processes,
                                        torch::Tensor masks,
                                        torch::Tensor action_log_probs,
                                        torch::Tensor advantages)
-    : observations(observations),
-      hidden_states(hidden_states),
-      actions(actions),
-      value_predictions(value_predictions),
-      returns(returns),
-      masks(masks),
-      action_log_probs(action_log_probs),
-      advantages(advantages),
-      indices(torch::randperm(num_processes, torch::TensorOptions(torch::kLong))),
-      index(0),
-      num_envs_per_batch(num_processes / num_mini_batch) {}
+    : RecurrentGenerator(split_evenly(num_processes, num_mini_batch),
+                         observations,
+                         hidden_states,
+                         actions,
+                         value_predictions,
+                         returns,
+                         masks,
+                         action_log_probs,
+                         advantages) {}
+
+RecurrentGenerator::RecurrentGenerator(const std::vector<int64_t> &group_sizes,
+                                       torch::Tensor observations,
+                                       torch::Tensor hidden_states,
+                                       torch::Tensor actions,
+                                       torch::Tensor value_predictions,
+                                       torch::Tensor returns,
+                                       torch::Tensor masks,
+                                       torch::Tensor action_log_probs,
+                                       torch::Tensor advantages)
+    : index(0),
+      num_steps(actions.size(0))
+{
+    auto num_processes = actions.size(1);
+    auto permutation_tensor = torch::randperm(num_processes,
+                                              torch::TensorOptions(torch::kLong));
+    std::vector<int64_t> permutation(permutation_tensor.data_ptr<int64_t>(),
+                                     permutation_tensor.data_ptr<int64_t>() + num_processes);
+
+    group_starts.push_back(0);
+    for (const auto group_size : group_sizes)
+    {
+        group_starts.push_back(group_starts.back() + group_size);
+    }
+    if (group_starts.back() != num_processes)
+    {
+        throw std::runtime_error("Group sizes add up to " +
+                                 std::to_string(group_starts.back()) +
+                                 " processes, but there are " +
+                                 std::to_string(num_processes));
+    }
+
+    // Each group's rows are (timestep, process) ordered, so the recurrent
+    // policy can unflatten them with a view
+    std::vector<int64_t> row_indices;
+    row_indices.reserve(num_steps * num_processes);
+    for (size_t group = 0; group + 1 < group_starts.size(); ++group)
+    {
+        for (int64_t step = 0; step < num_steps; ++step)
+        {
+            for (auto i = group_starts[group]; i < group_starts[group + 1]; ++i)
+            {
+                row_indices.push_back(step * num_processes + permutation[i]);
+            }
+        }
+    }
+
+    auto device = actions.device();
+    auto row_indices_tensor = torch::from_blob(row_indices.data(),
+                                               {static_cast<int64_t>(row_indices.size())},
+                                               torch::kLong)
+                                  .to(device);
+    permutation_tensor = permutation_tensor.to(device);
+
+    this->observations = gather_rows(num_steps, observations, row_indices_tensor);
+    this->hidden_states = hidden_states[0].index_select(0, permutation_tensor);
+    this->actions = gather_rows(num_steps, actions, row_indices_tensor);
+    this->value_predictions = gather_rows(num_steps, value_predictions, row_indices_tensor);
+    this->returns = gather_rows(num_steps, returns, row_indices_tensor);
+    this->masks = gather_rows(num_steps, masks, row_indices_tensor);
+    this->action_log_probs = gather_rows(num_steps, action_log_probs, row_indices_tensor);
+    this->advantages = gather_rows(num_steps, advantages, row_indices_tensor);
+}
 
 bool RecurrentGenerator::done() const
 {
-    return index >= indices.size(0);
+    return index >= static_cast<int>(group_starts.size()) - 1;
 }
 
 MiniBatch RecurrentGenerator::next()
 {
-    if (index >= indices.size(0))
+    if (done())
     {
         throw std::runtime_error("No minibatches left in generator.");
     }
 
-    MiniBatch mini_batch;
+    auto first_process = group_starts[index];
+    auto group_processes = group_starts[index + 1] - first_process;
+    auto first_row = first_process * num_steps;
+    auto group_rows = group_processes * num_steps;
 
-    // Fill minibatch with tensors of shape (timestep, process, *whatever)
-    // Except hidden states, that is just (process, *whatever)
-    int64_t env_index = indices[index].item().toLong();
-    mini_batch.observations = observations
-                                  .narrow(0, 0, observations.size(0) - 1)
-                                  .narrow(1, env_index, num_envs_per_batch);
-    mini_batch.hidden_states = hidden_states[0]
-                                   .narrow(0, env_index, num_envs_per_batch)
-                                   .view({num_envs_per_batch, -1});
-    mini_batch.actions = actions.narrow(1, env_index, num_envs_per_batch);
-    mini_batch.value_predictions = value_predictions
-                                       .narrow(0, 0, value_predictions.size(0) - 1)
-                                       .narrow(1, env_index, num_envs_per_batch);
-    mini_batch.returns = returns.narrow(0, 0, returns.size(0) - 1)
-                             .narrow(1, env_index, num_envs_per_batch);
-    mini_batch.masks = masks.narrow(0, 0, masks.size(0) - 1)
-                           .narrow(1, env_index, num_envs_per_batch);
-    mini_batch.action_log_probs = action_log_probs.narrow(1, env_index,
-                                                          num_envs_per_batch);
-    mini_batch.advantages = advantages.narrow(1, env_index, num_envs_per_batch);
-
-    // Flatten tensors to (timestep * process, *whatever)
-    int num_timesteps = mini_batch.observations.size(0);
-    int num_processes = num_envs_per_batch;
-    mini_batch.observations = flatten_helper(num_timesteps, num_processes,
-                                             mini_batch.observations);
-    mini_batch.actions = flatten_helper(num_timesteps, num_processes,
-                                        mini_batch.actions);
-    mini_batch.value_predictions = flatten_helper(num_timesteps, num_processes,
-                                                  mini_batch.value_predictions);
-    mini_batch.returns = flatten_helper(num_timesteps, num_processes,
-                                        mini_batch.returns);
-    mini_batch.masks = flatten_helper(num_timesteps, num_processes,
-                                      mini_batch.masks);
-    mini_batch.action_log_probs = flatten_helper(num_timesteps, num_processes,
-                                                 mini_batch.action_log_probs);
-    mini_batch.advantages = flatten_helper(num_timesteps, num_processes,
-                                           mini_batch.advantages);
+    // Tensors of shape (timestep * process, *whatever), except hidden states,
+    // which are just (process, *whatever)
+    MiniBatch mini_batch;
+    mini_batch.observations = observations.narrow(0, first_row, group_rows);
+    mini_batch.hidden_states = hidden_states.narrow(0, first_process, group_processes);
+    mini_batch.actions = actions.narrow(0, first_row, group_rows);
+    mini_batch.value_predictions = value_predictions.narrow(0, first_row, group_rows);
+    mini_batch.returns = returns.narrow(0, first_row, group_rows);
+    mini_batch.masks = masks.narrow(0, first_row, group_rows);
+    mini_batch.action_log_probs = action_log_probs.narrow(0, first_row, group_rows);
+    mini_batch.advantages = advantages.narrow(0, first_row, group_rows);
 
     index++;
 
@@ -134,5 +183,64 @@ TEST_CASE("RecurrentGenerator")
         generator.next();
         CHECK_THROWS(generator.next());
     }
+
+    SUBCASE("Minibatch tensors are contiguous")
+    {
+        auto minibatch = generator.next();
+
+        CHECK(minibatch.observations.is_contiguous());
+        CHECK(minibatch.hidden_states.is_contiguous());
+        CHECK(minibatch.advantages.is_contiguous());
+    }
+}
+
+TEST_CASE("RecurrentGenerator handles uneven groups")
+{
+    // Each observation is step * processes + process, and the hidden state
+    // is the process
+    const int num_steps = 4;
+    const int num_processes = 5;
+    auto observations = torch::arange(0, (num_steps + 1) * num_processes)
+                            .to(torch::kFloat)
+                            .view({num_steps + 1, num_processes, 1});
+    auto hidden_states = torch::arange(0, num_processes)
+                             .to(torch::kFloat)
+                             .view({1, num_processes, 1})
+                             .repeat({num_steps + 1, 1, 1});
+    RecurrentGenerator generator(num_processes, 2, observations, hidden_states,
+                                 torch::rand({num_steps, num_processes, 1}),
+                                 torch::rand({num_steps + 1, num_processes, 1}),
+                                 torch::rand({num_steps + 1, num_processes, 1}),
+                                 torch::ones({num_steps + 1, num_processes, 1}),
+                                 torch::rand({num_steps, num_processes, 1}),
+                                 torch::rand({num_steps, num_processes, 1}));
+
+    std::vector<int64_t> group_sizes;
+    std::vector<float> processes_seen;
+    while (!generator.done())
+    {
+        auto minibatch = generator.next();
+        auto group_size = minibatch.hidden_states.size(0);
+        group_sizes.push_back(group_size);
+        CHECK(minibatch.observations.size(0) == num_steps * group_size);
+
+        auto processes = minibatch.hidden_states.view({1, group_size});
+        auto expected = torch::arange(0, num_steps)
+                            .to(torch::kFloat)
+                            .view({num_steps, 1}) *
+                        num_processes +
+                        processes;
+        CHECK(torch::equal(minibatch.observations.view({num_steps, group_size}),
+                           expected));
+
+        for (int64_t i = 0; i < group_size; ++i)
+        {
+            processes_seen.push_back(processes[0][i].item().toFloat());
+        }
+    }
+
+    CHECK(group_sizes == std::vector<int64_t>{3, 2});
+    std::sort(processes_seen.begin(), processes_seen.end());
+    CHECK(processes_seen == std::vector<float>{0, 1, 2, 3, 4});
 }
 }
\ No newline at end of file
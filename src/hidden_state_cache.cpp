@@ -0,0 +1,197 @@
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/hidden_state_cache.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+HiddenStateCache::HiddenStateCache(int64_t capacity,
+                                   int64_t hidden_size,
+                                   torch::Device device)
+    : slab(torch::zeros({capacity, hidden_size}, torch::TensorOptions(device)))
+{
+    if (capacity <= 0)
+    {
+        throw std::runtime_error("HiddenStateCache capacity must be positive");
+    }
+    clear();
+}
+
+void HiddenStateCache::clear()
+{
+    lru_keys.clear();
+    entries.clear();
+    free_slots.clear();
+    // Hand out low slots first
+    for (auto slot = get_capacity() - 1; slot >= 0; --slot)
+    {
+        free_slots.push_back(slot);
+    }
+}
+
+void HiddenStateCache::erase(const std::string &key)
+{
+    auto entry = entries.find(key);
+    if (entry == entries.end())
+    {
+        return;
+    }
+    free_slots.push_back(entry->second.slot);
+    lru_keys.erase(entry->second.lru_position);
+    entries.erase(entry);
+}
+
+torch::Tensor HiddenStateCache::gather(const torch::Tensor &slots) const
+{
+    return slab.index_select(0, slots);
+}
+
+torch::Tensor HiddenStateCache::get_slots(const std::vector<std::string> &keys,
+                                          const std::vector<bool> &resets)
+{
+    if (!resets.empty() && resets.size() != keys.size())
+    {
+        throw std::runtime_error("Got " + std::to_string(resets.size()) +
+                                 " resets for " + std::to_string(keys.size()) +
+                                 " keys");
+    }
+    if (static_cast<int64_t>(std::set<std::string>(keys.begin(), keys.end()).size()) >
+        get_capacity())
+    {
+        throw std::runtime_error("More clients in the batch than the HiddenStateCache "
+                                 "capacity (" +
+                                 std::to_string(get_capacity()) + ")");
+    }
+
+    // Touch the keys that are already cached first, so they can't be evicted
+    // to make room for new keys in the same batch
+    for (const auto &key : keys)
+    {
+        auto entry = entries.find(key);
+        if (entry != entries.end())
+        {
+            lru_keys.splice(lru_keys.begin(), lru_keys, entry->second.lru_position);
+        }
+    }
+
+    std::vector<int64_t> slots;
+    std::vector<int64_t> zeroed_slots;
+    slots.reserve(keys.size());
+    for (unsigned int i = 0; i < keys.size(); ++i)
+    {
+        auto entry = entries.find(keys[i]);
+        if (entry == entries.end())
+        {
+            if (free_slots.empty())
+            {
+                erase(lru_keys.back());
+            }
+            lru_keys.push_front(keys[i]);
+            entry = entries.emplace(keys[i], Entry{free_slots.back(), lru_keys.begin()}).first;
+            free_slots.pop_back();
+            zeroed_slots.push_back(entry->second.slot);
+        }
+        else if (!resets.empty() && resets[i])
+        {
+            zeroed_slots.push_back(entry->second.slot);
+        }
+        slots.push_back(entry->second.slot);
+    }
+
+    if (!zeroed_slots.empty())
+    {
+        slab.index_fill_(0, torch::tensor(zeroed_slots, torch::kLong).to(slab.device()), 0);
+    }
+    return torch::tensor(slots, torch::kLong).to(slab.device());
+}
+
+void HiddenStateCache::scatter(const torch::Tensor &slots,
+                               const torch::Tensor &hidden_states)
+{
+    torch::NoGradGuard no_grad;
+    slab.index_copy_(0, slots, hidden_states.to(slab.device()));
+}
+
+TEST_CASE("HiddenStateCache")
+{
+    HiddenStateCache cache(3, 2);
+
+    SUBCASE("New clients start with zeroed hidden states")
+    {
+        auto slots = cache.get_slots({"a", "b"});
+
+        CHECK(slots.sizes().vec() == std::vector<int64_t>{2});
+        CHECK(torch::equal(cache.gather(slots), torch::zeros({2, 2})));
+        CHECK(cache.size() == 2);
+    }
+
+    SUBCASE("Scattered hidden states are gathered again")
+    {
+        auto slots = cache.get_slots({"a", "b"});
+        auto hidden_states = torch::rand({2, 2});
+        cache.scatter(slots, hidden_states);
+
+        // Reversed order
+        slots = cache.get_slots({"b", "a"});
+        CHECK(torch::equal(cache.gather(slots), hidden_states.flip({0})));
+    }
+
+    SUBCASE("Resets zero hidden states")
+    {
+        auto slots = cache.get_slots({"a", "b"});
+        cache.scatter(slots, torch::ones({2, 2}));
+
+        slots = cache.get_slots({"a", "b"}, {true, false});
+        auto hidden_states = cache.gather(slots);
+        CHECK(torch::equal(hidden_states[0], torch::zeros({2})));
+        CHECK(torch::equal(hidden_states[1], torch::ones({2})));
+    }
+
+    SUBCASE("Evicts the least recently used client when full")
+    {
+        auto slots = cache.get_slots({"a", "b", "c"});
+        cache.scatter(slots, torch::ones({3, 2}));
+        cache.get_slots({"a"});
+
+        slots = cache.get_slots({"d", "c"});
+        CHECK(!cache.contains("b"));
+        CHECK(cache.contains("a"));
+        CHECK(cache.size() == 3);
+        // d reuses b's slot, which gets zeroed
+        CHECK(torch::equal(cache.gather(slots)[0], torch::zeros({2})));
+        CHECK(torch::equal(cache.gather(slots)[1], torch::ones({2})));
+    }
+
+    SUBCASE("Doesn't evict clients in the same batch")
+    {
+        cache.get_slots({"a", "b", "c"});
+
+        auto slots = cache.get_slots({"a", "d"});
+        CHECK(cache.contains("a"));
+        CHECK(cache.contains("d"));
+        CHECK(slots[0].item().toLong() != slots[1].item().toLong());
+    }
+
+    SUBCASE("Throws when a batch has more clients than the capacity")
+    {
+        CHECK_THROWS(cache.get_slots({"a", "b", "c", "d"}));
+        CHECK_NOTHROW(cache.get_slots({"a", "b", "c", "a"}));
+    }
+
+    SUBCASE("Erased clients free their slots")
+    {
+        cache.get_slots({"a", "b", "c"});
+        cache.erase("b");
+        CHECK(cache.size() == 2);
+
+        cache.get_slots({"d"});
+        CHECK(cache.contains("a"));
+        CHECK(cache.contains("c"));
+    }
+}
+}
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPPRL_SSE2
+#endif
+// The SSSE3 code is compiled for SSSE3 whatever the target, and only called
+// if the CPU running it supports it
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define CPPRL_SSSE3
+#define CPPRL_TARGET_SSSE3 __attribute__((target("ssse3")))
+#elif defined(_M_X64)
+#include <intrin.h>
+#include <tmmintrin.h>
+#define CPPRL_SSSE3
+#define CPPRL_TARGET_SSSE3
+#endif
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#include "cpprl/image_preprocessor.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+namespace
+{
+// (77 R + 150 G + 29 B) / 256, rounded, which is what OpenCV uses for 8 bit
+// images
+const uint16_t red_weight = 77;
+const uint16_t green_weight = 150;
+const uint16_t blue_weight = 29;
+
+inline uint8_t grayscale_pixel(const uint8_t *rgb)
+{
+    return static_cast<uint8_t>((red_weight * rgb[0] + green_weight * rgb[1] +
+                                 blue_weight * rgb[2] + 128) >>
+                                8);
+}
+
+#ifdef CPPRL_SSSE3
+bool cpu_has_ssse3()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+// Shuffle masks that pick one channel of 16 interleaved RGB pixels out of
+// each of the 3 registers they are loaded into. Index channel * 3 + register.
+CPPRL_TARGET_SSSE3 std::array<__m128i, 9> make_deinterleave_masks()
+{
+    std::array<__m128i, 9> masks;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        for (int reg = 0; reg < 3; ++reg)
+        {
+            alignas(16) int8_t bytes[16];
+            for (int lane = 0; lane < 16; ++lane)
+            {
+                auto byte = lane * 3 + channel;
+                // A set high bit zeroes the lane
+                bytes[lane] = byte / 16 == reg ? static_cast<int8_t>(byte % 16) : -128;
+            }
+            masks[channel * 3 + reg] = _mm_load_si128(reinterpret_cast<const __m128i *>(bytes));
+        }
+    }
+    return masks;
+}
+
+CPPRL_TARGET_SSSE3 inline __m128i weighted_sum(__m128i red, __m128i green, __m128i blue)
+{
+    // Can't overflow 16 bits, since the weights add up to 256
+    auto sum = _mm_add_epi16(_mm_mullo_epi16(red, _mm_set1_epi16(red_weight)),
+                             _mm_mullo_epi16(green, _mm_set1_epi16(green_weight)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(blue, _mm_set1_epi16(blue_weight)));
+    sum = _mm_add_epi16(sum, _mm_set1_epi16(128));
+    return _mm_srli_epi16(sum, 8);
+}
+#endif
+}
+
+void elementwise_max(const uint8_t *a, const uint8_t *b, uint8_t *output, int64_t size)
+{
+    int64_t i = 0;
+#ifdef CPPRL_SSE2
+    for (; i + 16 <= size; i += 16)
+    {
+        auto a_chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        auto b_chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i),
+                         _mm_max_epu8(a_chunk, b_chunk));
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        output[i] = std::max(a[i], b[i]);
+    }
+}
+
+#ifdef CPPRL_SSSE3
+namespace
+{
+// Converts whole blocks of 16 pixels, returning how many pixels were done
+CPPRL_TARGET_SSSE3 int64_t rgb_to_grayscale_ssse3(const uint8_t *rgb, uint8_t *gray, int64_t num_pixels)
+{
+    int64_t i = 0;
+    static const auto masks = make_deinterleave_masks();
+    auto zero = _mm_setzero_si128();
+    for (; i + 16 <= num_pixels; i += 16)
+    {
+        __m128i registers[3];
+        for (int reg = 0; reg < 3; ++reg)
+        {
+            registers[reg] = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(rgb + i * 3 + reg * 16));
+        }
+        __m128i channels[3];
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            channels[channel] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(registers[0], masks[channel * 3]),
+                             _mm_shuffle_epi8(registers[1], masks[channel * 3 + 1])),
+                _mm_shuffle_epi8(registers[2], masks[channel * 3 + 2]));
+        }
+
+        auto low = weighted_sum(_mm_unpacklo_epi8(channels[0], zero),
+                                _mm_unpacklo_epi8(channels[1], zero),
+                                _mm_unpacklo_epi8(channels[2], zero));
+        auto high = weighted_sum(_mm_unpackhi_epi8(channels[0], zero),
+                                 _mm_unpackhi_epi8(channels[1], zero),
+                                 _mm_unpackhi_epi8(channels[2], zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(gray + i),
+                         _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+}
+#endif
+
+void rgb_to_grayscale(const uint8_t *rgb, uint8_t *gray, int64_t num_pixels)
+{
+    int64_t i = 0;
+#ifdef CPPRL_SSSE3
+    static const bool use_ssse3 = cpu_has_ssse3();
+    if (use_ssse3)
+    {
+        i = rgb_to_grayscale_ssse3(rgb, gray, num_pixels);
+    }
+#endif
+    for (; i < num_pixels; ++i)
+    {
+        gray[i] = grayscale_pixel(rgb + i * 3);
+    }
+}
+
+ImagePreprocessor::ImagePreprocessor(int64_t input_height,
+                                     int64_t input_width,
+                                     int64_t output_height,
+                                     int64_t output_width,
+                                     bool grayscale)
+    : input_height(input_height),
+      input_width(input_width),
+      output_height(output_height),
+      output_width(output_width),
+      grayscale(grayscale)
+{
+    if (input_height <= 0 || input_width <= 0 || output_height <= 0 || output_width <= 0)
+    {
+        throw std::runtime_error("Image sizes must be positive");
+    }
+
+    // Each output pixel averages the input pixels it covers, weighted by how
+    // much of each it covers
+    auto make_weights = [](int64_t input_size, int64_t output_size) {
+        std::vector<std::vector<AreaWeight>> weights(output_size);
+        double scale = static_cast<double>(input_size) / output_size;
+        for (int64_t i = 0; i < output_size; ++i)
+        {
+            double start = i * scale;
+            double end = std::min((i + 1) * scale, static_cast<double>(input_size));
+            auto first = static_cast<int64_t>(std::floor(start));
+            auto last = std::min(static_cast<int64_t>(std::ceil(end)), input_size);
+            for (auto source = first; source < last; ++source)
+            {
+                auto overlap = (std::min(end, source + 1.) -
+                                std::max(start, static_cast<double>(source)));
+                if (overlap > 1e-6)
+                {
+                    weights[i].push_back({source, static_cast<float>(overlap / (end - start))});
+                }
+            }
+        }
+        return weights;
+    };
+    row_weights = make_weights(input_height, output_height);
+    column_weights = make_weights(input_width, output_width);
+}
+
+void ImagePreprocessor::check_frames(const torch::Tensor &frames) const
+{
+    if (frames.dtype() != torch::kByte || frames.dim() != 4 ||
+        frames.size(1) != input_height || frames.size(2) != input_width ||
+        frames.size(3) != 3)
+    {
+        throw std::runtime_error("Expected uint8 frames of shape {batch, " +
+                                 std::to_string(input_height) + ", " +
+                                 std::to_string(input_width) + ", 3}");
+    }
+}
+
+torch::Tensor ImagePreprocessor::process(const torch::Tensor &frames,
+                                         const torch::Tensor &previous_frames) const
+{
+    auto output = torch::empty({frames.size(0), get_num_channels(), output_height, output_width},
+                               torch::kByte);
+    process(frames, previous_frames, output);
+    return output;
+}
+
+void ImagePreprocessor::process(const torch::Tensor &frames,
+                                const torch::Tensor &previous_frames,
+                                torch::Tensor output) const
+{
+    check_frames(frames);
+    if (previous_frames.defined())
+    {
+        check_frames(previous_frames);
+        if (previous_frames.size(0) != frames.size(0))
+        {
+            throw std::runtime_error("Got a different number of previous frames");
+        }
+    }
+    std::vector<int64_t> output_shape{frames.size(0), get_num_channels(),
+                                      output_height, output_width};
+    if (output.sizes().vec() != output_shape)
+    {
+        throw std::runtime_error("Output has the wrong shape");
+    }
+
+    // Anything we can't write to directly goes through a temporary
+    auto direct_output = (output.device() == torch::kCPU &&
+                          output.dtype() == torch::kByte &&
+                          output.is_contiguous());
+    auto destination = direct_output ? output : torch::empty(output_shape, torch::kByte);
+    auto input = frames.cpu().contiguous();
+    auto previous_input = previous_frames.defined()
+                              ? previous_frames.cpu().contiguous()
+                              : torch::Tensor();
+
+    auto frame_size = input_height * input_width * 3;
+    auto output_size = get_num_channels() * output_height * output_width;
+    at::parallel_for(0, frames.size(0), 1, [&](int64_t begin, int64_t end) {
+        std::vector<uint8_t> max_buffer, gray_buffer;
+        std::vector<float> row_buffer;
+        for (auto i = begin; i < end; ++i)
+        {
+            process_frame(input.data_ptr<uint8_t>() + i * frame_size,
+                          previous_input.defined()
+                              ? previous_input.data_ptr<uint8_t>() + i * frame_size
+                              : nullptr,
+                          destination.data_ptr<uint8_t>() + i * output_size,
+                          max_buffer, gray_buffer, row_buffer);
+        }
+    });
+
+    if (!direct_output)
+    {
+        output.copy_(destination);
+    }
+}
+
+void ImagePreprocessor::process_frame(const uint8_t *frame,
+                                      const uint8_t *previous_frame,
+                                      uint8_t *output,
+                                      std::vector<uint8_t> &max_buffer,
+                                      std::vector<uint8_t> &gray_buffer,
+                                      std::vector<float> &row_buffer) const
+{
+    auto num_pixels = input_height * input_width;
+    if (previous_frame)
+    {
+        max_buffer.resize(num_pixels * 3);
+        elementwise_max(frame, previous_frame, max_buffer.data(), num_pixels * 3);
+        frame = max_buffer.data();
+    }
+
+    if (grayscale)
+    {
+        gray_buffer.resize(num_pixels);
+        rgb_to_grayscale(frame, gray_buffer.data(), num_pixels);
+        resize_channel(gray_buffer.data(), 1, output, row_buffer);
+    }
+    else
+    {
+        // Resizing each channel separately does the HWC to CHW transpose
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            resize_channel(frame + channel, 3,
+                           output + channel * output_height * output_width,
+                           row_buffer);
+        }
+    }
+}
+
+void ImagePreprocessor::resize_channel(const uint8_t *input,
+                                       int64_t pixel_stride,
+                                       uint8_t *output,
+                                       std::vector<float> &row_buffer) const
+{
+    // Resize each row horizontally, then combine rows vertically
+    row_buffer.resize(input_height * output_width);
+    for (int64_t y = 0; y < input_height; ++y)
+    {
+        auto input_row = input + y * input_width * pixel_stride;
+        auto buffer_row = row_buffer.data() + y * output_width;
+        for (int64_t x = 0; x < output_width; ++x)
+        {
+            float sum = 0;
+            for (const auto &weight : column_weights[x])
+            {
+                sum += input_row[weight.source * pixel_stride] * weight.weight;
+            }
+            buffer_row[x] = sum;
+        }
+    }
+
+    std::vector<float> output_row(output_width);
+    for (int64_t y = 0; y < output_height; ++y)
+    {
+        std::fill(output_row.begin(), output_row.end(), 0.f);
+        for (const auto &weight : row_weights[y])
+        {
+            auto buffer_row = row_buffer.data() + weight.source * output_width;
+            for (int64_t x = 0; x < output_width; ++x)
+            {
+                output_row[x] += buffer_row[x] * weight.weight;
+            }
+        }
+        for (int64_t x = 0; x < output_width; ++x)
+        {
+            output[y * output_width + x] = static_cast<uint8_t>(
+                std::min(255.f, output_row[x] + 0.5f));
+        }
+    }
+}
+
+TEST_CASE("Image preprocessing")
+{
+    SUBCASE("rgb_to_grayscale() matches the scalar formula")
+    {
+        // Odd size to cover the leftover pixels after the SIMD loop
+        auto rgb = torch::randint(0, 256, {37, 3}).to(torch::kByte);
+        auto gray = torch::empty({37}, torch::kByte);
+        rgb_to_grayscale(rgb.data_ptr<uint8_t>(), gray.data_ptr<uint8_t>(), 37);
+
+        auto weights = torch::tensor({77, 150, 29}, torch::kLong);
+        auto expected = ((rgb.to(torch::kLong) * weights).sum(1) + 128) / 256;
+        CHECK(torch::equal(gray.to(torch::kLong), expected));
+
+        // Pure white stays white
+        auto white = torch::full({16, 3}, 255, torch::kByte);
+        rgb_to_grayscale(white.data_ptr<uint8_t>(), gray.data_ptr<uint8_t>(), 16);
+        CHECK(gray.narrow(0, 0, 16).eq(255).all().item().toBool());
+    }
+
+    SUBCASE("elementwise_max() takes the elementwise max")
+    {
+        auto a = torch::randint(0, 256, {37}).to(torch::kByte);
+        auto b = torch::randint(0, 256, {37}).to(torch::kByte);
+        auto output = torch::empty({37}, torch::kByte);
+        elementwise_max(a.data_ptr<uint8_t>(), b.data_ptr<uint8_t>(),
+                   output.data_ptr<uint8_t>(), 37);
+
+        CHECK(torch::equal(output, torch::max(a, b)));
+    }
+
+    SUBCASE("Halving the size averages 2x2 blocks")
+    {
+        ImagePreprocessor preprocessor(8, 6, 4, 3, false);
+        auto frames = torch::randint(0, 256, {2, 8, 6, 3}).to(torch::kByte);
+        auto output = preprocessor.process(frames);
+
+        auto expected = (torch::avg_pool2d(frames.permute({0, 3, 1, 2}).to(torch::kFloat), 2) + 0.5)
+                            .floor()
+                            .to(torch::kByte);
+        CHECK(torch::equal(output, expected));
+    }
+
+    SUBCASE("Resizes Atari frames to 84x84")
+    {
+        ImagePreprocessor preprocessor(210, 160);
+        auto frames = torch::full({3, 210, 160, 3}, 100, torch::kByte);
+        auto previous_frames = torch::full({3, 210, 160, 3}, 200, torch::kByte);
+        auto output = preprocessor.process(frames, previous_frames);
+
+        CHECK(output.sizes().vec() == std::vector<int64_t>{3, 1, 84, 84});
+        CHECK(output.eq(200).all().item().toBool());
+    }
+
+    SUBCASE("Can write into part of a bigger tensor")
+    {
+        ImagePreprocessor preprocessor(210, 160);
+        auto frames = torch::randint(0, 256, {2, 210, 160, 3}).to(torch::kByte);
+        auto frame_stack = torch::zeros({2, 4, 84, 84}, torch::kByte);
+        preprocessor.process(frames, torch::Tensor(), frame_stack.narrow(1, 3, 1));
+
+        CHECK(torch::equal(frame_stack.narrow(1, 3, 1), preprocessor.process(frames)));
+        CHECK(frame_stack.narrow(1, 0, 3).eq(0).all().item().toBool());
+    }
+
+    SUBCASE("Throws on the wrong frame shape")
+    {
+        ImagePreprocessor preprocessor(210, 160);
+        CHECK_THROWS(preprocessor.process(torch::zeros({1, 84, 84, 3}, torch::kByte)));
+        CHECK_THROWS(preprocessor.process(torch::zeros({1, 210, 160, 3})));
+    }
+}
+}
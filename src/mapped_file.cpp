@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <c10/util/ArrayRef.h>
+#include <torch/torch.h>
+
+#include "cpprl/mapped_file.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+namespace
+{
+size_t get_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return static_cast<size_t>(system_info.dwPageSize);
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+}
+
+MappedFile::MappedFile(void *data, size_t size) : data(data), size(size) {}
+
+std::shared_ptr<MappedFile> MappedFile::create(const std::string &path, size_t size)
+{
+#ifdef _WIN32
+    // Deleted once the last handle and view are gone, so the file doesn't
+    // outlive the mapping
+    HANDLE file = CreateFileA(path.c_str(),
+                              GENERIC_READ | GENERIC_WRITE,
+                              0,
+                              nullptr,
+                              CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                              nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error("Couldn't open " + path + ": error " +
+                                 std::to_string(GetLastError()));
+    }
+
+    // Mapping past the end of the file grows it to size
+    auto size_64 = static_cast<uint64_t>(size);
+    HANDLE mapping = CreateFileMappingA(file,
+                                        nullptr,
+                                        PAGE_READWRITE,
+                                        static_cast<DWORD>(size_64 >> 32),
+                                        static_cast<DWORD>(size_64 & 0xFFFFFFFF),
+                                        nullptr);
+    if (mapping == nullptr)
+    {
+        auto error = GetLastError();
+        CloseHandle(file);
+        throw std::runtime_error("Couldn't resize " + path + ": error " +
+                                 std::to_string(error));
+    }
+
+    void *data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    auto error = GetLastError();
+    // The view keeps the mapping and the file alive
+    CloseHandle(mapping);
+    CloseHandle(file);
+    if (data == nullptr)
+    {
+        throw std::runtime_error("Couldn't map " + path + ": error " +
+                                 std::to_string(error));
+    }
+
+    return std::shared_ptr<MappedFile>(new MappedFile(data, size));
+#else
+    int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (file < 0)
+    {
+        throw std::runtime_error("Couldn't open " + path + ": " + std::strerror(errno));
+    }
+    if (ftruncate(file, static_cast<off_t>(size)) != 0)
+    {
+        auto error = std::string(std::strerror(errno));
+        close(file);
+        unlink(path.c_str());
+        throw std::runtime_error("Couldn't resize " + path + ": " + error);
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    auto error = std::string(std::strerror(errno));
+    // The mapping keeps the file alive
+    close(file);
+    unlink(path.c_str());
+    if (data == MAP_FAILED)
+    {
+        throw std::runtime_error("Couldn't map " + path + ": " + error);
+    }
+
+    return std::shared_ptr<MappedFile>(new MappedFile(data, size));
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+torch::Tensor MappedFile::as_tensor(c10::IntArrayRef shape)
+{
+    int64_t numel = 1;
+    for (const auto dimension : shape)
+    {
+        numel *= dimension;
+    }
+    if (numel * sizeof(float) > size)
+    {
+        throw std::runtime_error("Tensor of " + std::to_string(numel) +
+                                 " floats doesn't fit in a mapped file of " +
+                                 std::to_string(size) + " bytes");
+    }
+
+    auto self = shared_from_this();
+    return torch::from_blob(data, shape, [self](void *) {}, torch::kFloat);
+}
+
+void MappedFile::prefetch(size_t offset, size_t length) const
+{
+    if (offset >= size)
+    {
+        return;
+    }
+    static const size_t page_size = get_page_size();
+    auto start = offset / page_size * page_size;
+    auto end = std::min(offset + length, size);
+#ifdef _WIN32
+    // PrefetchVirtualMemory() needs Windows 8, older versions just page in on
+    // demand
+#if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = static_cast<char *>(data) + start;
+    range.NumberOfBytes = end - start;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+#else
+    madvise(static_cast<char *>(data) + start, end - start, MADV_WILLNEED);
+#endif
+}
+
+TEST_CASE("MappedFile")
+{
+    auto file = MappedFile::create("cpprl_mapped_file_test.bin", 4096 * sizeof(float));
+
+    SUBCASE("Tensors read back what was written")
+    {
+        auto tensor = file->as_tensor({64, 64});
+        auto values = torch::rand({64, 64});
+        tensor.copy_(values);
+
+        CHECK(torch::equal(file->as_tensor({64, 64}), values));
+    }
+
+    SUBCASE("Tensors keep the mapping alive")
+    {
+        auto tensor = file->as_tensor({4096});
+        file.reset();
+        tensor.fill_(1);
+
+        CHECK(tensor.sum().item().toFloat() == 4096);
+    }
+
+    SUBCASE("Throws if the tensor is too large")
+    {
+        CHECK_THROWS(file->as_tensor({4097}));
+    }
+
+    SUBCASE("Prefetching doesn't crash")
+    {
+        file->prefetch(100, 1000);
+        file->prefetch(0, 1 << 20);
+        file->prefetch(1 << 20, 10);
+    }
+}
+}
@@ -0,0 +1,111 @@
+#include <cstdint>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/memory_usage.h"
+#include "cpprl/optimizers/fused_adam.h"
+#include "cpprl/optimizers/fused_lamb.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+int64_t get_optimizer_state_bytes(const torch::optim::Adam &optimizer)
+{
+    return (get_tensor_bytes(optimizer.exp_average_buffers) +
+            get_tensor_bytes(optimizer.exp_average_sq_buffers) +
+            get_tensor_bytes(optimizer.max_exp_average_sq_buffers));
+}
+
+int64_t get_optimizer_state_bytes(const torch::optim::RMSprop &optimizer)
+{
+    return (get_tensor_bytes(optimizer.square_average_buffers) +
+            get_tensor_bytes(optimizer.momentum_buffers) +
+            get_tensor_bytes(optimizer.grad_average_buffers));
+}
+
+int64_t get_optimizer_state_bytes(const FlatOptimizer &optimizer)
+{
+    return get_tensor_bytes(optimizer.get_state());
+}
+
+int64_t get_tensor_bytes(const torch::Tensor &tensor)
+{
+    if (!tensor.defined())
+    {
+        return 0;
+    }
+    return tensor.numel() * static_cast<int64_t>(tensor.element_size());
+}
+
+int64_t get_tensor_bytes(const std::vector<torch::Tensor> &tensors)
+{
+    int64_t bytes = 0;
+    for (const auto &tensor : tensors)
+    {
+        bytes += get_tensor_bytes(tensor);
+    }
+    return bytes;
+}
+
+int64_t get_total_bytes(const std::vector<MemoryUsage> &usage)
+{
+    int64_t bytes = 0;
+    for (const auto &part : usage)
+    {
+        bytes += part.bytes;
+    }
+    return bytes;
+}
+
+TEST_CASE("Memory usage")
+{
+    SUBCASE("Counts tensor bytes")
+    {
+        CHECK(get_tensor_bytes(torch::zeros({3, 4})) == 48);
+        CHECK(get_tensor_bytes(torch::zeros({3, 4}, torch::kByte)) == 12);
+        CHECK(get_tensor_bytes(torch::zeros({3, 4}).narrow(1, 0, 2)) == 24);
+        CHECK(get_tensor_bytes(torch::Tensor()) == 0);
+        CHECK(get_tensor_bytes({torch::zeros({2}), torch::zeros({2}, torch::kDouble)}) == 24);
+    }
+
+    SUBCASE("Counts Adam moments once they exist")
+    {
+        auto parameter = torch::zeros({10}, torch::requires_grad());
+        torch::optim::Adam optimizer({parameter}, torch::optim::AdamOptions(1e-3));
+        CHECK(get_optimizer_state_bytes(optimizer) == 0);
+
+        parameter.sum().backward();
+        optimizer.step();
+        CHECK(get_optimizer_state_bytes(optimizer) == 80);
+    }
+
+    SUBCASE("Counts RMSprop averages once they exist")
+    {
+        auto parameter = torch::zeros({10}, torch::requires_grad());
+        torch::optim::RMSprop optimizer({parameter}, torch::optim::RMSpropOptions(1e-3));
+        parameter.sum().backward();
+        optimizer.step();
+        CHECK(get_optimizer_state_bytes(optimizer) == 40);
+    }
+
+    SUBCASE("Counts fused optimizer state up front")
+    {
+        auto parameter = torch::zeros({10}, torch::requires_grad());
+        FusedAdam optimizer({parameter}, 1e-3);
+        CHECK(get_optimizer_state_bytes(optimizer) == 80);
+    }
+
+    SUBCASE("Counts LAMB's update buffer")
+    {
+        auto parameter = torch::zeros({10}, torch::requires_grad());
+        FusedLamb optimizer({parameter}, 1e-3);
+        CHECK(get_optimizer_state_bytes(optimizer) == 120);
+    }
+
+    SUBCASE("Adds up totals")
+    {
+        CHECK(get_total_bytes({{"a", 3}, {"b", 4}}) == 7);
+    }
+}
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <stdexcept>
+
 #include <torch/torch.h>
 
 #include "cpprl/model/cnn_base.h"
@@ -6,25 +9,78 @@
 
 namespace cpprl
 {
+const unsigned int num_layers = 4;
+
+static nn::Sequential make_layers(unsigned int num_inputs,
+                                  unsigned int hidden_size,
+                                  unsigned int first_layer,
+                                  unsigned int last_layer)
+{
+    nn::Sequential layers;
+    for (unsigned int i = first_layer; i < last_layer; ++i)
+    {
+        switch (i)
+        {
+        case 0:
+            layers->push_back(nn::Conv2d(nn::Conv2dOptions(num_inputs, 32, 8).stride(4)));
+            break;
+        case 1:
+            layers->push_back(nn::Conv2d(nn::Conv2dOptions(32, 64, 4).stride(2)));
+            break;
+        case 2:
+            layers->push_back(nn::Conv2d(nn::Conv2dOptions(64, 32, 3).stride(1)));
+            break;
+        default:
+            layers->push_back(nn::Linear(32 * 7 * 7, hidden_size));
+            break;
+        }
+        layers->push_back(nn::Functional(torch::relu));
+        if (i == 2)
+        {
+            layers->push_back(Flatten());
+        }
+    }
+    return layers;
+}
+
 CnnBase::CnnBase(unsigned int num_inputs,
                  bool recurrent,
-                 unsigned int hidden_size)
+                 unsigned int hidden_size,
+                 int num_shared_layers)
     : NNBase(recurrent, hidden_size, hidden_size),
-      main(nn::Conv2d(nn::Conv2dOptions(num_inputs, 32, 8).stride(4)),
-           nn::Functional(torch::relu),
-           nn::Conv2d(nn::Conv2dOptions(32, 64, 4).stride(2)),
-           nn::Functional(torch::relu),
-           nn::Conv2d(nn::Conv2dOptions(64, 32, 3).stride(1)),
-           nn::Functional(torch::relu),
-           Flatten(),
-           nn::Linear(32 * 7 * 7, hidden_size),
-           nn::Functional(torch::relu)),
-      critic_linear(nn::Linear(hidden_size, 1))
+      main(nullptr),
+      actor(nullptr),
+      critic(nullptr),
+      critic_linear(nn::Linear(hidden_size, 1)),
+      num_inputs(num_inputs),
+      num_shared_layers(num_shared_layers < 0
+                            ? num_layers
+                            : std::min(static_cast<unsigned int>(num_shared_layers),
+                                       num_layers))
 {
-    register_module("main", main);
+    // The GRU runs on the trunk's output, so it can't feed two towers
+    if (recurrent && this->num_shared_layers < num_layers)
+    {
+        throw std::runtime_error("Recurrent CnnBases have to share all their layers");
+    }
+    if (this->num_shared_layers > 0)
+    {
+        main = make_layers(num_inputs, hidden_size, 0, this->num_shared_layers);
+        register_module("main", main);
+        init_weights(main->named_parameters(), sqrt(2.), 0);
+    }
+    if (this->num_shared_layers < num_layers)
+    {
+        actor = make_layers(num_inputs, hidden_size,
+                            this->num_shared_layers, num_layers);
+        critic = make_layers(num_inputs, hidden_size,
+                             this->num_shared_layers, num_layers);
+        register_module("actor", actor);
+        register_module("critic", critic);
+        init_weights(actor->named_parameters(), sqrt(2.), 0);
+        init_weights(critic->named_parameters(), sqrt(2.), 0);
+    }
     register_module("critic_linear", critic_linear);
-
-    init_weights(main->named_parameters(), sqrt(2.), 0);
     init_weights(critic_linear->named_parameters(), 1, 0);
 
     train();
@@ -34,16 +90,35 @@ std::vector<torch::Tensor> CnnBase::forward(torch::Tensor inputs,
                                             torch::Tensor rnn_hxs,
                                             torch::Tensor masks)
 {
-    auto x = main->forward(inputs / 255.);
+    auto x = normalized_inputs ? inputs : inputs / 255.;
+    if (main)
+    {
+        x = main->forward(x);
+    }
+    auto hidden_critic = critic ? critic->forward(x) : x;
+    auto hidden_actor = actor ? actor->forward(x) : x;
 
     if (is_recurrent())
     {
-        auto gru_output = forward_gru(x, rnn_hxs, masks);
-        x = gru_output[0];
+        // Recurrent bases share the whole trunk
+        auto gru_output = forward_gru(hidden_actor, rnn_hxs, masks);
+        hidden_actor = gru_output[0];
+        hidden_critic = hidden_actor;
         rnn_hxs = gru_output[1];
     }
 
-    return {critic_linear->forward(x), x, rnn_hxs};
+    return {critic_linear->forward(hidden_critic), hidden_actor, rnn_hxs};
+}
+
+std::vector<int64_t> CnnBase::get_normalizer_shape() const
+{
+    return {num_inputs, 1, 1};
+}
+
+bool CnnBase::transform_value_output(torch::Tensor scale, torch::Tensor shift)
+{
+    transform_linear_output(*critic_linear->ptr<nn::LinearImpl>(0), scale, shift);
+    return true;
 }
 
 TEST_CASE("CnnBase")
@@ -77,5 +152,32 @@ TEST_CASE("CnnBase")
         CHECK(outputs[2].size(0) == 4);
         CHECK(outputs[2].size(1) == 10);
     }
+
+    SUBCASE("Output tensors are correct shapes with separate towers")
+    {
+        auto separate_base = std::make_shared<CnnBase>(3, false, 10, 2);
+        CHECK(separate_base->get_num_shared_layers() == 2);
+
+        auto inputs = torch::rand({4, 3, 84, 84});
+        auto rnn_hxs = torch::rand({4, 10});
+        auto masks = torch::zeros({4, 1});
+        auto outputs = separate_base->forward(inputs, rnn_hxs, masks);
+
+        REQUIRE(outputs.size() == 3);
+
+        // Critic
+        CHECK(outputs[0].size(0) == 4);
+        CHECK(outputs[0].size(1) == 1);
+
+        // Actor
+        CHECK(outputs[1].size(0) == 4);
+        CHECK(outputs[1].size(1) == 10);
+    }
+
+    SUBCASE("Recurrent bases can't have separate towers")
+    {
+        CHECK_THROWS(CnnBase(3, true, 10, 2));
+        CHECK_NOTHROW(CnnBase(3, true, 10, 4));
+    }
 }
 }
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/model/impala_cnn_base.h"
+#include "cpprl/model/model_utils.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+ResidualBlockImpl::ResidualBlockImpl(unsigned int channels)
+    : conv_1(nn::Conv2dOptions(channels, channels, 3).padding(1)),
+      conv_2(nn::Conv2dOptions(channels, channels, 3).padding(1))
+{
+    register_module("conv_1", conv_1);
+    register_module("conv_2", conv_2);
+}
+
+torch::Tensor ResidualBlockImpl::forward(torch::Tensor x)
+{
+    // The input is needed for the skip connection, so only the intermediate
+    // activations are done in-place
+    auto output = conv_1(torch::relu(x));
+    output.relu_();
+    output = conv_2(output);
+    return output.add_(x);
+}
+
+ImpalaStageImpl::ImpalaStageImpl(unsigned int in_channels,
+                                 unsigned int out_channels,
+                                 bool use_max_pool)
+    : conv(nn::Conv2dOptions(in_channels, out_channels, 3)
+               .stride(use_max_pool ? 1 : 2)
+               .padding(1)),
+      residual_block_1(out_channels),
+      residual_block_2(out_channels),
+      use_max_pool(use_max_pool)
+{
+    register_module("conv", conv);
+    register_module("residual_block_1", residual_block_1);
+    register_module("residual_block_2", residual_block_2);
+}
+
+torch::Tensor ImpalaStageImpl::forward(torch::Tensor x)
+{
+    x = conv(x);
+    if (use_max_pool)
+    {
+        x = torch::max_pool2d(x, {3, 3}, {2, 2}, {1, 1});
+    }
+    x = residual_block_1(x);
+    return residual_block_2(x);
+}
+
+ImpalaCnnBase::ImpalaCnnBase(std::vector<int64_t> observation_shape,
+                             bool recurrent,
+                             unsigned int hidden_size,
+                             std::vector<int64_t> stage_channels,
+                             bool use_max_pool,
+                             bool channels_last)
+    : NNBase(recurrent, hidden_size, hidden_size),
+      linear(nullptr),
+      critic_linear(nullptr),
+      observation_shape(observation_shape),
+      channels_last(channels_last)
+{
+    if (observation_shape.size() != 3)
+    {
+        throw std::runtime_error("ImpalaCnnBase needs a {channels, height, width} "
+                                 "observation shape");
+    }
+
+    auto in_channels = observation_shape[0];
+    for (const auto out_channels : stage_channels)
+    {
+        stages->push_back(ImpalaStage(in_channels, out_channels, use_max_pool));
+        in_channels = out_channels;
+    }
+
+    // Work out the flattened output size for this resolution
+    int64_t flattened_size;
+    {
+        torch::NoGradGuard no_grad;
+        std::vector<int64_t> dummy_shape{1};
+        dummy_shape.insert(dummy_shape.end(),
+                           observation_shape.begin(), observation_shape.end());
+        flattened_size = stages->forward(torch::zeros(dummy_shape)).numel();
+    }
+
+    linear = nn::Linear(flattened_size, hidden_size);
+    critic_linear = nn::Linear(hidden_size, 1);
+
+    register_module("stages", stages);
+    register_module("linear", linear);
+    register_module("critic_linear", critic_linear);
+
+    init_weights(stages->named_parameters(), sqrt(2.), 0);
+    init_weights(linear->named_parameters(), sqrt(2.), 0);
+    init_weights(critic_linear->named_parameters(), 1, 0);
+
+    train();
+}
+
+std::vector<torch::Tensor> ImpalaCnnBase::forward(torch::Tensor inputs,
+                                                  torch::Tensor rnn_hxs,
+                                                  torch::Tensor masks)
+{
+    auto x = normalized_inputs ? inputs : inputs / 255.;
+    if (channels_last)
+    {
+        x = x.contiguous(torch::MemoryFormat::ChannelsLast);
+    }
+
+    x = stages->forward(x);
+    x.relu_();
+    // reshape() rather than view(), channels last activations aren't
+    // contiguous in NCHW order
+    x = linear(x.reshape({x.size(0), -1}));
+    x.relu_();
+
+    if (is_recurrent())
+    {
+        auto gru_output = forward_gru(x, rnn_hxs, masks);
+        x = gru_output[0];
+        rnn_hxs = gru_output[1];
+    }
+
+    return {critic_linear->forward(x), x, rnn_hxs};
+}
+
+std::vector<int64_t> ImpalaCnnBase::get_normalizer_shape() const
+{
+    return {observation_shape[0], 1, 1};
+}
+
+bool ImpalaCnnBase::transform_value_output(torch::Tensor scale, torch::Tensor shift)
+{
+    transform_linear_output(*critic_linear, scale, shift);
+    return true;
+}
+
+TEST_CASE("ImpalaCnnBase")
+{
+    SUBCASE("Sanity checks")
+    {
+        auto base = std::make_shared<ImpalaCnnBase>(std::vector<int64_t>{3, 64, 48},
+                                                    true, 10);
+
+        CHECK(base->is_recurrent() == true);
+        CHECK(base->get_hidden_size() == 10);
+    }
+
+    SUBCASE("Rejects observations that aren't images")
+    {
+        CHECK_THROWS(ImpalaCnnBase(std::vector<int64_t>{5}));
+    }
+
+    SUBCASE("Output tensors are correct shapes")
+    {
+        auto check_outputs = [](ImpalaCnnBase &base, int64_t height, int64_t width) {
+            auto inputs = torch::rand({4, 3, height, width});
+            auto rnn_hxs = torch::rand({4, 10});
+            auto masks = torch::zeros({4, 1});
+            auto outputs = base.forward(inputs, rnn_hxs, masks);
+
+            REQUIRE(outputs.size() == 3);
+
+            // Critic
+            CHECK(outputs[0].size(0) == 4);
+            CHECK(outputs[0].size(1) == 1);
+
+            // Actor
+            CHECK(outputs[1].size(0) == 4);
+            CHECK(outputs[1].size(1) == 10);
+
+            // Hidden state
+            CHECK(outputs[2].size(0) == 4);
+            CHECK(outputs[2].size(1) == 10);
+        };
+
+        SUBCASE("Recurrent")
+        {
+            ImpalaCnnBase base({3, 64, 48}, true, 10);
+            check_outputs(base, 64, 48);
+        }
+
+        SUBCASE("Non-recurrent")
+        {
+            ImpalaCnnBase base({3, 64, 48}, false, 10);
+            check_outputs(base, 64, 48);
+        }
+
+        SUBCASE("Without max pooling")
+        {
+            ImpalaCnnBase base({3, 84, 84}, false, 10, {8, 16}, false);
+            check_outputs(base, 84, 84);
+        }
+
+        SUBCASE("Channels last")
+        {
+            ImpalaCnnBase base({3, 84, 84}, false, 10, {16, 32, 32}, true, true);
+            check_outputs(base, 84, 84);
+        }
+    }
+
+    SUBCASE("Channels last gives the same outputs as NCHW")
+    {
+        ImpalaCnnBase base({3, 84, 84}, false, 10);
+        ImpalaCnnBase channels_last_base({3, 84, 84}, false, 10, {16, 32, 32}, true, true);
+        {
+            torch::NoGradGuard no_grad;
+            auto parameters = base.parameters();
+            auto channels_last_parameters = channels_last_base.parameters();
+            REQUIRE(parameters.size() == channels_last_parameters.size());
+            for (size_t i = 0; i < parameters.size(); ++i)
+            {
+                channels_last_parameters[i].copy_(parameters[i]);
+            }
+        }
+
+        auto inputs = torch::rand({4, 3, 84, 84}) * 255;
+        auto rnn_hxs = torch::zeros({4, 10});
+        auto masks = torch::ones({4, 1});
+        auto outputs = base.forward(inputs, rnn_hxs, masks);
+        auto channels_last_outputs = channels_last_base.forward(inputs, rnn_hxs, masks);
+
+        CHECK(torch::allclose(channels_last_outputs[0], outputs[0], 1e-4, 1e-5));
+        CHECK(torch::allclose(channels_last_outputs[1], outputs[1], 1e-4, 1e-5));
+    }
+}
+}
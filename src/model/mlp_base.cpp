@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <torch/torch.h>
 
 #include "cpprl/model/mlp_base.h"
@@ -6,14 +8,37 @@
 
 namespace cpprl
 {
+const unsigned int num_layers = 2;
+
+static nn::Sequential make_layers(unsigned int num_inputs,
+                                  unsigned int hidden_size,
+                                  unsigned int first_layer,
+                                  unsigned int last_layer)
+{
+    nn::Sequential layers;
+    for (unsigned int i = first_layer; i < last_layer; ++i)
+    {
+        layers->push_back(nn::Linear(i == 0 ? num_inputs : hidden_size,
+                                     hidden_size));
+        layers->push_back(nn::Functional(torch::tanh));
+    }
+    return layers;
+}
+
 MlpBase::MlpBase(unsigned int num_inputs,
                  bool recurrent,
-                 unsigned int hidden_size)
+                 unsigned int hidden_size,
+                 int num_shared_layers)
     : NNBase(recurrent, num_inputs, hidden_size),
+      trunk(nullptr),
       actor(nullptr),
       critic(nullptr),
       critic_linear(nullptr),
-      num_inputs(num_inputs)
+      num_inputs(num_inputs),
+      num_shared_layers(num_shared_layers < 0
+                            ? num_layers
+                            : std::min(static_cast<unsigned int>(num_shared_layers),
+                                       num_layers))
 {
     if (recurrent)
     {
@@ -23,27 +48,56 @@ MlpBase::MlpBase(unsigned int num_inputs,
         num_inputs = hidden_size;
     }
 
-    actor = nn::Sequential(nn::Linear(num_inputs, hidden_size),
-                           nn::Functional(torch::tanh),
-                           nn::Linear(hidden_size, hidden_size),
-                           nn::Functional(torch::tanh));
-    critic = nn::Sequential(nn::Linear(num_inputs, hidden_size),
-                            nn::Functional(torch::tanh),
-                            nn::Linear(hidden_size, hidden_size),
-                            nn::Functional(torch::tanh));
+    // Shared layers are computed once per forward pass and feed both heads
+    if (this->num_shared_layers > 0)
+    {
+        trunk = make_layers(num_inputs, hidden_size, 0, this->num_shared_layers);
+        register_module("trunk", trunk);
+        init_weights(trunk->named_parameters(), sqrt(2.), 0);
+    }
+    if (this->num_shared_layers < num_layers)
+    {
+        actor = make_layers(num_inputs, hidden_size,
+                            this->num_shared_layers, num_layers);
+        critic = make_layers(num_inputs, hidden_size,
+                             this->num_shared_layers, num_layers);
+        register_module("actor", actor);
+        register_module("critic", critic);
+        init_weights(actor->named_parameters(), sqrt(2.), 0);
+        init_weights(critic->named_parameters(), sqrt(2.), 0);
+    }
     critic_linear = nn::Linear(hidden_size, 1);
-
-    register_module("actor", actor);
-    register_module("critic", critic);
     register_module("critic_linear", critic_linear);
-
-    init_weights(actor->named_parameters(), sqrt(2.), 0);
-    init_weights(critic->named_parameters(), sqrt(2.), 0);
     init_weights(critic_linear->named_parameters(), sqrt(2.), 0);
 
     train();
 }
 
+void MlpBase::clear_input_transform()
+{
+    folded_weights.clear();
+    folded_biases.clear();
+}
+
+bool MlpBase::fold_input_transform(torch::Tensor scale, torch::Tensor shift)
+{
+    if (is_recurrent())
+    {
+        return false;
+    }
+
+    torch::NoGradGuard no_grad;
+    clear_input_transform();
+    // W * (x * scale + shift) + b = (W * scale) * x + (W * shift + b)
+    for (const auto &tower : get_input_towers())
+    {
+        auto linear = tower->ptr<nn::LinearImpl>(0);
+        folded_weights.push_back(linear->weight * scale);
+        folded_biases.push_back(linear->bias + torch::mv(linear->weight, shift));
+    }
+    return true;
+}
+
 std::vector<torch::Tensor> MlpBase::forward(torch::Tensor inputs,
                                             torch::Tensor rnn_hxs,
                                             torch::Tensor masks)
@@ -57,12 +111,55 @@ std::vector<torch::Tensor> MlpBase::forward(torch::Tensor inputs,
         rnn_hxs = gru_output[1];
     }
 
-    auto hidden_critic = critic->forward(x);
-    auto hidden_actor = actor->forward(x);
+    bool use_folded = !folded_weights.empty() && !torch::GradMode::is_enabled();
+    if (trunk)
+    {
+        x = forward_tower(trunk, x, use_folded ? 0 : -1);
+        use_folded = false;
+    }
+    auto hidden_critic = critic ? forward_tower(critic, x, use_folded ? 1 : -1) : x;
+    auto hidden_actor = actor ? forward_tower(actor, x, use_folded ? 0 : -1) : x;
 
     return {critic_linear->forward(hidden_critic), hidden_actor, rnn_hxs};
 }
 
+torch::Tensor MlpBase::forward_tower(nn::Sequential &tower,
+                                     torch::Tensor x,
+                                     int folded_index)
+{
+    if (folded_index < 0)
+    {
+        return tower->forward(x);
+    }
+
+    x = torch::linear(x, folded_weights[folded_index], folded_biases[folded_index]);
+    for (auto module = tower->begin() + 1; module != tower->end(); ++module)
+    {
+        x = module->forward(x);
+    }
+    return x;
+}
+
+std::vector<nn::Sequential> MlpBase::get_input_towers() const
+{
+    if (trunk)
+    {
+        return {trunk};
+    }
+    return {actor, critic};
+}
+
+std::vector<int64_t> MlpBase::get_normalizer_shape() const
+{
+    return {num_inputs};
+}
+
+bool MlpBase::transform_value_output(torch::Tensor scale, torch::Tensor shift)
+{
+    transform_linear_output(*critic_linear, scale, shift);
+    return true;
+}
+
 TEST_CASE("MlpBase")
 {
     SUBCASE("Recurrent")
@@ -129,5 +226,86 @@ TEST_CASE("MlpBase")
             CHECK(outputs[2].size(1) == 10);
         }
     }
+
+    SUBCASE("Folded input transform")
+    {
+        for (int num_shared_layers : {0, share_all_layers})
+        {
+            auto base = MlpBase(5, false, 10, num_shared_layers);
+            auto scale = torch::rand({5}) + 0.5;
+            auto shift = torch::rand({5});
+            auto inputs = torch::rand({4, 5});
+            auto rnn_hxs = torch::zeros({4, 10});
+            auto masks = torch::ones({4, 1});
+
+            auto expected = base.forward(inputs * scale + shift, rnn_hxs, masks);
+            REQUIRE(base.fold_input_transform(scale, shift));
+            std::vector<torch::Tensor> actual;
+            {
+                torch::NoGradGuard no_grad;
+                actual = base.forward(inputs, rnn_hxs, masks);
+            }
+
+            CHECK(torch::allclose(actual[0], expected[0], 1e-4, 1e-5));
+            CHECK(torch::allclose(actual[1], expected[1], 1e-4, 1e-5));
+        }
+
+        SUBCASE("Isn't supported by recurrent bases")
+        {
+            auto base = MlpBase(5, true, 10);
+            CHECK(!base.fold_input_transform(torch::ones({5}), torch::zeros({5})));
+        }
+    }
+
+    SUBCASE("Shared trunk")
+    {
+        auto separate_base = MlpBase(5, false, 10);
+        auto partial_base = MlpBase(5, false, 10, 1);
+        auto shared_base = MlpBase(5, false, 10, share_all_layers);
+
+        SUBCASE("Sanity checks")
+        {
+            CHECK(separate_base.get_num_shared_layers() == 0);
+            CHECK(partial_base.get_num_shared_layers() == 1);
+            CHECK(shared_base.get_num_shared_layers() == 2);
+        }
+
+        SUBCASE("Sharing layers reduces the parameter count")
+        {
+            auto count_parameters = [](const MlpBase &base) {
+                int64_t count = 0;
+                for (const auto &parameter : base.parameters())
+                {
+                    count += parameter.numel();
+                }
+                return count;
+            };
+
+            CHECK(count_parameters(partial_base) < count_parameters(separate_base));
+            CHECK(count_parameters(shared_base) < count_parameters(partial_base));
+        }
+
+        SUBCASE("Output tensors are correct shapes")
+        {
+            auto inputs = torch::rand({4, 5});
+            auto rnn_hxs = torch::rand({4, 10});
+            auto masks = torch::zeros({4, 1});
+
+            for (auto base : {&partial_base, &shared_base})
+            {
+                auto outputs = base->forward(inputs, rnn_hxs, masks);
+
+                REQUIRE(outputs.size() == 3);
+
+                // Critic
+                CHECK(outputs[0].size(0) == 4);
+                CHECK(outputs[0].size(1) == 1);
+
+                // Actor
+                CHECK(outputs[1].size(0) == 4);
+                CHECK(outputs[1].size(1) == 10);
+            }
+        }
+    }
 }
 }
\ No newline at end of file
@@ -1,3 +1,8 @@
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 #include <torch/torch.h>
 
 #include "cpprl/model/model_utils.h"
@@ -7,40 +12,80 @@ using namespace torch;
 
 namespace cpprl
 {
-torch::Tensor orthogonal_(Tensor tensor, double gain)
+namespace
 {
-    NoGradGuard guard;
+thread_local OrthogonalInitializer *deferred_initializer = nullptr;
+}
 
+void OrthogonalInitializer::add(torch::Tensor weight, double gain)
+{
     AT_CHECK(
-        tensor.ndimension() >= 2,
+        weight.ndimension() >= 2,
         "Only tensors with 2 or more dimensions are supported");
+    weights.emplace_back(weight, gain);
+}
 
-    const auto rows = tensor.size(0);
-    const auto columns = tensor.numel() / rows;
-    auto flattened = torch::randn({rows, columns});
+void OrthogonalInitializer::add(const OrthogonalInitializer &other)
+{
+    weights.insert(weights.end(), other.weights.begin(), other.weights.end());
+}
 
-    if (rows < columns)
+void OrthogonalInitializer::run()
+{
+    NoGradGuard guard;
+
+    // Ordered by shape, so the random draws only depend on the order the
+    // weights were added in
+    std::map<std::pair<int64_t, int64_t>, std::vector<unsigned int>> groups;
+    for (unsigned int i = 0; i < weights.size(); ++i)
     {
-        flattened.t_();
+        const auto rows = weights[i].first.size(0);
+        groups[{rows, weights[i].first.numel() / rows}].push_back(i);
     }
 
-    // Compute the qr factorization
-    Tensor q, r;
-    std::tie(q, r) = torch::qr(flattened);
-    // Make Q uniform according to https://arxiv.org/pdf/math-ph/0609050.pdf
-    auto d = torch::diag(r, 0);
-    auto ph = d.sign();
-    q *= ph;
-
-    if (rows < columns)
+    for (const auto &group : groups)
     {
-        q.t_();
+        const auto rows = group.first.first;
+        const auto columns = group.first.second;
+        const auto &indices = group.second;
+        auto flattened = torch::randn({static_cast<int64_t>(indices.size()), rows, columns});
+
+        if (rows < columns)
+        {
+            flattened = flattened.transpose(1, 2);
+        }
+
+        // Compute the qr factorizations
+        Tensor q, r;
+        std::tie(q, r) = torch::qr(flattened);
+        // Make Q uniform according to https://arxiv.org/pdf/math-ph/0609050.pdf
+        auto ph = torch::diagonal(r, 0, -2, -1).sign();
+        q *= ph.unsqueeze(1);
+
+        if (rows < columns)
+        {
+            q = q.transpose(1, 2);
+        }
+
+        for (unsigned int i = 0; i < indices.size(); ++i)
+        {
+            auto &weight = weights[indices[i]];
+            weight.first.view({rows, columns}).copy_(q[i]).mul_(weight.second);
+        }
     }
 
-    tensor.view_as(q).copy_(q);
-    tensor.mul_(gain);
+    weights.clear();
+}
 
-    return tensor;
+DeferOrthogonalInit::DeferOrthogonalInit(OrthogonalInitializer &initializer)
+    : previous(deferred_initializer)
+{
+    deferred_initializer = &initializer;
+}
+
+DeferOrthogonalInit::~DeferOrthogonalInit()
+{
+    deferred_initializer = previous;
 }
 
 torch::Tensor FlattenImpl::forward(torch::Tensor x)
@@ -52,6 +97,8 @@ void init_weights(torch::OrderedDict<std::string, torch::Tensor> parameters,
                   double weight_gain,
                   double bias_gain)
 {
+    OrthogonalInitializer initializer;
+    auto &weight_initializer = deferred_initializer ? *deferred_initializer : initializer;
     for (const auto &parameter : parameters)
     {
         if (parameter.value().size(0) != 0)
@@ -62,10 +109,11 @@ void init_weights(torch::OrderedDict<std::string, torch::Tensor> parameters,
             }
             else if (parameter.key().find("weight") != std::string::npos)
             {
-                orthogonal_(parameter.value(), weight_gain);
+                weight_initializer.add(parameter.value(), weight_gain);
             }
         }
     }
+    initializer.run();
 }
 
 TEST_CASE("Flatten")
@@ -100,6 +148,15 @@ TEST_CASE("Flatten")
     }
 }
 
+void transform_linear_output(nn::LinearImpl &linear,
+                             torch::Tensor scale,
+                             torch::Tensor shift)
+{
+    torch::NoGradGuard no_grad;
+    linear.weight.mul_(scale.view({-1, 1}));
+    linear.bias.mul_(scale).add_(shift);
+}
+
 TEST_CASE("init_weights()")
 {
     auto module = nn::Sequential(
@@ -119,5 +176,78 @@ TEST_CASE("init_weights()")
             }
         }
     }
+
+    SUBCASE("Weights are orthogonal")
+    {
+        auto tall = module->named_parameters()["0.weight"];
+        auto wide = module->named_parameters()["2.weight"];
+
+        CHECK(torch::allclose(torch::mm(tall.t(), tall), torch::eye(5), 1e-4, 1e-5));
+        CHECK(torch::allclose(torch::mm(wide, wide.t()), torch::eye(8), 1e-4, 1e-5));
+    }
+
+    SUBCASE("Weights are left alone while deferred")
+    {
+        auto weight = module->named_parameters()["0.weight"];
+        auto original_weight = weight.clone();
+        OrthogonalInitializer initializer;
+        {
+            DeferOrthogonalInit defer(initializer);
+            init_weights(module->named_parameters(), 2, 1);
+        }
+
+        CHECK(torch::equal(weight, original_weight));
+        CHECK(module->named_parameters()["0.bias"][0].item().toDouble() == doctest::Approx(1));
+
+        initializer.run();
+
+        CHECK(!torch::equal(weight, original_weight));
+        CHECK(torch::allclose(torch::mm(weight.t(), weight), torch::eye(5) * 4, 1e-4, 1e-5));
+        CHECK(initializer.empty());
+    }
+}
+
+TEST_CASE("OrthogonalInitializer")
+{
+    OrthogonalInitializer initializer;
+    std::vector<torch::Tensor> weights{torch::zeros({6, 4}),
+                                       torch::zeros({6, 4}),
+                                       torch::zeros({3, 2, 2, 2}),
+                                       torch::zeros({3, 8})};
+    for (const auto &weight : weights)
+    {
+        initializer.add(weight, 1);
+    }
+    initializer.run();
+
+    SUBCASE("Initializes weights of every shape")
+    {
+        CHECK(torch::allclose(torch::mm(weights[0].t(), weights[0]), torch::eye(4), 1e-4, 1e-5));
+        CHECK(torch::allclose(torch::mm(weights[1].t(), weights[1]), torch::eye(4), 1e-4, 1e-5));
+        auto flattened = weights[2].view({3, 8});
+        CHECK(torch::allclose(torch::mm(flattened, flattened.t()), torch::eye(3), 1e-4, 1e-5));
+        CHECK(torch::allclose(torch::mm(weights[3], weights[3].t()), torch::eye(3), 1e-4, 1e-5));
+    }
+
+    SUBCASE("Weights of the same shape get different values")
+    {
+        CHECK(!torch::allclose(weights[0], weights[1]));
+    }
+
+    SUBCASE("Throws on 1 dimensional tensors")
+    {
+        CHECK_THROWS(initializer.add(torch::zeros({5}), 1));
+    }
+}
+
+TEST_CASE("transform_linear_output()")
+{
+    auto linear = nn::Linear(4, 2);
+    auto inputs = torch::rand({3, 4});
+    auto expected = linear->forward(inputs) * torch::tensor({2.f, 0.5f}) + torch::tensor({1.f, -3.f});
+
+    transform_linear_output(*linear, torch::tensor({2.f, 0.5f}), torch::tensor({1.f, -3.f}));
+
+    CHECK(torch::allclose(linear->forward(inputs), expected, 1e-5, 1e-5));
 }
 }
\ No newline at end of file
@@ -13,7 +13,8 @@ NNBase::NNBase(bool recurrent,
                unsigned int hidden_size)
     : gru(nullptr),
       hidden_size(hidden_size),
-      recurrent(recurrent)
+      recurrent(recurrent),
+      normalized_inputs(false)
 {
     // Init GRU
     if (recurrent)
@@ -25,6 +26,18 @@ NNBase::NNBase(bool recurrent,
     }
 }
 
+void NNBase::clear_input_transform() {}
+
+bool NNBase::fold_input_transform(torch::Tensor /*scale*/, torch::Tensor /*shift*/)
+{
+    return false;
+}
+
+bool NNBase::transform_value_output(torch::Tensor /*scale*/, torch::Tensor /*shift*/)
+{
+    return false;
+}
+
 // Do not use.
 //
 // Instantiate a subclass and use theirs instead
@@ -35,6 +48,12 @@ std::vector<torch::Tensor> NNBase::forward(torch::Tensor /*inputs*/,
     return std::vector<torch::Tensor>();
 }
 
+std::vector<int64_t> NNBase::get_normalizer_shape() const
+{
+    throw std::runtime_error("Observation normalization isn't supported by this "
+                             "base");
+}
+
 unsigned int NNBase::get_hidden_size() const
 {
     if (recurrent)
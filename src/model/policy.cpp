@@ -1,10 +1,19 @@
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <vector>
+
+#include <ATen/Parallel.h>
 #include <torch/torch.h>
 
 #include "cpprl/model/policy.h"
 #include "cpprl/distributions/categorical.h"
+#include "cpprl/model/cnn_base.h"
 #include "cpprl/model/mlp_base.h"
+#include "cpprl/model/model_utils.h"
 #include "cpprl/model/output_layers.h"
 #include "cpprl/observation_normalizer.h"
+#include "cpprl/pop_art.h"
 #include "cpprl/spaces.h"
 #include "third_party/doctest.h"
 
@@ -14,10 +23,14 @@ namespace cpprl
 {
 PolicyImpl::PolicyImpl(ActionSpace action_space,
                        std::shared_ptr<NNBase> base,
-                       bool normalize_observations)
+                       bool normalize_observations,
+                       bool use_pop_art)
     : action_space(action_space),
       base(register_module("base", base)),
-      observation_normalizer(nullptr)
+      observation_normalizer(nullptr),
+      pop_art(nullptr),
+      fold_observation_normalizer(false),
+      fold_clip(true)
 {
     int num_outputs = action_space.shape[0];
     if (action_space.type == "Discrete")
@@ -43,9 +56,22 @@ PolicyImpl::PolicyImpl(ActionSpace action_space,
 
     if (normalize_observations)
     {
-        // Normalized observations only supported for MlpBase
-        auto mlp_base = static_cast<MlpBase *>(base.get());
-        observation_normalizer = register_module("observation_normalizer", ObservationNormalizer(mlp_base->get_num_inputs()));
+        // The normalizer replaces any input scaling the base would otherwise do
+        observation_normalizer = register_module(
+            "observation_normalizer",
+            ObservationNormalizer(base->get_normalizer_shape()));
+        base->set_normalized_inputs(true);
+    }
+
+    if (use_pop_art)
+    {
+        // Checks the base supports it, without changing anything
+        auto options = torch::TensorOptions(base->parameters()[0].device());
+        if (!base->transform_value_output(torch::ones({1}, options), torch::zeros({1}, options)))
+        {
+            throw std::runtime_error("PopArt isn't supported by this base");
+        }
+        pop_art = register_module("pop_art", PopArt());
     }
 }
 
@@ -53,10 +79,7 @@ std::vector<torch::Tensor> PolicyImpl::act(torch::Tensor inputs,
                                            torch::Tensor rnn_hxs,
                                            torch::Tensor masks) const
 {
-    if (observation_normalizer)
-    {
-        inputs = observation_normalizer->process_observation(inputs);
-    }
+    inputs = normalize_observation(inputs);
 
     auto base_output = base->forward(inputs, rnn_hxs, masks);
     auto dist = output_layer->forward(base_output[1]);
@@ -74,7 +97,7 @@ std::vector<torch::Tensor> PolicyImpl::act(torch::Tensor inputs,
         action_log_probs = dist->log_prob(action).sum(-1, true);
     }
 
-    return {base_output[0], // value
+    return {denormalize_value(base_output[0]), // value
             action,
             action_log_probs,
             base_output[2]}; // rnn_hxs
@@ -85,10 +108,7 @@ std::vector<torch::Tensor> PolicyImpl::evaluate_actions(torch::Tensor inputs,
                                                         torch::Tensor masks,
                                                         torch::Tensor actions) const
 {
-    if (observation_normalizer)
-    {
-        inputs = observation_normalizer->process_observation(inputs);
-    }
+    inputs = normalize_observation(inputs);
 
     auto base_output = base->forward(inputs, rnn_hxs, masks);
     auto dist = output_layer->forward(base_output[1]);
@@ -108,20 +128,29 @@ std::vector<torch::Tensor> PolicyImpl::evaluate_actions(torch::Tensor inputs,
 
     auto entropy = dist->entropy().mean();
 
-    return {base_output[0], // value
+    return {denormalize_value(base_output[0]), // value
             action_log_probs,
             entropy,
             base_output[2]}; // rnn_hxs
 }
 
+std::vector<MemoryUsage> PolicyImpl::get_memory_usage() const
+{
+    std::vector<torch::Tensor> gradients;
+    for (const auto &parameter : parameters())
+    {
+        gradients.push_back(parameter.grad());
+    }
+    return {{"parameters", get_tensor_bytes(parameters())},
+            {"gradients", get_tensor_bytes(gradients)},
+            {"buffers", get_tensor_bytes(buffers())}};
+}
+
 torch::Tensor PolicyImpl::get_probs(torch::Tensor inputs,
                                     torch::Tensor rnn_hxs,
                                     torch::Tensor masks) const
 {
-    if (observation_normalizer)
-    {
-        inputs = observation_normalizer->process_observation(inputs);
-    }
+    inputs = normalize_observation(inputs);
 
     auto base_output = base->forward(inputs, rnn_hxs, masks);
     auto dist = output_layer->forward(base_output[1]);
@@ -133,20 +162,171 @@ torch::Tensor PolicyImpl::get_values(torch::Tensor inputs,
                                      torch::Tensor rnn_hxs,
                                      torch::Tensor masks) const
 {
-    if (observation_normalizer)
+    inputs = normalize_observation(inputs);
+
+    auto base_output = base->forward(inputs, rnn_hxs, masks);
+
+    return denormalize_value(base_output[0]);
+}
+
+torch::Tensor PolicyImpl::normalize_value_errors(torch::Tensor errors) const
+{
+    if (!pop_art)
     {
-        inputs = observation_normalizer->process_observation(inputs);
+        return errors;
     }
+    return errors / pop_art->get_scale();
+}
 
-    auto base_output = base->forward(inputs, rnn_hxs, masks);
+torch::Tensor PolicyImpl::denormalize_value(torch::Tensor value) const
+{
+    if (!pop_art)
+    {
+        return value;
+    }
+    return pop_art->denormalize(value);
+}
 
-    return base_output[0];
+torch::Tensor PolicyImpl::normalize_observation(torch::Tensor observation) const
+{
+    // Byte observations are converted here, so the bases only see floats
+    auto converted = observation.scalar_type() != torch::kFloat;
+    observation = observation.to(torch::kFloat);
+    if (!observation_normalizer)
+    {
+        return observation;
+    }
+    if (fold_observation_normalizer && !torch::GradMode::is_enabled())
+    {
+        if (fold_clip)
+        {
+            // clamp() only takes scalar bounds, so clamp in place instead,
+            // reusing the converted copy of byte observations
+            auto clipped = converted ? observation : torch::empty_like(observation);
+            torch::min_out(clipped, observation, fold_upper_bound);
+            torch::max_out(clipped, clipped, fold_lower_bound);
+            return clipped;
+        }
+        return observation;
+    }
+    return observation_normalizer->process_observation(observation);
+}
+
+void PolicyImpl::load(torch::serialize::InputArchive &archive)
+{
+    nn::Module::load(archive);
+    refresh_observation_normalizer();
+}
+
+void PolicyImpl::refresh_observation_normalizer()
+{
+    if (observation_normalizer.is_empty())
+    {
+        return;
+    }
+
+    observation_normalizer->publish_snapshot();
+    refresh_observation_normalizer_folding();
+}
+
+void PolicyImpl::refresh_observation_normalizer_folding()
+{
+    if (!fold_observation_normalizer)
+    {
+        return;
+    }
+
+    torch::NoGradGuard no_grad;
+    auto transform = observation_normalizer->get_affine_transform();
+    if (!base->fold_input_transform(transform[0], transform[1]))
+    {
+        throw std::runtime_error("Observation normalizer folding isn't supported "
+                                 "by this base");
+    }
+
+    // Clip range in unnormalized observation space
+    auto clip = observation_normalizer->get_clip_value();
+    fold_lower_bound = (-clip - transform[1]) / transform[0];
+    fold_upper_bound = (clip - transform[1]) / transform[0];
+}
+
+void PolicyImpl::set_observation_normalizer_folding(bool enabled, bool clip)
+{
+    if (enabled && !observation_normalizer)
+    {
+        throw std::runtime_error("Can't fold an observation normalizer into a "
+                                 "policy that doesn't have one");
+    }
+
+    fold_observation_normalizer = enabled;
+    fold_clip = clip;
+    if (enabled)
+    {
+        refresh_observation_normalizer_folding();
+    }
+    else
+    {
+        base->clear_input_transform();
+    }
+}
+
+void PolicyImpl::to(torch::Device device, torch::Dtype dtype, bool non_blocking)
+{
+    nn::Module::to(device, dtype, non_blocking);
+    refresh_observation_normalizer_folding();
+}
+
+void PolicyImpl::to(torch::Dtype dtype, bool non_blocking)
+{
+    nn::Module::to(dtype, non_blocking);
+    refresh_observation_normalizer_folding();
+}
+
+void PolicyImpl::to(torch::Device device, bool non_blocking)
+{
+    nn::Module::to(device, non_blocking);
+    refresh_observation_normalizer_folding();
 }
 
 void PolicyImpl::update_observation_normalizer(torch::Tensor observations)
 {
     assert(!observation_normalizer.is_empty());
-    observation_normalizer->update(observations);
+    observation_normalizer->update(observations.to(torch::kFloat));
+    refresh_observation_normalizer_folding();
+}
+
+void PolicyImpl::update_pop_art(torch::Tensor returns)
+{
+    if (!pop_art)
+    {
+        throw std::runtime_error("Policy doesn't use PopArt");
+    }
+
+    auto transform = pop_art->update(returns);
+    base->transform_value_output(transform[0], transform[1]);
+}
+
+std::vector<Policy> make_policies(int64_t count,
+                                  const std::function<Policy(int64_t)> &make_policy)
+{
+    std::vector<Policy> policies(count, Policy(nullptr));
+    std::vector<OrthogonalInitializer> initializers(count);
+    at::parallel_for(0, count, 1, [&](int64_t begin, int64_t end) {
+        for (auto i = begin; i < end; ++i)
+        {
+            DeferOrthogonalInit defer(initializers[i]);
+            policies[i] = make_policy(i);
+        }
+    });
+
+    OrthogonalInitializer initializer;
+    for (const auto &policy_initializer : initializers)
+    {
+        initializer.add(policy_initializer);
+    }
+    initializer.run();
+
+    return policies;
 }
 
 TEST_CASE("Policy")
@@ -255,6 +435,156 @@ TEST_CASE("Policy")
         }
     }
 
+    SUBCASE("With observation normalization")
+    {
+        SUBCASE("MlpBase")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, true);
+
+            CHECK(policy->using_observation_normalizer());
+
+            auto inputs = torch::rand({4, 3});
+            policy->update_observation_normalizer(inputs);
+            auto outputs = policy->act(inputs, torch::rand({4, 10}), torch::ones({4, 1}));
+
+            CHECK(outputs[1].size(0) == 4);
+        }
+
+        SUBCASE("Folded into the base")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, true);
+
+            policy->update_observation_normalizer(torch::rand({8, 3}) * 4 + 2);
+            policy->set_observation_normalizer_folding(true);
+            CHECK(policy->is_folding_observation_normalizer());
+
+            // Includes values outside of the clip range
+            auto inputs = torch::rand({4, 3}) * 200 - 100;
+            auto rnn_hxs = torch::zeros({4, 10});
+            auto masks = torch::ones({4, 1});
+            auto expected = policy->get_values(inputs, rnn_hxs, masks);
+            torch::Tensor actual;
+            {
+                torch::NoGradGuard no_grad;
+                actual = policy->get_values(inputs, rnn_hxs, masks);
+            }
+
+            CHECK(torch::allclose(actual, expected, 1e-4, 1e-4));
+        }
+
+        SUBCASE("Refolded after loading")
+        {
+            auto source_base = std::make_shared<MlpBase>(3, false, 10);
+            Policy source(ActionSpace{"Discrete", {5}}, source_base, true);
+            source->update_observation_normalizer(torch::rand({8, 3}) * 4 + 2);
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, true);
+            policy->update_observation_normalizer(torch::rand({8, 3}));
+            policy->set_observation_normalizer_folding(true);
+
+            std::stringstream stream;
+            torch::save(source, stream);
+            torch::load(policy, stream);
+
+            auto inputs = torch::rand({4, 3}) * 10;
+            auto rnn_hxs = torch::zeros({4, 10});
+            auto masks = torch::ones({4, 1});
+            auto expected = source->get_values(inputs, rnn_hxs, masks);
+            torch::Tensor actual;
+            {
+                torch::NoGradGuard no_grad;
+                actual = policy->get_values(inputs, rnn_hxs, masks);
+            }
+
+            CHECK(torch::allclose(actual, expected, 1e-4, 1e-4));
+        }
+
+        SUBCASE("Folding needs a normalizer")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, false);
+
+            CHECK_THROWS(policy->set_observation_normalizer_folding(true));
+        }
+
+        SUBCASE("CnnBase")
+        {
+            auto base = std::make_shared<CnnBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, true);
+
+            CHECK(policy->using_observation_normalizer());
+
+            auto inputs = torch::rand({4, 3, 84, 84}) * 255;
+            policy->update_observation_normalizer(inputs);
+            auto outputs = policy->act(inputs, torch::rand({4, 10}), torch::ones({4, 1}));
+
+            CHECK(outputs[1].size(0) == 4);
+        }
+    }
+
+    SUBCASE("With PopArt")
+    {
+        auto inputs = torch::rand({4, 3});
+        auto hidden_states = torch::zeros({4, 10});
+        auto masks = torch::ones({4, 1});
+
+        SUBCASE("Updating the statistics doesn't change the values")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, false, true);
+            CHECK(policy->using_pop_art());
+
+            auto before = policy->get_values(inputs, hidden_states, masks);
+            policy->update_pop_art(torch::randn({20, 4, 1}) * 30 + 100);
+            auto after = policy->get_values(inputs, hidden_states, masks);
+            auto evaluated = policy->evaluate_actions(inputs, hidden_states, masks,
+                                                      torch::zeros({4, 1}, torch::kLong))[0];
+
+            CHECK(torch::allclose(before, after, 1e-3, 1e-3));
+            CHECK(torch::allclose(evaluated, after));
+        }
+
+        SUBCASE("Value errors are scaled by the return scale")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base, false, true);
+            auto returns = torch::randn({1000, 1}) * 30 + 100;
+            policy->update_pop_art(returns);
+
+            auto errors = torch::full({4, 1}, 30.);
+            auto normalized_errors = policy->normalize_value_errors(errors);
+            CHECK(normalized_errors[0].item().toFloat() ==
+                  doctest::Approx(30 / returns.std().item().toFloat()).epsilon(0.01));
+        }
+
+        SUBCASE("Without it, value errors are left alone")
+        {
+            auto base = std::make_shared<MlpBase>(3, false, 10);
+            Policy policy(ActionSpace{"Discrete", {5}}, base);
+            auto errors = torch::rand({4, 1});
+
+            CHECK(!policy->using_pop_art());
+            CHECK(torch::equal(policy->normalize_value_errors(errors), errors));
+            CHECK_THROWS(policy->update_pop_art(errors));
+        }
+    }
+
+    SUBCASE("Byte observations give the same outputs as float ones")
+    {
+        auto base = std::make_shared<CnnBase>(1, false, 10);
+        Policy policy(ActionSpace{"Discrete", {5}}, base);
+
+        auto inputs = torch::randint(0, 256, {2, 1, 84, 84});
+        auto hidden_states = torch::zeros({2, 10});
+        auto masks = torch::ones({2, 1});
+        auto byte_values = policy->get_values(inputs.to(torch::kByte), hidden_states, masks);
+        auto float_values = policy->get_values(inputs.to(torch::kFloat), hidden_states, masks);
+
+        CHECK(torch::allclose(byte_values, float_values));
+    }
+
     SUBCASE("Non-recurrent")
     {
         auto base = std::make_shared<MlpBase>(3, false, 10);
@@ -358,4 +688,55 @@ TEST_CASE("Policy")
         }
     }
 }
+TEST_CASE("make_policies()")
+{
+    ActionSpace space{"Discrete", {3}};
+    auto policies = make_policies(4, [&](int64_t) {
+        return Policy(space, std::make_shared<MlpBase>(4, true, 8));
+    });
+
+    SUBCASE("Makes every policy")
+    {
+        REQUIRE(policies.size() == 4);
+        for (const auto &policy : policies)
+        {
+            CHECK(!policy.is_empty());
+        }
+    }
+
+    SUBCASE("Weights are orthogonal")
+    {
+        for (const auto &policy : policies)
+        {
+            for (const auto &parameter : policy->named_parameters())
+            {
+                const auto &weight = parameter.value();
+                if (parameter.key().find("weight") == std::string::npos || weight.dim() != 2)
+                {
+                    continue;
+                }
+                auto gram = weight.size(0) < weight.size(1) ? torch::mm(weight, weight.t())
+                                                            : torch::mm(weight.t(), weight);
+                INFO(parameter.key());
+                CHECK(torch::allclose(gram / gram[0][0], torch::eye(gram.size(0)), 1e-3, 1e-4));
+            }
+        }
+    }
+
+    SUBCASE("Policies get different weights")
+    {
+        auto first_weight = [](const Policy &policy) -> torch::Tensor {
+            for (const auto &parameter : policy->named_parameters())
+            {
+                if (parameter.key().find("weight") != std::string::npos)
+                {
+                    return parameter.value();
+                }
+            }
+            return {};
+        };
+
+        CHECK(!torch::allclose(first_weight(policies[0]), first_weight(policies[1])));
+    }
+}
 }
\ No newline at end of file
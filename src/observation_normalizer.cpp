@@ -1,3 +1,7 @@
+#include <atomic>
+#include <memory>
+#include <thread>
+
 #include <torch/torch.h>
 
 #include "cpprl/observation_normalizer.h"
@@ -6,19 +10,46 @@
 
 namespace cpprl
 {
+torch::Tensor ObservationNormalizerSnapshot::process_observation(torch::Tensor observation) const
+{
+    // The observation itself only takes one fused multiply-add and an in-place
+    // clamp
+    return torch::addcmul(shift.to(observation.device()),
+                          observation,
+                          scale.to(observation.device()))
+        .clamp_(-clip, clip);
+}
+
 ObservationNormalizerImpl::ObservationNormalizerImpl(int size, float clip)
     : clip(register_buffer("clip", torch::full({1}, clip, torch::kFloat))),
-      rms(register_module("rms", RunningMeanStd(size))) {}
+      rms(register_module("rms", RunningMeanStd(size))),
+      version(0)
+{
+    publish_snapshot();
+}
+
+ObservationNormalizerImpl::ObservationNormalizerImpl(c10::IntArrayRef shape, float clip)
+    : clip(register_buffer("clip", torch::full({1}, clip, torch::kFloat))),
+      rms(register_module("rms", RunningMeanStd(shape))),
+      version(0)
+{
+    publish_snapshot();
+}
 
 ObservationNormalizerImpl::ObservationNormalizerImpl(const std::vector<float> &means,
                                                      const std::vector<float> &variances,
                                                      float clip)
     : clip(register_buffer("clip", torch::full({1}, clip, torch::kFloat))),
-      rms(register_module("rms", RunningMeanStd(means, variances))) {}
+      rms(register_module("rms", RunningMeanStd(means, variances))),
+      version(0)
+{
+    publish_snapshot();
+}
 
 ObservationNormalizerImpl::ObservationNormalizerImpl(const std::vector<ObservationNormalizer> &others)
     : clip(register_buffer("clip", torch::zeros({1}, torch::kFloat))),
-      rms(register_module("rms", RunningMeanStd(1)))
+      rms(register_module("rms", RunningMeanStd(1))),
+      version(0)
 {
     // Calculate mean clip
     for (const auto &other : others)
@@ -57,20 +88,26 @@ ObservationNormalizerImpl::ObservationNormalizerImpl(const std::vector<Observati
         variance /= others.size();
     }
 
-    rms = RunningMeanStd(mean_means, mean_variances);
+    rms = RunningMeanStd(mean_means, mean_variances, others[0]->get_shape());
 
     int total_count = std::accumulate(others.begin(), others.end(), 0,
                                       [](int accumulator, const ObservationNormalizer &other) {
                                           return accumulator + other->get_step_count();
                                       });
     rms->set_count(total_count);
+
+    publish_snapshot();
 }
 
 torch::Tensor ObservationNormalizerImpl::process_observation(torch::Tensor observation) const
 {
-    auto normalized_obs = (observation - rms->get_mean()) /
-                          torch::sqrt(rms->get_variance() + 1e-8);
-    return torch::clamp(normalized_obs, -clip.item(), clip.item());
+    return get_snapshot()->process_observation(observation);
+}
+
+std::vector<torch::Tensor> ObservationNormalizerImpl::get_affine_transform() const
+{
+    auto current_snapshot = get_snapshot();
+    return {current_snapshot->scale, current_snapshot->shift};
 }
 
 std::vector<float> ObservationNormalizerImpl::get_mean() const
@@ -79,15 +116,65 @@ std::vector<float> ObservationNormalizerImpl::get_mean() const
     return std::vector<float>(mean.data_ptr<float>(), mean.data_ptr<float>() + mean.numel());
 }
 
+std::shared_ptr<const ObservationNormalizerSnapshot> ObservationNormalizerImpl::get_snapshot() const
+{
+    return std::atomic_load(&snapshot);
+}
+
 std::vector<float> ObservationNormalizerImpl::get_variance() const
 {
     auto variance = rms->get_variance();
     return std::vector<float>(variance.data_ptr<float>(), variance.data_ptr<float>() + variance.numel());
 }
 
+std::vector<int64_t> ObservationNormalizerImpl::get_shape() const
+{
+    return rms->get_shape();
+}
+
+void ObservationNormalizerImpl::load(torch::serialize::InputArchive &archive)
+{
+    torch::nn::Module::load(archive);
+    publish_snapshot();
+}
+
+void ObservationNormalizerImpl::publish_snapshot()
+{
+    // Copy-on-write: build the new statistics off to the side, then swap the
+    // pointer. Readers holding the old snapshot are unaffected.
+    torch::NoGradGuard no_grad;
+    auto new_snapshot = std::make_shared<ObservationNormalizerSnapshot>();
+    new_snapshot->scale = torch::rsqrt(rms->get_variance() + 1e-8);
+    new_snapshot->shift = -rms->get_mean() * new_snapshot->scale;
+    new_snapshot->clip = get_clip_value();
+    new_snapshot->version = ++version;
+    std::atomic_store(&snapshot,
+                      std::shared_ptr<const ObservationNormalizerSnapshot>(
+                          std::move(new_snapshot)));
+}
+
+void ObservationNormalizerImpl::to(torch::Device device, torch::Dtype dtype, bool non_blocking)
+{
+    torch::nn::Module::to(device, dtype, non_blocking);
+    publish_snapshot();
+}
+
+void ObservationNormalizerImpl::to(torch::Dtype dtype, bool non_blocking)
+{
+    torch::nn::Module::to(dtype, non_blocking);
+    publish_snapshot();
+}
+
+void ObservationNormalizerImpl::to(torch::Device device, bool non_blocking)
+{
+    torch::nn::Module::to(device, non_blocking);
+    publish_snapshot();
+}
+
 void ObservationNormalizerImpl::update(torch::Tensor observations)
 {
     rms->update(observations);
+    publish_snapshot();
 }
 
 TEST_CASE("ObservationNormalizer")
@@ -128,6 +215,87 @@ TEST_CASE("ObservationNormalizer")
         DOCTEST_CHECK(processed_observation[4].item().toFloat() == doctest::Approx(1.31322402));
     }
 
+    SUBCASE("Normalizes images per channel")
+    {
+        ObservationNormalizer normalizer(std::vector<int64_t>{2, 1, 1});
+
+        auto observations = torch::rand({8, 2, 4, 4});
+        observations.select(1, 1).mul_(100).add_(50);
+        normalizer->update(observations);
+        auto processed_observations = normalizer->process_observation(observations);
+
+        CHECK(processed_observations.sizes().vec() == observations.sizes().vec());
+        for (int channel = 0; channel < 2; ++channel)
+        {
+            auto processed_channel = processed_observations.select(1, channel);
+            DOCTEST_CHECK(processed_channel.mean().item().toFloat() ==
+                          doctest::Approx(0).epsilon(0.01));
+            DOCTEST_CHECK(processed_channel.std(false).item().toFloat() ==
+                          doctest::Approx(1).epsilon(0.01));
+        }
+    }
+
+    SUBCASE("Snapshots")
+    {
+        ObservationNormalizer normalizer(3);
+        auto observation = torch::rand({3}) * 10;
+
+        SUBCASE("Aren't changed by updates")
+        {
+            auto snapshot = normalizer->get_snapshot();
+            auto before = snapshot->process_observation(observation);
+            normalizer->update(torch::rand({4, 3}) * 100);
+
+            CHECK(torch::equal(snapshot->process_observation(observation), before));
+            CHECK(!torch::equal(normalizer->process_observation(observation), before));
+        }
+
+        SUBCASE("Are versioned")
+        {
+            auto first_version = normalizer->get_version();
+            normalizer->update(torch::rand({4, 3}));
+
+            CHECK(normalizer->get_version() == first_version + 1);
+            CHECK(normalizer->get_snapshot()->version == first_version + 1);
+        }
+
+        SUBCASE("Are republished when the normalizer is moved")
+        {
+            auto device = torch::cuda::is_available() ? torch::Device(torch::kCUDA)
+                                                      : torch::Device(torch::kCPU);
+            auto first_version = normalizer->get_version();
+            normalizer->to(device);
+
+            CHECK(normalizer->get_version() == first_version + 1);
+            CHECK(normalizer->get_snapshot()->scale.device() == device);
+            CHECK(normalizer->get_snapshot()->shift.device() == device);
+        }
+
+        SUBCASE("Can be read while the normalizer is updated")
+        {
+            std::atomic<bool> finished(false);
+            bool versions_increase = true;
+            std::thread reader([&] {
+                uint64_t last_version = 0;
+                while (!finished)
+                {
+                    auto snapshot = normalizer->get_snapshot();
+                    snapshot->process_observation(observation);
+                    versions_increase &= snapshot->version >= last_version;
+                    last_version = snapshot->version;
+                }
+            });
+            for (int i = 0; i < 100; ++i)
+            {
+                normalizer->update(torch::rand({4, 3}));
+            }
+            finished = true;
+            reader.join();
+
+            CHECK(versions_increase);
+        }
+    }
+
     SUBCASE("Loads mean and variance from constructor correctly")
     {
         ObservationNormalizer normalizer(std::vector<float>({1, 2, 3}), std::vector<float>({4, 5, 6}));
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/flat_optimizer.h"
+#include "cpprl/optimizers/fused_adam.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+FlatOptimizer::FlatOptimizer(std::vector<torch::Tensor> parameters,
+                             float learning_rate,
+                             int num_state_buffers)
+    : parameters(parameters),
+      offsets({0}),
+      learning_rate(learning_rate),
+      step_count(0)
+{
+    if (parameters.empty())
+    {
+        throw std::runtime_error("Optimizer needs at least one parameter");
+    }
+    for (const auto &parameter : parameters)
+    {
+        if (parameter.scalar_type() != torch::kFloat)
+        {
+            throw std::runtime_error("Fused optimizers only support float parameters");
+        }
+        offsets.push_back(offsets.back() + parameter.numel());
+    }
+
+    flatten();
+    for (int i = 0; i < num_state_buffers; ++i)
+    {
+        state.push_back(torch::zeros_like(flat_parameters));
+    }
+}
+
+void FlatOptimizer::check_flat()
+{
+    auto parameter_data = static_cast<float *>(flat_parameters.data_ptr());
+    auto gradient_data = static_cast<float *>(flat_gradients.data_ptr());
+    for (unsigned int i = 0; i < parameters.size(); ++i)
+    {
+        const auto &gradient = parameters[i].grad();
+        if (parameters[i].data_ptr() != parameter_data + offsets[i] ||
+            !parameters[i].is_contiguous() ||
+            !gradient.defined() ||
+            gradient.data_ptr() != gradient_data + offsets[i] ||
+            !gradient.is_contiguous())
+        {
+            flatten();
+            return;
+        }
+    }
+}
+
+void FlatOptimizer::flatten()
+{
+    torch::NoGradGuard no_grad;
+    auto options = torch::TensorOptions(parameters[0].device()).dtype(torch::kFloat);
+    auto new_parameters = torch::empty({offsets.back()}, options);
+    auto new_gradients = torch::zeros({offsets.back()}, options);
+
+    for (unsigned int i = 0; i < parameters.size(); ++i)
+    {
+        auto &parameter = parameters[i];
+        auto size = offsets[i + 1] - offsets[i];
+        auto parameter_view = new_parameters.narrow(0, offsets[i], size)
+                                  .view(parameter.sizes());
+        auto gradient_view = new_gradients.narrow(0, offsets[i], size)
+                                 .view(parameter.sizes());
+
+        parameter_view.copy_(parameter);
+        if (parameter.grad().defined())
+        {
+            gradient_view.copy_(parameter.grad());
+        }
+        parameter.set_data(parameter_view);
+        parameter.grad() = gradient_view;
+    }
+
+    flat_parameters = new_parameters;
+    flat_gradients = new_gradients;
+    for (auto &buffer : state)
+    {
+        buffer = buffer.to(flat_parameters.device());
+    }
+}
+
+std::vector<double> FlatOptimizer::get_squared_norms(const torch::Tensor &buffer) const
+{
+    auto num_parameters = static_cast<int64_t>(parameters.size());
+    std::vector<double> squared_norms(num_parameters);
+    if (!buffer.device().is_cpu())
+    {
+        for (int64_t i = 0; i < num_parameters; ++i)
+        {
+            squared_norms[i] = buffer.narrow(0, offsets[i], offsets[i + 1] - offsets[i])
+                                   .pow(2)
+                                   .sum()
+                                   .item()
+                                   .toDouble();
+        }
+        return squared_norms;
+    }
+
+    auto data = buffer.data_ptr<float>();
+    at::parallel_for(0, num_parameters, 1, [&](int64_t begin, int64_t end) {
+        for (auto i = begin; i < end; ++i)
+        {
+            double sum = 0;
+            for (auto j = offsets[i]; j < offsets[i + 1]; ++j)
+            {
+                sum += static_cast<double>(data[j]) * data[j];
+            }
+            squared_norms[i] = sum;
+        }
+    });
+    return squared_norms;
+}
+
+void FlatOptimizer::parallel_for_parameters(
+    const std::function<void(int64_t, int64_t, int64_t)> &function) const
+{
+    at::parallel_for(0, offsets.back(), at::internal::GRAIN_SIZE, [&](int64_t begin, int64_t end) {
+        // The last parameter starting at or before begin
+        auto parameter = std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+        while (begin < end)
+        {
+            auto range_end = std::min(end, offsets[parameter + 1]);
+            if (range_end > begin)
+            {
+                function(parameter, begin, range_end);
+            }
+            begin = range_end;
+            ++parameter;
+        }
+    });
+}
+
+void FlatOptimizer::step()
+{
+    check_flat();
+    torch::NoGradGuard no_grad;
+    ++step_count;
+    update();
+}
+
+void FlatOptimizer::zero_grad()
+{
+    check_flat();
+    flat_gradients.zero_();
+}
+
+TEST_CASE("FlatOptimizer")
+{
+    auto linear = torch::nn::Linear(3, 2);
+    FusedAdam optimizer(linear->parameters(), 1e-3);
+
+    SUBCASE("Parameters and gradients are views of the flat buffers")
+    {
+        auto weight_data = static_cast<float *>(linear->weight.data_ptr());
+        CHECK(static_cast<float *>(linear->bias.data_ptr()) == weight_data + 6);
+
+        optimizer.zero_grad();
+        linear->forward(torch::rand({4, 3})).sum().backward();
+        auto gradient_data = static_cast<float *>(linear->weight.grad().data_ptr());
+        CHECK(static_cast<float *>(linear->bias.grad().data_ptr()) == gradient_data + 6);
+    }
+
+    SUBCASE("Keeps working after a parameter is replaced")
+    {
+        {
+            torch::NoGradGuard no_grad;
+            linear->weight.set_data(torch::ones({2, 3}));
+        }
+        optimizer.zero_grad();
+        linear->forward(torch::ones({1, 3})).sum().backward();
+        optimizer.step();
+
+        // Adam's first step moves every element by the learning rate
+        CHECK(torch::allclose(linear->weight, torch::full({2, 3}, 1 - 1e-3)));
+        auto weight_data = static_cast<float *>(linear->weight.data_ptr());
+        CHECK(static_cast<float *>(linear->bias.data_ptr()) == weight_data + 6);
+    }
+
+    SUBCASE("Zeroes every gradient at once")
+    {
+        linear->forward(torch::rand({4, 3})).sum().backward();
+        optimizer.zero_grad();
+
+        CHECK(linear->weight.grad().abs().sum().item().toFloat() == 0);
+        CHECK(linear->bias.grad().abs().sum().item().toFloat() == 0);
+    }
+}
+}
@@ -0,0 +1,148 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPPRL_SSE2
+#endif
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/fused_adam.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+FusedAdam::FusedAdam(std::vector<torch::Tensor> parameters,
+                     float learning_rate,
+                     float beta1,
+                     float beta2,
+                     float epsilon)
+    : FlatOptimizer(parameters, learning_rate, 2),
+      beta1(beta1),
+      beta2(beta2),
+      epsilon(epsilon) {}
+
+void FusedAdam::update()
+{
+    auto bias_correction1 = 1 - std::pow(beta1, step_count);
+    auto bias_correction2 = 1 - std::pow(beta2, step_count);
+    auto step_size = static_cast<float>(learning_rate * std::sqrt(bias_correction2) /
+                                        bias_correction1);
+    auto &exp_average = get_state(0);
+    auto &exp_average_sq = get_state(1);
+
+    // Off the CPU, the same update as a few kernels over the flat buffers
+    if (!flat_parameters.device().is_cpu())
+    {
+        exp_average.mul_(beta1).add_(flat_gradients, 1 - beta1);
+        exp_average_sq.mul_(beta2).addcmul_(flat_gradients, flat_gradients, 1 - beta2);
+        flat_parameters.addcdiv_(exp_average, exp_average_sq.sqrt().add_(epsilon), -step_size);
+        return;
+    }
+
+    auto parameter_data = flat_parameters.data_ptr<float>();
+    auto gradient_data = flat_gradients.data_ptr<float>();
+    auto exp_average_data = exp_average.data_ptr<float>();
+    auto exp_average_sq_data = exp_average_sq.data_ptr<float>();
+
+    at::parallel_for(0, flat_parameters.numel(), at::internal::GRAIN_SIZE, [&](int64_t begin, int64_t end) {
+        auto i = begin;
+#ifdef CPPRL_SSE2
+        auto beta1_x4 = _mm_set1_ps(beta1);
+        auto one_minus_beta1_x4 = _mm_set1_ps(1 - beta1);
+        auto beta2_x4 = _mm_set1_ps(beta2);
+        auto one_minus_beta2_x4 = _mm_set1_ps(1 - beta2);
+        auto epsilon_x4 = _mm_set1_ps(epsilon);
+        auto step_size_x4 = _mm_set1_ps(step_size);
+        for (; i + 4 <= end; i += 4)
+        {
+            auto gradient = _mm_loadu_ps(gradient_data + i);
+            auto m = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(exp_average_data + i), beta1_x4),
+                                _mm_mul_ps(gradient, one_minus_beta1_x4));
+            auto v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(exp_average_sq_data + i), beta2_x4),
+                                _mm_mul_ps(_mm_mul_ps(gradient, gradient), one_minus_beta2_x4));
+            auto denominator = _mm_add_ps(_mm_sqrt_ps(v), epsilon_x4);
+            auto parameter = _mm_sub_ps(_mm_loadu_ps(parameter_data + i),
+                                        _mm_mul_ps(step_size_x4, _mm_div_ps(m, denominator)));
+            _mm_storeu_ps(exp_average_data + i, m);
+            _mm_storeu_ps(exp_average_sq_data + i, v);
+            _mm_storeu_ps(parameter_data + i, parameter);
+        }
+#endif
+        for (; i < end; ++i)
+        {
+            auto gradient = gradient_data[i];
+            auto m = exp_average_data[i] * beta1 + gradient * (1 - beta1);
+            auto v = exp_average_sq_data[i] * beta2 + gradient * gradient * (1 - beta2);
+            exp_average_data[i] = m;
+            exp_average_sq_data[i] = v;
+            parameter_data[i] -= step_size * (m / (std::sqrt(v) + epsilon));
+        }
+    });
+}
+
+TEST_CASE("FusedAdam")
+{
+    torch::manual_seed(0);
+    auto fused_model = torch::nn::Sequential(torch::nn::Linear(5, 7),
+                                             torch::nn::Linear(7, 3));
+    auto reference_model = torch::nn::Sequential(torch::nn::Linear(5, 7),
+                                                 torch::nn::Linear(7, 3));
+    {
+        torch::NoGradGuard no_grad;
+        auto fused_parameters = fused_model->parameters();
+        auto reference_parameters = reference_model->parameters();
+        for (unsigned int i = 0; i < fused_parameters.size(); ++i)
+        {
+            reference_parameters[i].copy_(fused_parameters[i]);
+        }
+    }
+
+    FusedAdam fused_optimizer(fused_model->parameters(), 1e-2, 0.8, 0.9, 1e-6);
+    torch::optim::Adam reference_optimizer(reference_model->parameters(),
+                                           torch::optim::AdamOptions(1e-2)
+                                               .beta1(0.8)
+                                               .beta2(0.9)
+                                               .eps(1e-6));
+
+    SUBCASE("Matches torch::optim::Adam")
+    {
+        for (int i = 0; i < 20; ++i)
+        {
+            auto inputs = torch::rand({4, 5});
+            auto targets = torch::rand({4, 3});
+
+            fused_optimizer.zero_grad();
+            (fused_model->forward(inputs) - targets).pow(2).mean().backward();
+            fused_optimizer.step();
+
+            reference_optimizer.zero_grad();
+            (reference_model->forward(inputs) - targets).pow(2).mean().backward();
+            reference_optimizer.step();
+        }
+
+        auto fused_parameters = fused_model->parameters();
+        auto reference_parameters = reference_model->parameters();
+        for (unsigned int i = 0; i < fused_parameters.size(); ++i)
+        {
+            CHECK(torch::allclose(fused_parameters[i], reference_parameters[i], 1e-4, 1e-6));
+        }
+        CHECK(fused_optimizer.get_step_count() == 20);
+    }
+
+    SUBCASE("Uses the learning rate it is given")
+    {
+        fused_optimizer.set_learning_rate(0);
+        auto before = fused_model->parameters()[0].clone();
+
+        fused_optimizer.zero_grad();
+        fused_model->forward(torch::rand({4, 5})).sum().backward();
+        fused_optimizer.step();
+
+        CHECK(torch::equal(fused_model->parameters()[0], before));
+    }
+}
+}
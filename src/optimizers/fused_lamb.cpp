@@ -0,0 +1,181 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/fused_lamb.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+FusedLamb::FusedLamb(std::vector<torch::Tensor> parameters,
+                     float learning_rate,
+                     float beta1,
+                     float beta2,
+                     float epsilon,
+                     float weight_decay)
+    : FlatOptimizer(parameters, learning_rate, 3),
+      beta1(beta1),
+      beta2(beta2),
+      epsilon(epsilon),
+      weight_decay(weight_decay) {}
+
+void FusedLamb::update()
+{
+    auto bias_correction1 = static_cast<float>(1 - std::pow(beta1, step_count));
+    auto bias_correction2 = static_cast<float>(1 - std::pow(beta2, step_count));
+    auto &exp_average = get_state(0);
+    auto &exp_average_sq = get_state(1);
+    // Kept as state, rather than scratch space, so it's counted with the
+    // optimizer's memory
+    auto &updates = get_state(2);
+    auto on_cpu = flat_parameters.device().is_cpu();
+
+    // Adam's update, plus weight decay, before the trust ratio
+    if (on_cpu)
+    {
+        auto parameter_data = flat_parameters.data_ptr<float>();
+        auto gradient_data = flat_gradients.data_ptr<float>();
+        auto exp_average_data = exp_average.data_ptr<float>();
+        auto exp_average_sq_data = exp_average_sq.data_ptr<float>();
+        auto update_data = updates.data_ptr<float>();
+        at::parallel_for(0, flat_parameters.numel(), at::internal::GRAIN_SIZE, [&](int64_t begin, int64_t end) {
+            for (auto i = begin; i < end; ++i)
+            {
+                auto gradient = gradient_data[i];
+                auto m = exp_average_data[i] * beta1 + gradient * (1 - beta1);
+                auto v = exp_average_sq_data[i] * beta2 + gradient * gradient * (1 - beta2);
+                exp_average_data[i] = m;
+                exp_average_sq_data[i] = v;
+                update_data[i] = ((m / bias_correction1) / (std::sqrt(v / bias_correction2) + epsilon) +
+                                  weight_decay * parameter_data[i]);
+            }
+        });
+    }
+    else
+    {
+        exp_average.mul_(beta1).add_(flat_gradients, 1 - beta1);
+        exp_average_sq.mul_(beta2).addcmul_(flat_gradients, flat_gradients, 1 - beta2);
+        updates.copy_(exp_average)
+            .div_(bias_correction1)
+            .div_((exp_average_sq / bias_correction2).sqrt_().add_(epsilon))
+            .add_(flat_parameters, weight_decay);
+    }
+
+    // Parameters that are all zero, like freshly initialized biases, take
+    // unscaled steps
+    auto weight_norms = get_squared_norms(flat_parameters);
+    auto update_norms = get_squared_norms(updates);
+    std::vector<float> step_sizes;
+    for (unsigned int i = 0; i < weight_norms.size(); ++i)
+    {
+        auto trust_ratio = weight_norms[i] > 0 && update_norms[i] > 0
+                               ? std::sqrt(weight_norms[i] / update_norms[i])
+                               : 1.;
+        step_sizes.push_back(static_cast<float>(learning_rate * trust_ratio));
+    }
+
+    if (!on_cpu)
+    {
+        const auto &offsets = get_offsets();
+        for (unsigned int i = 0; i < step_sizes.size(); ++i)
+        {
+            auto size = offsets[i + 1] - offsets[i];
+            flat_parameters.narrow(0, offsets[i], size)
+                .add_(updates.narrow(0, offsets[i], size), -step_sizes[i]);
+        }
+        return;
+    }
+
+    auto parameter_data = flat_parameters.data_ptr<float>();
+    auto update_data = updates.data_ptr<float>();
+    parallel_for_parameters([&](int64_t parameter, int64_t begin, int64_t end) {
+        auto step_size = step_sizes[parameter];
+        for (auto i = begin; i < end; ++i)
+        {
+            parameter_data[i] -= step_size * update_data[i];
+        }
+    });
+}
+
+TEST_CASE("FusedLamb")
+{
+    torch::manual_seed(0);
+    auto model = torch::nn::Sequential(torch::nn::Linear(5, 7),
+                                       torch::nn::Linear(7, 3));
+    std::vector<torch::Tensor> reference_parameters;
+    for (const auto &parameter : model->parameters())
+    {
+        reference_parameters.push_back(parameter.detach().clone());
+    }
+    FusedLamb optimizer(model->parameters(), 1e-2, 0.8, 0.9, 1e-6, 0.01);
+
+    SUBCASE("Matches a per-parameter implementation")
+    {
+        std::vector<torch::Tensor> exp_averages, exp_average_sqs;
+        for (const auto &parameter : reference_parameters)
+        {
+            exp_averages.push_back(torch::zeros_like(parameter));
+            exp_average_sqs.push_back(torch::zeros_like(parameter));
+        }
+
+        for (int step = 1; step <= 10; ++step)
+        {
+            auto inputs = torch::rand({4, 5});
+            optimizer.zero_grad();
+            model->forward(inputs).pow(2).mean().backward();
+
+            // The same loss through the reference parameters
+            std::vector<torch::Tensor> gradients;
+            {
+                std::vector<torch::Tensor> leaves;
+                for (const auto &parameter : reference_parameters)
+                {
+                    leaves.push_back(parameter.detach().requires_grad_());
+                }
+                auto hidden = torch::addmm(leaves[1], inputs, leaves[0].t());
+                auto outputs = torch::addmm(leaves[3], hidden, leaves[2].t());
+                outputs.pow(2).mean().backward();
+                for (const auto &leaf : leaves)
+                {
+                    gradients.push_back(leaf.grad());
+                }
+            }
+            optimizer.step();
+
+            for (unsigned int i = 0; i < reference_parameters.size(); ++i)
+            {
+                auto &parameter = reference_parameters[i];
+                exp_averages[i] = exp_averages[i] * 0.8 + gradients[i] * 0.2;
+                exp_average_sqs[i] = exp_average_sqs[i] * 0.9 + gradients[i].pow(2) * 0.1;
+                auto update = ((exp_averages[i] / (1 - std::pow(0.8, step))) /
+                                   ((exp_average_sqs[i] / (1 - std::pow(0.9, step))).sqrt() + 1e-6) +
+                               parameter * 0.01);
+                auto weight_norm = parameter.norm().item().toFloat();
+                auto update_norm = update.norm().item().toFloat();
+                auto trust_ratio = weight_norm > 0 && update_norm > 0 ? weight_norm / update_norm : 1;
+                parameter = parameter - update * 1e-2 * trust_ratio;
+            }
+        }
+
+        auto parameters = model->parameters();
+        for (unsigned int i = 0; i < parameters.size(); ++i)
+        {
+            CHECK(torch::allclose(parameters[i], reference_parameters[i], 1e-4, 1e-5));
+        }
+    }
+
+    SUBCASE("Steps each layer by the same fraction of its weights")
+    {
+        optimizer.zero_grad();
+        model->forward(torch::rand({4, 5})).pow(2).mean().backward();
+        auto weights = model->parameters()[0].detach().clone();
+        optimizer.step();
+
+        auto change = (model->parameters()[0] - weights).norm().item().toFloat();
+        CHECK(change == doctest::Approx(1e-2 * weights.norm().item().toFloat()).epsilon(1e-3));
+    }
+}
+}
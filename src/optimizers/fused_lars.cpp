@@ -0,0 +1,150 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/fused_lars.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+FusedLars::FusedLars(std::vector<torch::Tensor> parameters,
+                     float learning_rate,
+                     float momentum,
+                     float weight_decay,
+                     float trust_coefficient,
+                     float epsilon)
+    : FlatOptimizer(parameters, learning_rate, 1),
+      momentum(momentum),
+      weight_decay(weight_decay),
+      trust_coefficient(trust_coefficient),
+      epsilon(epsilon) {}
+
+void FusedLars::update()
+{
+    // Parameters that are all zero, like freshly initialized biases, use the
+    // global learning rate
+    auto weight_norms = get_squared_norms(flat_parameters);
+    auto gradient_norms = get_squared_norms(flat_gradients);
+    std::vector<float> learning_rates;
+    for (unsigned int i = 0; i < weight_norms.size(); ++i)
+    {
+        auto weight_norm = std::sqrt(weight_norms[i]);
+        auto gradient_norm = std::sqrt(gradient_norms[i]);
+        auto trust_ratio = weight_norm > 0 && gradient_norm > 0
+                               ? trust_coefficient * weight_norm /
+                                     (gradient_norm + weight_decay * weight_norm + epsilon)
+                               : 1.;
+        learning_rates.push_back(static_cast<float>(learning_rate * trust_ratio));
+    }
+
+    auto &velocity = get_state(0);
+    if (!flat_parameters.device().is_cpu())
+    {
+        const auto &offsets = get_offsets();
+        velocity.mul_(momentum);
+        for (unsigned int i = 0; i < learning_rates.size(); ++i)
+        {
+            auto size = offsets[i + 1] - offsets[i];
+            velocity.narrow(0, offsets[i], size)
+                .add_(flat_gradients.narrow(0, offsets[i], size), learning_rates[i])
+                .add_(flat_parameters.narrow(0, offsets[i], size), learning_rates[i] * weight_decay);
+        }
+        flat_parameters.sub_(velocity);
+        return;
+    }
+
+    auto parameter_data = flat_parameters.data_ptr<float>();
+    auto gradient_data = flat_gradients.data_ptr<float>();
+    auto velocity_data = velocity.data_ptr<float>();
+    parallel_for_parameters([&](int64_t parameter, int64_t begin, int64_t end) {
+        auto layer_learning_rate = learning_rates[parameter];
+        for (auto i = begin; i < end; ++i)
+        {
+            auto step = velocity_data[i] * momentum +
+                        layer_learning_rate * (gradient_data[i] + weight_decay * parameter_data[i]);
+            velocity_data[i] = step;
+            parameter_data[i] -= step;
+        }
+    });
+}
+
+TEST_CASE("FusedLars")
+{
+    torch::manual_seed(0);
+    auto model = torch::nn::Linear(5, 3);
+
+    SUBCASE("Matches a per-parameter implementation")
+    {
+        auto reference_weight = model->weight.detach().clone();
+        auto reference_bias = model->bias.detach().clone();
+        FusedLars optimizer(model->parameters(), 0.1, 0.9, 1e-3, 0.01);
+
+        std::vector<torch::Tensor> velocities{torch::zeros_like(reference_weight),
+                                              torch::zeros_like(reference_bias)};
+        for (int step = 0; step < 10; ++step)
+        {
+            auto inputs = torch::rand({4, 5});
+            optimizer.zero_grad();
+            model->forward(inputs).pow(2).mean().backward();
+            optimizer.step();
+
+            auto weight = reference_weight.detach().requires_grad_();
+            auto bias = reference_bias.detach().requires_grad_();
+            torch::addmm(bias, inputs, weight.t()).pow(2).mean().backward();
+
+            std::vector<torch::Tensor *> parameters{&reference_weight, &reference_bias};
+            std::vector<torch::Tensor> gradients{weight.grad(), bias.grad()};
+            for (unsigned int i = 0; i < parameters.size(); ++i)
+            {
+                auto &parameter = *parameters[i];
+                auto weight_norm = parameter.norm().item().toFloat();
+                auto gradient_norm = gradients[i].norm().item().toFloat();
+                auto trust_ratio = 0.01 * weight_norm / (gradient_norm + 1e-3 * weight_norm + 1e-8);
+                velocities[i] = velocities[i] * 0.9 + (gradients[i] + parameter * 1e-3) * 0.1 * trust_ratio;
+                parameter = parameter - velocities[i];
+            }
+        }
+
+        CHECK(torch::allclose(model->weight, reference_weight, 1e-4, 1e-6));
+        CHECK(torch::allclose(model->bias, reference_bias, 1e-4, 1e-6));
+    }
+
+    SUBCASE("Steps each layer by learning_rate * trust_coefficient of its weights")
+    {
+        FusedLars optimizer(model->parameters(), 0.5, 0.9, 0, 0.01);
+        optimizer.zero_grad();
+        model->forward(torch::rand({4, 5})).pow(2).mean().backward();
+        auto weights = model->weight.detach().clone();
+        optimizer.step();
+
+        // learning_rate * trust_coefficient * ||weights|| / ||gradient|| times
+        // the gradient, and the velocity starts at zero
+        auto change = (model->weight - weights).norm().item().toFloat();
+        CHECK(change == doctest::Approx(0.5 * 0.01 * weights.norm().item().toFloat()).epsilon(1e-3));
+    }
+
+    SUBCASE("Isn't thrown off by the scale of the loss")
+    {
+        auto scaled_model = torch::nn::Linear(5, 3);
+        {
+            torch::NoGradGuard no_grad;
+            scaled_model->weight.copy_(model->weight);
+            scaled_model->bias.copy_(model->bias);
+        }
+        FusedLars optimizer(model->parameters(), 0.1);
+        FusedLars scaled_optimizer(scaled_model->parameters(), 0.1);
+
+        auto inputs = torch::rand({4, 5});
+        optimizer.zero_grad();
+        model->forward(inputs).pow(2).mean().backward();
+        optimizer.step();
+        scaled_optimizer.zero_grad();
+        (scaled_model->forward(inputs).pow(2).mean() * 1000).backward();
+        scaled_optimizer.step();
+
+        CHECK(torch::allclose(model->weight, scaled_model->weight, 1e-4, 1e-6));
+    }
+}
+}
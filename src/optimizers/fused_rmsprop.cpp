@@ -0,0 +1,162 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPPRL_SSE2
+#endif
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/fused_rmsprop.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+FusedRMSprop::FusedRMSprop(std::vector<torch::Tensor> parameters,
+                           float learning_rate,
+                           float alpha,
+                           float epsilon,
+                           float momentum)
+    : FlatOptimizer(parameters, learning_rate, momentum > 0 ? 2 : 1),
+      alpha(alpha),
+      epsilon(epsilon),
+      momentum(momentum) {}
+
+void FusedRMSprop::update()
+{
+    auto &square_average = get_state(0);
+
+    // Off the CPU, the same update as a few kernels over the flat buffers
+    if (!flat_parameters.device().is_cpu())
+    {
+        square_average.mul_(alpha).addcmul_(flat_gradients, flat_gradients, 1 - alpha);
+        auto average = square_average.sqrt().add_(epsilon);
+        if (momentum > 0)
+        {
+            auto &momentum_buffer = get_state(1);
+            momentum_buffer.mul_(momentum).addcdiv_(flat_gradients, average);
+            flat_parameters.add_(momentum_buffer, -learning_rate);
+        }
+        else
+        {
+            flat_parameters.addcdiv_(flat_gradients, average, -learning_rate);
+        }
+        return;
+    }
+
+    auto parameter_data = flat_parameters.data_ptr<float>();
+    auto gradient_data = flat_gradients.data_ptr<float>();
+    auto square_average_data = square_average.data_ptr<float>();
+    auto momentum_data = momentum > 0 ? get_state(1).data_ptr<float>() : nullptr;
+
+    at::parallel_for(0, flat_parameters.numel(), at::internal::GRAIN_SIZE, [&](int64_t begin, int64_t end) {
+        auto i = begin;
+#ifdef CPPRL_SSE2
+        auto alpha_x4 = _mm_set1_ps(alpha);
+        auto one_minus_alpha_x4 = _mm_set1_ps(1 - alpha);
+        auto epsilon_x4 = _mm_set1_ps(epsilon);
+        auto momentum_x4 = _mm_set1_ps(momentum);
+        auto learning_rate_x4 = _mm_set1_ps(learning_rate);
+        for (; i + 4 <= end; i += 4)
+        {
+            auto gradient = _mm_loadu_ps(gradient_data + i);
+            auto square = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(square_average_data + i), alpha_x4),
+                                     _mm_mul_ps(_mm_mul_ps(gradient, gradient), one_minus_alpha_x4));
+            _mm_storeu_ps(square_average_data + i, square);
+            auto scaled_gradient = _mm_div_ps(gradient,
+                                              _mm_add_ps(_mm_sqrt_ps(square), epsilon_x4));
+            if (momentum_data)
+            {
+                scaled_gradient = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(momentum_data + i), momentum_x4),
+                                             scaled_gradient);
+                _mm_storeu_ps(momentum_data + i, scaled_gradient);
+            }
+            _mm_storeu_ps(parameter_data + i,
+                          _mm_sub_ps(_mm_loadu_ps(parameter_data + i),
+                                     _mm_mul_ps(learning_rate_x4, scaled_gradient)));
+        }
+#endif
+        for (; i < end; ++i)
+        {
+            auto gradient = gradient_data[i];
+            auto square = square_average_data[i] * alpha + gradient * gradient * (1 - alpha);
+            square_average_data[i] = square;
+            auto scaled_gradient = gradient / (std::sqrt(square) + epsilon);
+            if (momentum_data)
+            {
+                scaled_gradient += momentum_data[i] * momentum;
+                momentum_data[i] = scaled_gradient;
+            }
+            parameter_data[i] -= learning_rate * scaled_gradient;
+        }
+    });
+}
+
+TEST_CASE("FusedRMSprop")
+{
+    torch::manual_seed(0);
+    auto fused_model = torch::nn::Sequential(torch::nn::Linear(5, 7),
+                                             torch::nn::Linear(7, 3));
+    auto reference_model = torch::nn::Sequential(torch::nn::Linear(5, 7),
+                                                 torch::nn::Linear(7, 3));
+    {
+        torch::NoGradGuard no_grad;
+        auto fused_parameters = fused_model->parameters();
+        auto reference_parameters = reference_model->parameters();
+        for (unsigned int i = 0; i < fused_parameters.size(); ++i)
+        {
+            reference_parameters[i].copy_(fused_parameters[i]);
+        }
+    }
+
+    auto check_matches = [&](FusedRMSprop &fused_optimizer,
+                             torch::optim::RMSprop &reference_optimizer) {
+        for (int i = 0; i < 20; ++i)
+        {
+            auto inputs = torch::rand({4, 5});
+            auto targets = torch::rand({4, 3});
+
+            fused_optimizer.zero_grad();
+            (fused_model->forward(inputs) - targets).pow(2).mean().backward();
+            fused_optimizer.step();
+
+            reference_optimizer.zero_grad();
+            (reference_model->forward(inputs) - targets).pow(2).mean().backward();
+            reference_optimizer.step();
+        }
+
+        auto fused_parameters = fused_model->parameters();
+        auto reference_parameters = reference_model->parameters();
+        for (unsigned int i = 0; i < fused_parameters.size(); ++i)
+        {
+            CHECK(torch::allclose(fused_parameters[i], reference_parameters[i], 1e-4, 1e-6));
+        }
+    };
+
+    SUBCASE("Matches torch::optim::RMSprop")
+    {
+        FusedRMSprop fused_optimizer(fused_model->parameters(), 1e-2, 0.9, 1e-5);
+        torch::optim::RMSprop reference_optimizer(reference_model->parameters(),
+                                                  torch::optim::RMSpropOptions(1e-2)
+                                                      .alpha(0.9)
+                                                      .eps(1e-5));
+        check_matches(fused_optimizer, reference_optimizer);
+        CHECK(fused_optimizer.get_state().size() == 1);
+    }
+
+    SUBCASE("Matches torch::optim::RMSprop with momentum")
+    {
+        FusedRMSprop fused_optimizer(fused_model->parameters(), 1e-2, 0.9, 1e-5, 0.5);
+        torch::optim::RMSprop reference_optimizer(reference_model->parameters(),
+                                                  torch::optim::RMSpropOptions(1e-2)
+                                                      .alpha(0.9)
+                                                      .eps(1e-5)
+                                                      .momentum(0.5));
+        check_matches(fused_optimizer, reference_optimizer);
+        CHECK(fused_optimizer.get_state().size() == 2);
+    }
+}
+}
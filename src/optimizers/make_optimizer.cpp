@@ -0,0 +1,59 @@
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/optimizers/make_optimizer.h"
+#include "cpprl/optimizers/flat_optimizer.h"
+#include "cpprl/optimizers/fused_adam.h"
+#include "cpprl/optimizers/fused_lamb.h"
+#include "cpprl/optimizers/fused_lars.h"
+#include "cpprl/optimizers/fused_rmsprop.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+std::unique_ptr<FlatOptimizer> make_optimizer(const std::string &name,
+                                              std::vector<torch::Tensor> parameters,
+                                              float learning_rate,
+                                              float epsilon)
+{
+    if (name == "Adam")
+    {
+        return std::make_unique<FusedAdam>(parameters, learning_rate, 0.9, 0.999, epsilon);
+    }
+    else if (name == "LAMB")
+    {
+        return std::make_unique<FusedLamb>(parameters, learning_rate, 0.9, 0.999, epsilon);
+    }
+    else if (name == "LARS")
+    {
+        return std::make_unique<FusedLars>(parameters, learning_rate, 0.9, 0, 0.001, epsilon);
+    }
+    else if (name == "RMSprop")
+    {
+        return std::make_unique<FusedRMSprop>(parameters, learning_rate, 0.99, epsilon);
+    }
+    throw std::runtime_error("Optimizer " + name + " not supported");
+}
+
+TEST_CASE("make_optimizer()")
+{
+    auto linear = torch::nn::Linear(3, 2);
+
+    SUBCASE("Makes each optimizer")
+    {
+        CHECK(dynamic_cast<FusedAdam *>(make_optimizer("Adam", linear->parameters(), 1e-3).get()));
+        CHECK(dynamic_cast<FusedLamb *>(make_optimizer("LAMB", linear->parameters(), 1e-3).get()));
+        CHECK(dynamic_cast<FusedLars *>(make_optimizer("LARS", linear->parameters(), 1e-3).get()));
+        CHECK(dynamic_cast<FusedRMSprop *>(make_optimizer("RMSprop", linear->parameters(), 1e-3).get()));
+    }
+
+    SUBCASE("Throws on unknown optimizers")
+    {
+        CHECK_THROWS(make_optimizer("SGD", linear->parameters(), 1e-3));
+    }
+}
+}
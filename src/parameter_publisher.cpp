@@ -0,0 +1,213 @@
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/parameter_publisher.h"
+#include "cpprl/model/mlp_base.h"
+#include "cpprl/model/policy.h"
+#include "cpprl/spaces.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+ParameterPublisher::ParameterPublisher(const Policy &policy)
+    : version(0)
+{
+    int64_t total_size = 0;
+    for (const auto &tensor : get_tensors(policy))
+    {
+        tensor_sizes.push_back(tensor.numel());
+        total_size += tensor.numel();
+    }
+    for (auto &slot : slots)
+    {
+        slot.data = torch::zeros({total_size}, torch::kFloat);
+        slot.sequence = 0;
+    }
+
+    publish(policy);
+}
+
+void ParameterPublisher::check_layout(const std::vector<torch::Tensor> &tensors) const
+{
+    bool matches = tensors.size() == tensor_sizes.size();
+    for (unsigned int i = 0; matches && i < tensors.size(); ++i)
+    {
+        matches = tensors[i].numel() == tensor_sizes[i];
+    }
+    if (!matches)
+    {
+        throw std::runtime_error("Policy doesn't match the layout of the policy "
+                                 "the ParameterPublisher was made for");
+    }
+}
+
+bool ParameterPublisher::fetch(Policy &policy, uint64_t &current_version) const
+{
+    auto tensors = get_tensors(policy);
+    check_layout(tensors);
+
+    torch::NoGradGuard no_grad;
+    while (true)
+    {
+        auto latest_version = version.load(std::memory_order_acquire);
+        if (latest_version == current_version)
+        {
+            return false;
+        }
+
+        const auto &slot = slots[latest_version % 2];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence % 2 != 0)
+        {
+            // The learner has already lapped us and is writing to this slot
+            std::this_thread::yield();
+            continue;
+        }
+
+        int64_t offset = 0;
+        for (unsigned int i = 0; i < tensors.size(); ++i)
+        {
+            tensors[i].copy_(slot.data.narrow(0, offset, tensor_sizes[i])
+                                 .view(tensors[i].sizes()));
+            offset += tensor_sizes[i];
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+        {
+            current_version = latest_version;
+            break;
+        }
+    }
+
+    policy->refresh_observation_normalizer();
+    return true;
+}
+
+std::vector<torch::Tensor> ParameterPublisher::get_tensors(const Policy &policy)
+{
+    auto tensors = policy->parameters();
+    auto buffers = policy->buffers();
+    tensors.insert(tensors.end(), buffers.begin(), buffers.end());
+    return tensors;
+}
+
+void ParameterPublisher::publish(const Policy &policy)
+{
+    auto tensors = get_tensors(policy);
+    check_layout(tensors);
+
+    auto next_version = version.load(std::memory_order_relaxed) + 1;
+    auto &slot = slots[next_version % 2];
+    auto sequence = slot.sequence.load(std::memory_order_relaxed);
+
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    torch::NoGradGuard no_grad;
+    int64_t offset = 0;
+    for (unsigned int i = 0; i < tensors.size(); ++i)
+    {
+        slot.data.narrow(0, offset, tensor_sizes[i])
+            .copy_(tensors[i].detach().reshape({-1}));
+        offset += tensor_sizes[i];
+    }
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    version.store(next_version, std::memory_order_release);
+}
+
+TEST_CASE("ParameterPublisher")
+{
+    ActionSpace space{"Discrete", {3}};
+    Policy learner(space, std::make_shared<MlpBase>(4), true);
+    Policy actor(space, std::make_shared<MlpBase>(4), true);
+    ParameterPublisher publisher(learner);
+
+    SUBCASE("Copies parameters and buffers")
+    {
+        learner->update_observation_normalizer(torch::rand({5, 4}) * 10);
+        publisher.publish(learner);
+        uint64_t version = 0;
+
+        CHECK(publisher.fetch(actor, version));
+        CHECK(version == publisher.get_version());
+
+        auto learner_parameters = learner->parameters();
+        auto actor_parameters = actor->parameters();
+        for (unsigned int i = 0; i < learner_parameters.size(); ++i)
+        {
+            CHECK(torch::equal(learner_parameters[i], actor_parameters[i]));
+        }
+        auto learner_buffers = learner->buffers();
+        auto actor_buffers = actor->buffers();
+        for (unsigned int i = 0; i < learner_buffers.size(); ++i)
+        {
+            CHECK(torch::equal(learner_buffers[i], actor_buffers[i]));
+        }
+
+        auto observations = torch::rand({2, 4}) * 10;
+        auto masks = torch::ones({2, 1});
+        auto hidden_states = torch::zeros({2, 1});
+        CHECK(torch::allclose(learner->get_values(observations, hidden_states, masks),
+                              actor->get_values(observations, hidden_states, masks)));
+    }
+
+    SUBCASE("Doesn't copy the same version twice")
+    {
+        uint64_t version = 0;
+        CHECK(publisher.fetch(actor, version));
+        CHECK(!publisher.fetch(actor, version));
+
+        publisher.publish(learner);
+        CHECK(publisher.fetch(actor, version));
+    }
+
+    SUBCASE("Throws on mismatched policies")
+    {
+        Policy other(space, std::make_shared<MlpBase>(5), true);
+        uint64_t version = 0;
+
+        CHECK_THROWS(publisher.fetch(other, version));
+        CHECK_THROWS(publisher.publish(other));
+    }
+
+    SUBCASE("Never gives torn weights while publishing concurrently")
+    {
+        std::atomic<bool> finished(false);
+        std::thread learner_thread([&] {
+            torch::NoGradGuard no_grad;
+            for (int i = 0; i < 200; ++i)
+            {
+                for (auto &parameter : learner->parameters())
+                {
+                    parameter.fill_(i);
+                }
+                publisher.publish(learner);
+            }
+            finished = true;
+        });
+
+        bool consistent = true;
+        uint64_t version = 0;
+        while (!finished)
+        {
+            if (publisher.fetch(actor, version))
+            {
+                auto first_value = actor->parameters()[0].reshape({-1})[0].item().toFloat();
+                for (const auto &parameter : actor->parameters())
+                {
+                    consistent &= (parameter == first_value).all().item().toBool();
+                }
+            }
+        }
+        learner_thread.join();
+
+        CHECK(consistent);
+    }
+}
+}
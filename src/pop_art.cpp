@@ -0,0 +1,90 @@
+#include <cmath>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "cpprl/pop_art.h"
+#include "cpprl/running_mean_std.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+PopArtImpl::PopArtImpl(float min_scale)
+    : rms(register_module("rms", RunningMeanStd(1))),
+      min_scale(min_scale) {}
+
+torch::Tensor PopArtImpl::denormalize(torch::Tensor values) const
+{
+    return torch::addcmul(get_mean(), values, get_scale());
+}
+
+torch::Tensor PopArtImpl::get_scale() const
+{
+    return torch::sqrt(rms->get_variance()).clamp_min(min_scale);
+}
+
+torch::Tensor PopArtImpl::normalize(torch::Tensor returns) const
+{
+    return (returns - get_mean()) / get_scale();
+}
+
+std::vector<torch::Tensor> PopArtImpl::update(torch::Tensor returns)
+{
+    torch::NoGradGuard no_grad;
+    auto old_mean = get_mean();
+    auto old_scale = get_scale();
+
+    rms->update(returns.reshape({-1, 1}));
+
+    auto new_mean = get_mean();
+    auto new_scale = get_scale();
+    return {old_scale / new_scale, (old_mean - new_mean) / new_scale};
+}
+
+TEST_CASE("PopArt")
+{
+    PopArt pop_art;
+
+    SUBCASE("Starts out as the identity")
+    {
+        auto values = torch::rand({4, 1});
+        CHECK(torch::allclose(pop_art->normalize(values), values));
+        CHECK(torch::allclose(pop_art->denormalize(values), values));
+    }
+
+    SUBCASE("Normalizes returns to the running statistics")
+    {
+        auto returns = torch::randn({200, 1}) * 20 + 50;
+        pop_art->update(returns);
+
+        auto normalized = pop_art->normalize(returns);
+        CHECK(normalized.mean().item().toFloat() == doctest::Approx(0).epsilon(0.01));
+        CHECK(normalized.std().item().toFloat() == doctest::Approx(1).epsilon(0.01));
+        CHECK(torch::allclose(pop_art->denormalize(normalized), returns, 1e-4, 1e-3));
+    }
+
+    SUBCASE("Preserves the outputs of a layer it transforms")
+    {
+        auto critic = torch::nn::Linear(3, 1);
+        auto inputs = torch::rand({5, 3});
+        pop_art->update(torch::randn({10, 1}) * 3 + 2);
+        auto before = pop_art->denormalize(critic->forward(inputs));
+
+        auto transform = pop_art->update(torch::randn({10, 1}) * 40 - 7);
+        {
+            torch::NoGradGuard no_grad;
+            critic->weight.mul_(transform[0].view({-1, 1}));
+            critic->bias.mul_(transform[0]).add_(transform[1]);
+        }
+        auto after = pop_art->denormalize(critic->forward(inputs));
+
+        CHECK(torch::allclose(before, after, 1e-4, 1e-4));
+    }
+
+    SUBCASE("Doesn't divide by zero on constant returns")
+    {
+        pop_art->update(torch::full({10, 1}, 3.));
+        CHECK(std::isfinite(pop_art->normalize(torch::full({1}, 4.)).item().toFloat()));
+    }
+}
+}
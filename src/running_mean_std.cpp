@@ -5,26 +5,67 @@
 
 namespace cpprl
 {
+static torch::Tensor vector_to_buffer(std::vector<float> &values,
+                                      c10::IntArrayRef shape)
+{
+    auto buffer = torch::from_blob(values.data(),
+                                   {static_cast<long>(values.size())})
+                      .clone();
+    if (!shape.empty())
+    {
+        buffer = buffer.view(shape);
+    }
+    return buffer;
+}
+
 RunningMeanStdImpl::RunningMeanStdImpl(int size)
     : count(register_buffer("count", torch::full({1}, 1e-4, torch::kFloat))),
       mean(register_buffer("mean", torch::zeros({size}))),
       variance(register_buffer("variance", torch::ones({size}))) {}
 
-RunningMeanStdImpl::RunningMeanStdImpl(std::vector<float> means, std::vector<float> variances)
+RunningMeanStdImpl::RunningMeanStdImpl(c10::IntArrayRef shape)
+    : count(register_buffer("count", torch::full({1}, 1e-4, torch::kFloat))),
+      mean(register_buffer("mean", torch::zeros(shape))),
+      variance(register_buffer("variance", torch::ones(shape))) {}
+
+RunningMeanStdImpl::RunningMeanStdImpl(std::vector<float> means,
+                                       std::vector<float> variances,
+                                       c10::IntArrayRef shape)
     : count(register_buffer("count", torch::full({1}, 1e-4, torch::kFloat))),
-      mean(register_buffer("mean", torch::from_blob(means.data(), {static_cast<long>(means.size())})
-                                       .clone())),
-      variance(register_buffer("variance", torch::from_blob(variances.data(), {static_cast<long>(variances.size())})
-                                               .clone())) {}
+      mean(register_buffer("mean", vector_to_buffer(means, shape))),
+      variance(register_buffer("variance", vector_to_buffer(variances, shape))) {}
 
 void RunningMeanStdImpl::update(torch::Tensor observation)
 {
-    observation = observation.reshape({-1, mean.size(0)});
-    auto batch_mean = observation.mean(0);
-    auto batch_var = observation.var(0, false, false);
-    auto batch_count = observation.size(0);
+    // Flatten everything but the trailing statistics dimensions into a batch
+    // dimension
+    auto num_stat_dims = mean.dim();
+    AT_CHECK(observation.dim() >= num_stat_dims,
+             "Observations need at least as many dimensions as the statistics");
+    auto observation_shape = observation.sizes().vec();
+    std::vector<int64_t> batch_shape{-1};
+    batch_shape.insert(batch_shape.end(),
+                       observation_shape.end() - num_stat_dims,
+                       observation_shape.end());
+    observation = observation.reshape(batch_shape);
 
-    update_from_moments(batch_mean, batch_var, batch_count);
+    std::vector<int64_t> reduce_dims{0};
+    for (int64_t i = 0; i < num_stat_dims; ++i)
+    {
+        if (mean.size(i) == 1)
+        {
+            reduce_dims.push_back(i + 1);
+        }
+    }
+
+    // Mean and variance in a single pass
+    torch::Tensor batch_var, batch_mean;
+    std::tie(batch_var, batch_mean) = torch::var_mean(observation, reduce_dims,
+                                                      false, true);
+    auto batch_count = observation.numel() / mean.numel();
+
+    update_from_moments(batch_mean.view_as(mean), batch_var.view_as(mean),
+                        batch_count);
 }
 
 void RunningMeanStdImpl::update_from_moments(torch::Tensor batch_mean,
@@ -69,6 +110,32 @@ TEST_CASE("RunningMeanStd")
         }
     }
 
+    SUBCASE("Calculates per-channel mean and variance correctly")
+    {
+        RunningMeanStd rms(std::vector<int64_t>{3, 1, 1});
+        auto observations = torch::rand({4, 3, 5, 5});
+        rms->update(observations.narrow(0, 0, 2));
+        rms->update(observations.narrow(0, 2, 2));
+
+        auto per_channel = observations.transpose(0, 1).reshape({3, -1});
+        auto expected_mean = per_channel.mean(1);
+        auto expected_variance = per_channel.var(1, false);
+
+        auto actual_mean = rms->get_mean();
+        auto actual_variance = rms->get_variance();
+
+        CHECK(rms->get_shape() == std::vector<int64_t>{3, 1, 1});
+        for (int i = 0; i < 3; ++i)
+        {
+            DOCTEST_CHECK(expected_mean[i].item().toFloat() ==
+                          doctest::Approx(actual_mean[i][0][0].item().toFloat())
+                              .epsilon(0.001));
+            DOCTEST_CHECK(expected_variance[i].item().toFloat() ==
+                          doctest::Approx(actual_variance[i][0][0].item().toFloat())
+                              .epsilon(0.001));
+        }
+    }
+
     SUBCASE("Loads mean and variance from constructor correctly")
     {
         RunningMeanStd rms(std::vector<float>{1, 2, 3}, std::vector<float>{4, 5, 6});
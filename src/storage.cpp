@@ -1,4 +1,5 @@
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <c10/util/ArrayRef.h>
@@ -6,6 +7,7 @@
 
 #include "cpprl/generators/feed_forward_generator.h"
 #include "cpprl/generators/recurrent_generator.h"
+#include "cpprl/mapped_file.h"
 #include "cpprl/storage.h"
 #include "cpprl/spaces.h"
 #include "third_party/doctest.h"
@@ -17,97 +19,129 @@ RolloutStorage::RolloutStorage(int64_t num_steps,
                                c10::ArrayRef<int64_t> obs_shape,
                                ActionSpace action_space,
                                int64_t hidden_state_size,
-                               torch::Device device)
-    : device(device), num_steps(num_steps), step(0)
+                               torch::Device device,
+                               torch::Dtype observation_dtype)
+    : device(device),
+      observation_shape(obs_shape.vec()),
+      num_steps(num_steps),
+      observation_size(1),
+      hidden_state_size(hidden_state_size),
+      num_actions(1),
+      step(0),
+      first_row(0),
+      byte_observations(observation_dtype == torch::kByte),
+      discrete_actions(action_space.type == "Discrete"),
+      incremental_gae(false),
+      incremental_gamma(0)
 {
-    std::vector<int64_t> observations_shape{num_steps + 1, num_processes};
-    observations_shape.insert(observations_shape.end(),
-                              obs_shape.begin(), obs_shape.end());
-    observations = torch::zeros(observations_shape, torch::TensorOptions(device));
-    hidden_states = torch::zeros({num_steps + 1, num_processes,
-                                  hidden_state_size},
-                                 torch::TensorOptions(device));
-    rewards = torch::zeros({num_steps, num_processes, 1}, torch::TensorOptions(device));
-    value_predictions = torch::zeros({num_steps + 1, num_processes, 1}, torch::TensorOptions(device));
-    returns = torch::zeros({num_steps + 1, num_processes, 1}, torch::TensorOptions(device));
-    action_log_probs = torch::zeros({num_steps, num_processes, 1}, torch::TensorOptions(device));
-    int num_actions;
-    if (action_space.type == "Discrete")
+    if (observation_dtype != torch::kFloat && observation_dtype != torch::kByte)
     {
-        num_actions = 1;
+        throw std::runtime_error("Observations can only be stored as floats or bytes");
     }
-    else
+    for (const auto dimension : observation_shape)
+    {
+        observation_size *= dimension;
+    }
+    if (!discrete_actions)
     {
         num_actions = action_space.shape[0];
     }
-    actions = torch::zeros({num_steps, num_processes, num_actions}, torch::TensorOptions(device));
-    if (action_space.type == "Discrete")
+
+    // Observation, hidden state, mask, action, action log prob, value
+    // prediction, reward
+    auto record_size = (get_packed_observation_size() + hidden_state_size + 1 +
+                        num_actions + 3);
+    records = torch::zeros({num_steps + 1, num_processes, record_size},
+                           torch::TensorOptions(device));
+    if (byte_observations)
     {
-        actions = actions.to(torch::kLong);
+        std::vector<int64_t> observations_shape{num_steps + 1, num_processes};
+        observations_shape.insert(observations_shape.end(),
+                                  observation_shape.begin(), observation_shape.end());
+        observations = torch::zeros(observations_shape,
+                                    torch::TensorOptions(device).dtype(torch::kByte));
     }
-    masks = torch::ones({num_steps + 1, num_processes, 1}, torch::TensorOptions(device));
+    make_field_views();
+    masks.fill_(1);
+    returns = torch::zeros({num_steps + 1, num_processes, 1}, torch::TensorOptions(device));
 }
 
 RolloutStorage::RolloutStorage(std::vector<RolloutStorage *> individual_storages,
                                torch::Device device)
     : device(device),
-      num_steps(individual_storages[0]->get_rewards().size(0)),
-      step(0)
+      observation_shape(individual_storages[0]->observation_shape),
+      num_steps(individual_storages[0]->num_steps),
+      observation_size(individual_storages[0]->observation_size),
+      hidden_state_size(individual_storages[0]->hidden_state_size),
+      num_actions(individual_storages[0]->num_actions),
+      step(0),
+      first_row(0),
+      byte_observations(individual_storages[0]->byte_observations),
+      discrete_actions(individual_storages[0]->discrete_actions),
+      incremental_gae(false),
+      incremental_gamma(0)
 {
-    std::vector<torch::Tensor> observations_vec;
+    std::vector<torch::Tensor> records_vec;
     std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(observations_vec),
-                   [](RolloutStorage *storage) { return storage->get_observations(); });
-    observations = torch::cat(observations_vec, 1);
-
-    std::vector<torch::Tensor> hidden_states_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(hidden_states_vec),
-                   [](RolloutStorage *storage) { return storage->get_hidden_states(); });
-    hidden_states = torch::cat(hidden_states_vec, 1);
-
-    std::vector<torch::Tensor> rewards_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(rewards_vec),
-                   [](RolloutStorage *storage) { return storage->get_rewards(); });
-    rewards = torch::cat(rewards_vec, 1);
-
-    std::vector<torch::Tensor> value_predictions_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(value_predictions_vec),
-                   [](RolloutStorage *storage) { return storage->get_value_predictions(); });
-    value_predictions = torch::cat(value_predictions_vec, 1);
+                   std::back_inserter(records_vec),
+                   [](RolloutStorage *storage) {
+                       return storage->get_steps(storage->records, 0, storage->num_steps + 1);
+                   });
+    records = torch::cat(records_vec, 1);
+    if (byte_observations)
+    {
+        std::vector<torch::Tensor> observations_vec;
+        std::transform(individual_storages.begin(), individual_storages.end(),
+                       std::back_inserter(observations_vec),
+                       [](RolloutStorage *storage) { return storage->get_observations(); });
+        observations = torch::cat(observations_vec, 1);
+    }
+    make_field_views();
 
     std::vector<torch::Tensor> returns_vec;
     std::transform(individual_storages.begin(), individual_storages.end(),
                    std::back_inserter(returns_vec),
                    [](RolloutStorage *storage) { return storage->get_returns(); });
     returns = torch::cat(returns_vec, 1);
+}
 
-    std::vector<torch::Tensor> action_log_probs_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(action_log_probs_vec),
-                   [](RolloutStorage *storage) { return storage->get_action_log_probs(); });
-    action_log_probs = torch::cat(action_log_probs_vec, 1);
-
-    std::vector<torch::Tensor> actions_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(actions_vec),
-                   [](RolloutStorage *storage) { return storage->get_actions(); });
-    actions = torch::cat(actions_vec, 1);
+std::vector<MemoryUsage> RolloutStorage::estimate_memory_usage(
+    int64_t num_steps,
+    int64_t num_processes,
+    c10::ArrayRef<int64_t> obs_shape,
+    ActionSpace action_space,
+    int64_t hidden_state_size,
+    torch::Dtype observation_dtype,
+    bool incremental_gae)
+{
+    int64_t observation_size = 1;
+    for (const auto dimension : obs_shape)
+    {
+        observation_size *= dimension;
+    }
+    auto num_actions = action_space.type == "Discrete" ? 1 : action_space.shape[0];
+    auto observation_bytes = observation_dtype == torch::kByte ? 1 : sizeof(float);
 
-    std::vector<torch::Tensor> masks_vec;
-    std::transform(individual_storages.begin(), individual_storages.end(),
-                   std::back_inserter(masks_vec),
-                   [](RolloutStorage *storage) { return storage->get_masks(); });
-    masks = torch::cat(masks_vec, 1);
+    // Everything has a row per step, plus one
+    auto row_bytes = (num_steps + 1) * num_processes * static_cast<int64_t>(sizeof(float));
+    return {{"observations", (num_steps + 1) * num_processes * observation_size *
+                                 static_cast<int64_t>(observation_bytes)},
+            {"hidden_states", row_bytes * hidden_state_size},
+            {"masks", row_bytes},
+            {"actions", row_bytes * num_actions},
+            {"action_log_probs", row_bytes},
+            {"value_predictions", row_bytes},
+            {"rewards", row_bytes},
+            {"returns", row_bytes},
+            {"td_residuals", incremental_gae
+                                 ? num_steps * num_processes * static_cast<int64_t>(sizeof(float))
+                                 : 0}};
 }
 
 void RolloutStorage::after_update()
 {
-    observations[0].copy_(observations[-1]);
-    hidden_states[0].copy_(hidden_states[-1]);
-    masks[0].copy_(masks[-1]);
+    // The last step becomes the first step of the next rollout where it is
+    first_row = row(num_steps);
 }
 
 void RolloutStorage::compute_returns(torch::Tensor next_value,
@@ -115,62 +149,187 @@ void RolloutStorage::compute_returns(torch::Tensor next_value,
                                      float gamma,
                                      float tau)
 {
+    if (!use_gae || !incremental_gae || gamma != incremental_gamma)
+    {
+        compute_returns(next_value, use_gae, gamma, tau, 0, num_steps);
+        return;
+    }
+
+    // Only the last residual is left, now the next value is known
+    value_predictions[row(-1)] = next_value;
+    auto last_residual = td_residuals[-1];
+    torch::addcmul_out(last_residual, rewards[row(-2)], value_predictions[row(-1)],
+                       masks[row(-1)], gamma);
+    last_residual.sub_(value_predictions[row(-2)]);
+
+    torch::Tensor gae = torch::zeros({records.size(1), 1}, torch::TensorOptions(device));
+    for (int step = num_steps - 1; step >= 0; --step)
+    {
+        gae = td_residuals[step] + gamma * tau * masks[row(step + 1)] * gae;
+        returns[step] = gae + value_predictions[row(step)];
+    }
+}
+
+void RolloutStorage::compute_returns(torch::Tensor next_value,
+                                     bool use_gae,
+                                     float gamma,
+                                     float tau,
+                                     int64_t start,
+                                     int64_t length)
+{
+    check_window(start, length);
+    auto end = start + length;
     if (use_gae)
     {
-        value_predictions[-1] = next_value;
-        torch::Tensor gae = torch::zeros({rewards.size(1), 1}, torch::TensorOptions(device));
-        for (int step = rewards.size(0) - 1; step >= 0; --step)
+        if (end == num_steps)
         {
-            auto delta = (rewards[step] +
+            value_predictions[row(-1)] = next_value;
+        }
+        torch::Tensor gae = torch::zeros({records.size(1), 1}, torch::TensorOptions(device));
+        auto next_value_prediction = next_value;
+        for (int64_t step = end - 1; step >= start; --step)
+        {
+            auto delta = (rewards[row(step)] +
                           gamma *
-                              value_predictions[step + 1] *
-                              masks[step + 1] -
-                          value_predictions[step]);
-            gae = delta + gamma * tau * masks[step + 1] * gae;
-            returns[step] = gae + value_predictions[step];
+                              next_value_prediction *
+                              masks[row(step + 1)] -
+                          value_predictions[row(step)]);
+            gae = delta + gamma * tau * masks[row(step + 1)] * gae;
+            returns[step] = gae + value_predictions[row(step)];
+            next_value_prediction = value_predictions[row(step)];
         }
     }
     else
     {
-        returns[-1] = next_value;
-        for (int step = rewards.size(0) - 1; step >= 0; --step)
+        if (end == num_steps)
+        {
+            returns[-1] = next_value;
+        }
+        auto next_return = next_value;
+        for (int64_t step = end - 1; step >= start; --step)
         {
-            returns[step] = (returns[step + 1] *
-                                 gamma *
-                                 masks[step + 1] +
-                             rewards[step]);
+            next_return = (next_return *
+                               gamma *
+                               masks[row(step + 1)] +
+                           rewards[row(step)]);
+            returns[step] = next_return;
         }
     }
 }
 
+void RolloutStorage::check_window(int64_t start, int64_t length) const
+{
+    if (start < 0 || length < 1 || start + length > num_steps)
+    {
+        throw std::runtime_error("Window of " + std::to_string(length) +
+                                 " steps starting at step " +
+                                 std::to_string(start) +
+                                 " doesn't fit in a rollout of " +
+                                 std::to_string(num_steps) + " steps");
+    }
+}
+
+void RolloutStorage::continue_from(const RolloutStorage &previous)
+{
+    // The observation, hidden state and mask are next to each other in a
+    // record, so this is one copy
+    auto carried_size = get_packed_observation_size() + hidden_state_size + 1;
+    records[row(0)].narrow(1, 0, carried_size)
+        .copy_(previous.records[previous.row(-1)].narrow(1, 0, carried_size));
+    if (byte_observations)
+    {
+        observations[row(0)].copy_(previous.get_observation(-1));
+    }
+    step = 0;
+}
+
 std::unique_ptr<Generator> RolloutStorage::feed_forward_generator(
     torch::Tensor advantages, int num_mini_batch)
 {
-    auto num_steps = actions.size(0);
+    return feed_forward_generator(advantages, num_mini_batch, 0, num_steps);
+}
+
+std::unique_ptr<Generator> RolloutStorage::feed_forward_generator(
+    torch::Tensor advantages, int num_mini_batch, int64_t start, int64_t length)
+{
+    check_window(start, length);
     auto num_processes = actions.size(1);
-    auto batch_size = num_processes * num_steps;
+    auto batch_size = num_processes * length;
     if (batch_size < num_mini_batch)
     {
         throw std::runtime_error("PPO needs the number of processes (" +
                                  std::to_string(num_processes) +
                                  ") * the number of steps (" +
-                                 std::to_string(num_steps) + ") = " +
-                                 std::to_string(num_processes * num_steps) +
+                                 std::to_string(length) + ") = " +
+                                 std::to_string(num_processes * length) +
                                  " to be greater than or equal to the number of minibatches (" +
                                  std::to_string(num_mini_batch) +
                                  ")");
     }
-    auto mini_batch_size = batch_size / num_mini_batch;
-    return std::make_unique<FeedForwardGenerator>(
-        mini_batch_size,
+    // Any remainder is spread over the first few minibatches
+    return feed_forward_generator(advantages,
+                                  split_evenly(batch_size, num_mini_batch),
+                                  start,
+                                  length);
+}
+
+std::unique_ptr<Generator> RolloutStorage::feed_forward_generator(
+    torch::Tensor advantages,
+    const std::vector<int64_t> &mini_batch_sizes,
+    int64_t start,
+    int64_t length)
+{
+    check_window(start, length);
+    // Minibatches are gathered straight from the buffer rows, so the generator
+    // doesn't care whether the rollout wraps around
+    auto generator = std::make_unique<FeedForwardGenerator>(
+        mini_batch_sizes,
         observations,
         hidden_states,
-        actions,
+        discrete_actions ? actions.to(torch::kLong) : actions,
         value_predictions,
-        returns,
+        returns.narrow(0, start, length + 1),
         masks,
         action_log_probs,
-        advantages);
+        advantages,
+        rows(start, length));
+
+    if (mapped_file)
+    {
+        // Page in the records the next minibatch needs, merging neighbours
+        auto record_bytes = records.size(2) * sizeof(float);
+        auto file = mapped_file;
+        generator->set_prefetch_callback([file, record_bytes](const torch::Tensor &indices) {
+            auto sorted_indices = std::get<0>(indices.sort()).cpu();
+            auto index_data = sorted_indices.data_ptr<int64_t>();
+            auto num_indices = sorted_indices.numel();
+            for (int64_t i = 0; i < num_indices;)
+            {
+                auto run_end = i + 1;
+                while (run_end < num_indices && index_data[run_end] <= index_data[run_end - 1] + 1)
+                {
+                    run_end++;
+                }
+                file->prefetch(index_data[i] * record_bytes,
+                               (index_data[run_end - 1] - index_data[i] + 1) * record_bytes);
+                i = run_end;
+            }
+        });
+    }
+    return generator;
+}
+
+std::vector<MemoryUsage> RolloutStorage::get_memory_usage() const
+{
+    return {{"observations", get_tensor_bytes(observations)},
+            {"hidden_states", get_tensor_bytes(hidden_states)},
+            {"masks", get_tensor_bytes(masks)},
+            {"actions", get_tensor_bytes(actions)},
+            {"action_log_probs", get_tensor_bytes(action_log_probs)},
+            {"value_predictions", get_tensor_bytes(value_predictions)},
+            {"rewards", get_tensor_bytes(rewards)},
+            {"returns", get_tensor_bytes(returns)},
+            {"td_residuals", get_tensor_bytes(td_residuals)}};
 }
 
 void RolloutStorage::insert(torch::Tensor observation,
@@ -181,13 +340,42 @@ void RolloutStorage::insert(torch::Tensor observation,
                             torch::Tensor reward,
                             torch::Tensor mask)
 {
-    observations[step + 1].copy_(observation);
-    hidden_states[step + 1].copy_(hidden_state);
-    actions[step].copy_(action);
-    action_log_probs[step].copy_(action_log_prob);
-    value_predictions[step].copy_(value_prediction);
-    rewards[step].copy_(reward);
-    masks[step + 1].copy_(mask);
+    torch::NoGradGuard no_grad;
+    // One copy for the fields that belong to the next step, and one for the
+    // fields that belong to this one
+    auto num_processes = records.size(1);
+    auto options = records.options();
+    auto next_step_size = get_packed_observation_size() + hidden_state_size + 1;
+    auto next_step_record = records[row(step + 1)].narrow(1, 0, next_step_size);
+    std::vector<torch::Tensor> next_step_fields{
+        hidden_state.reshape({num_processes, -1}).to(options),
+        mask.reshape({num_processes, 1}).to(options)};
+    if (byte_observations)
+    {
+        observations[row(step + 1)].copy_(observation.reshape_as(observations[0]));
+    }
+    else
+    {
+        next_step_fields.insert(next_step_fields.begin(),
+                                observation.reshape({num_processes, -1}).to(options));
+    }
+    torch::cat_out(next_step_record, next_step_fields, 1);
+    auto step_record = records[row(step)].narrow(1, next_step_size, num_actions + 3);
+    torch::cat_out(step_record,
+                   {action.reshape({num_processes, -1}).to(options),
+                    action_log_prob.reshape({num_processes, 1}).to(options),
+                    value_prediction.reshape({num_processes, 1}).to(options),
+                    reward.reshape({num_processes, 1}).to(options)},
+                   1);
+
+    if (incremental_gae && step > 0)
+    {
+        // The previous step's residual needs this step's value prediction
+        auto residual = td_residuals[step - 1];
+        torch::addcmul_out(residual, rewards[row(step - 1)], value_predictions[row(step)],
+                           masks[row(step)], incremental_gamma);
+        residual.sub_(value_predictions[row(step - 1)]);
+    }
 
     step = (step + 1) % num_steps;
 }
@@ -195,6 +383,13 @@ void RolloutStorage::insert(torch::Tensor observation,
 std::unique_ptr<Generator> RolloutStorage::recurrent_generator(
     torch::Tensor advantages, int num_mini_batch)
 {
+    return recurrent_generator(advantages, num_mini_batch, 0, num_steps);
+}
+
+std::unique_ptr<Generator> RolloutStorage::recurrent_generator(
+    torch::Tensor advantages, int num_mini_batch, int64_t start, int64_t length)
+{
+    check_window(start, length);
     auto num_processes = actions.size(1);
     if (num_processes < num_mini_batch)
     {
@@ -204,35 +399,140 @@ std::unique_ptr<Generator> RolloutStorage::recurrent_generator(
                                  std::to_string(num_mini_batch) +
                                  ")");
     }
+    return recurrent_generator(advantages,
+                               split_evenly(num_processes, num_mini_batch),
+                               start,
+                               length);
+}
+
+std::unique_ptr<Generator> RolloutStorage::recurrent_generator(
+    torch::Tensor advantages,
+    const std::vector<int64_t> &group_sizes,
+    int64_t start,
+    int64_t length)
+{
+    check_window(start, length);
+    // The generator gathers everything into minibatch order itself, and only
+    // needs the hidden states of the first step
+    auto step_actions = get_steps(actions, start, length);
     return std::make_unique<RecurrentGenerator>(
-        num_processes,
-        num_mini_batch,
-        observations,
-        hidden_states,
-        actions,
-        value_predictions,
-        returns,
-        masks,
-        action_log_probs,
+        group_sizes,
+        get_steps(observations, start, length),
+        get_steps(hidden_states, start, 1),
+        discrete_actions ? step_actions.to(torch::kLong) : step_actions,
+        get_steps(value_predictions, start, length),
+        returns.narrow(0, start, length),
+        get_steps(masks, start, length),
+        get_steps(action_log_probs, start, length),
         advantages);
 }
 
+torch::Tensor RolloutStorage::get_steps(const torch::Tensor &field,
+                                        int64_t start,
+                                        int64_t length) const
+{
+    auto first = row(start);
+    if (first + length <= num_steps + 1)
+    {
+        return field.narrow(0, first, length);
+    }
+    return field.index_select(0, rows(start, length));
+}
+
+void RolloutStorage::make_field_views()
+{
+    int64_t offset = 0;
+    auto next_field = [&](int64_t size) {
+        auto field = records.narrow(2, offset, size);
+        offset += size;
+        return field;
+    };
+
+    if (!byte_observations)
+    {
+        std::vector<int64_t> observations_shape{records.size(0), records.size(1)};
+        observations_shape.insert(observations_shape.end(),
+                                  observation_shape.begin(), observation_shape.end());
+        observations = next_field(observation_size).view(observations_shape);
+    }
+    hidden_states = next_field(hidden_state_size);
+    masks = next_field(1);
+    // These have a row to spare, but it's needed when the rollout wraps
+    actions = next_field(num_actions);
+    action_log_probs = next_field(1);
+    value_predictions = next_field(1);
+    rewards = next_field(1);
+}
+
+torch::Tensor RolloutStorage::rows(int64_t start, int64_t length) const
+{
+    return (torch::arange(start, start + length, torch::TensorOptions(device).dtype(torch::kLong)) +
+            first_row)
+        .remainder(num_steps + 1);
+}
+
+void RolloutStorage::map_to_file(const std::string &path)
+{
+    if (device != torch::kCPU)
+    {
+        throw std::runtime_error("Only CPU rollout storages can be mapped to a file");
+    }
+
+    auto file = MappedFile::create(path, records.numel() * sizeof(float));
+    auto mapped_records = file->as_tensor(records.sizes());
+    mapped_records.copy_(records);
+    records = mapped_records;
+    make_field_views();
+    mapped_file = file;
+}
+
 void RolloutStorage::set_first_observation(torch::Tensor observation)
 {
-    observations[0].copy_(observation);
+    observations[row(0)].copy_(observation);
+}
+
+void RolloutStorage::set_incremental_gae(bool enabled, float gamma)
+{
+    incremental_gae = enabled;
+    incremental_gamma = gamma;
+    if (enabled && !td_residuals.defined())
+    {
+        td_residuals = torch::zeros({num_steps, records.size(1), 1},
+                                    torch::TensorOptions(device));
+    }
+}
+
+void RolloutStorage::set_steps(torch::Tensor &field, const torch::Tensor &values)
+{
+    auto length = values.size(0);
+    if (first_row + length <= num_steps + 1)
+    {
+        field.narrow(0, first_row, length).copy_(values);
+    }
+    else
+    {
+        field.index_copy_(0, rows(0, length), values.to(field.options()));
+    }
 }
 
 void RolloutStorage::to(torch::Device device)
 {
     this->device = device;
-    observations = observations.to(device);
-    hidden_states = hidden_states.to(device);
-    rewards = rewards.to(device);
-    value_predictions = value_predictions.to(device);
+    records = records.to(device);
+    if (byte_observations)
+    {
+        observations = observations.to(device);
+    }
+    if (device != torch::kCPU)
+    {
+        mapped_file = nullptr;
+    }
+    make_field_views();
     returns = returns.to(device);
-    action_log_probs = action_log_probs.to(device);
-    actions = actions.to(device);
-    masks = masks.to(device);
+    if (td_residuals.defined())
+    {
+        td_residuals = td_residuals.to(device);
+    }
 }
 
 // cppcheck-suppress syntaxError
@@ -338,6 +638,33 @@ TEST_CASE("RolloutStorage")
         CHECK(storage.get_masks()[1][0][0].item().toInt() != 1);
     }
 
+    SUBCASE("insert() round trips actions")
+    {
+        SUBCASE("Discrete")
+        {
+            RolloutStorage storage(2, 3, {2}, ActionSpace{"Discrete", {5}}, 1, torch::kCPU);
+            auto actions = torch::randint(0, 5, {3, 1}, torch::kLong);
+            storage.insert(torch::rand({3, 2}), torch::rand({3, 1}), actions,
+                           torch::rand({3, 1}), torch::rand({3, 1}),
+                           torch::rand({3, 1}), torch::ones({3, 1}));
+
+            CHECK(torch::equal(storage.get_actions()[0], actions));
+        }
+
+        SUBCASE("Box")
+        {
+            RolloutStorage storage(2, 3, {2}, ActionSpace{"Box", {4}}, 1, torch::kCPU);
+            auto actions = torch::rand({3, 4});
+            auto observation = torch::rand({3, 2});
+            storage.insert(observation, torch::rand({3, 1}), actions,
+                           torch::rand({3, 1}), torch::rand({3, 1}),
+                           torch::rand({3, 1}), torch::ones({3, 1}));
+
+            CHECK(torch::equal(storage.get_actions()[0], actions));
+            CHECK(torch::equal(storage.get_observations()[1], observation));
+        }
+    }
+
     SUBCASE("compute_returns()")
     {
         RolloutStorage storage(3, 2, {4}, ActionSpace{"Discrete", {3}}, 5, torch::kCPU);
@@ -436,6 +763,108 @@ TEST_CASE("RolloutStorage")
         }
     }
 
+    SUBCASE("Incremental GAE gives the same returns as computing them at the end")
+    {
+        RolloutStorage storage(5, 3, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+        RolloutStorage incremental_storage(5, 3, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+        incremental_storage.set_incremental_gae(true, 0.9);
+
+        for (int rollout = 0; rollout < 2; ++rollout)
+        {
+            for (int step = 0; step < 5; ++step)
+            {
+                auto value_predictions = torch::rand({3, 1});
+                auto rewards = torch::rand({3, 1});
+                auto masks = torch::randint(0, 2, {3, 1});
+                for (auto target : {&storage, &incremental_storage})
+                {
+                    target->insert(torch::zeros({3, 2}),
+                                   torch::zeros({3, 1}),
+                                   torch::zeros({3, 1}),
+                                   torch::zeros({3, 1}),
+                                   value_predictions,
+                                   rewards,
+                                   masks);
+                }
+            }
+
+            auto next_value = torch::rand({3, 1});
+            storage.compute_returns(next_value, true, 0.9, 0.95);
+            incremental_storage.compute_returns(next_value, true, 0.9, 0.95);
+
+            INFO("Returns: \n"
+                 << storage.get_returns() << "\n");
+            INFO("Incremental returns: \n"
+                 << incremental_storage.get_returns() << "\n");
+            CHECK(torch::allclose(storage.get_returns(), incremental_storage.get_returns()));
+
+            storage.after_update();
+            incremental_storage.after_update();
+        }
+    }
+
+    SUBCASE("Windowed compute_returns()")
+    {
+        RolloutStorage storage(6, 2, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+        RolloutStorage windowed_storage(6, 2, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+        for (int step = 0; step < 6; ++step)
+        {
+            auto value_predictions = torch::rand({2, 1});
+            auto rewards = torch::rand({2, 1});
+            auto masks = torch::randint(0, 2, {2, 1});
+            for (auto target : {&storage, &windowed_storage})
+            {
+                target->insert(torch::zeros({2, 2}),
+                               torch::zeros({2, 1}),
+                               torch::zeros({2, 1}),
+                               torch::zeros({2, 1}),
+                               value_predictions,
+                               rewards,
+                               masks);
+            }
+        }
+        auto next_value = torch::rand({2, 1});
+
+        SUBCASE("Matches compute_returns() over the whole rollout")
+        {
+            for (bool use_gae : {false, true})
+            {
+                storage.compute_returns(next_value, use_gae, 0.9, 0.95);
+                windowed_storage.compute_returns(next_value, use_gae, 0.9, 0.95, 0, 6);
+
+                CHECK(torch::allclose(storage.get_returns(), windowed_storage.get_returns()));
+            }
+        }
+
+        SUBCASE("Matches compute_returns() with 1-step GAE")
+        {
+            // With tau = 0 nothing crosses window boundaries
+            storage.compute_returns(next_value, true, 0.9, 0);
+            windowed_storage.compute_returns(windowed_storage.get_value_predictions()[4],
+                                             true, 0.9, 0, 0, 4);
+            windowed_storage.compute_returns(next_value, true, 0.9, 0, 4, 2);
+
+            CHECK(torch::allclose(storage.get_returns(), windowed_storage.get_returns()));
+        }
+
+        SUBCASE("Throws on windows outside the rollout")
+        {
+            CHECK_THROWS(windowed_storage.compute_returns(next_value, true, 0.9, 0, 4, 3));
+            CHECK_THROWS(windowed_storage.compute_returns(next_value, true, 0.9, 0, -1, 2));
+        }
+
+        SUBCASE("Can create generators over a window")
+        {
+            auto generator = windowed_storage.feed_forward_generator(torch::rand({2, 2, 1}), 2, 3, 2);
+            auto mini_batch = generator->next();
+            CHECK(mini_batch.observations.size(0) == 2);
+
+            generator = windowed_storage.recurrent_generator(torch::rand({2, 2, 1}), 2, 3, 2);
+            mini_batch = generator->next();
+            CHECK(mini_batch.observations.size(0) == 2);
+        }
+    }
+
     SUBCASE("after_update() copies last observation, moves hidden state and mask to "
             "the 0th timestep")
     {
@@ -487,6 +916,97 @@ TEST_CASE("RolloutStorage")
               doctest::Approx(0));
     }
 
+    SUBCASE("continue_from() starts from the other storage's last step")
+    {
+        RolloutStorage previous(2, 2, {3}, ActionSpace{"Discrete", {3}}, 2, torch::kCPU);
+        RolloutStorage next(2, 2, {3}, ActionSpace{"Discrete", {3}}, 2, torch::kCPU);
+        for (int i = 0; i < 2; ++i)
+        {
+            previous.insert(torch::rand({2, 3}),
+                            torch::rand({2, 2}),
+                            torch::zeros({2, 1}),
+                            torch::zeros({2, 1}),
+                            torch::zeros({2, 1}),
+                            torch::zeros({2, 1}),
+                            torch::zeros({2, 1}));
+        }
+        next.continue_from(previous);
+
+        CHECK(torch::equal(next.get_observations()[0], previous.get_observations()[-1]));
+        CHECK(torch::equal(next.get_hidden_states()[0], previous.get_hidden_states()[-1]));
+        CHECK(torch::equal(next.get_masks()[0], previous.get_masks()[-1]));
+    }
+
+    SUBCASE("Reads in step order after wrapping around the buffer")
+    {
+        // Each step's observation and action are both the global step number
+        RolloutStorage storage(3, 2, {1}, ActionSpace{"Box", {1}}, 1, torch::kCPU);
+        int global_step = 0;
+        for (int rollout = 0; rollout < 3; ++rollout)
+        {
+            for (int step = 0; step < 3; ++step)
+            {
+                storage.insert(torch::full({2, 1}, global_step + 1),
+                               torch::zeros({2, 1}),
+                               torch::full({2, 1}, global_step),
+                               torch::zeros({2, 1}),
+                               torch::zeros({2, 1}),
+                               torch::zeros({2, 1}),
+                               torch::ones({2, 1}));
+                global_step++;
+            }
+            if (rollout < 2)
+            {
+                storage.after_update();
+            }
+        }
+
+        auto observations = storage.get_observations();
+        auto actions = storage.get_actions();
+        for (int step = 0; step < 3; ++step)
+        {
+            CHECK(observations[step][0][0].item().toFloat() == 6 + step);
+            CHECK(actions[step][0][0].item().toFloat() == 6 + step);
+            CHECK(storage.get_observation(step)[0][0].item().toFloat() == 6 + step);
+        }
+        CHECK(storage.get_observation(-1)[0][0].item().toFloat() == 9);
+
+        auto generator = storage.feed_forward_generator(torch::zeros({3, 2, 1}), 2);
+        while (!generator->done())
+        {
+            auto mini_batch = generator->next();
+            CHECK(torch::equal(mini_batch.observations, mini_batch.actions));
+        }
+        generator = storage.recurrent_generator(torch::zeros({3, 2, 1}), 2);
+        while (!generator->done())
+        {
+            auto mini_batch = generator->next();
+            CHECK(torch::equal(mini_batch.observations, mini_batch.actions));
+        }
+    }
+
+    SUBCASE("Can be mapped to a file")
+    {
+        RolloutStorage storage(4, 3, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+        auto observation = torch::rand({3, 2});
+        storage.insert(observation, torch::zeros({3, 1}), torch::ones({3, 1}),
+                       torch::zeros({3, 1}), torch::zeros({3, 1}),
+                       torch::zeros({3, 1}), torch::ones({3, 1}));
+        storage.map_to_file("cpprl_rollout_storage_test.bin");
+
+        CHECK(torch::equal(storage.get_observation(1), observation));
+        storage.insert(observation * 2, torch::zeros({3, 1}), torch::ones({3, 1}),
+                       torch::zeros({3, 1}), torch::zeros({3, 1}),
+                       torch::zeros({3, 1}), torch::ones({3, 1}));
+        CHECK(torch::equal(storage.get_observation(2), observation * 2));
+
+        auto generator = storage.feed_forward_generator(torch::rand({4, 3, 1}), 3);
+        while (!generator->done())
+        {
+            CHECK(generator->next().observations.size(0) == 4);
+        }
+    }
+
     SUBCASE("Can create feed-forward generator")
     {
         RolloutStorage storage(3, 5, {5, 2}, ActionSpace{"Discrete", {3}}, 10, torch::kCPU);
@@ -494,6 +1014,53 @@ TEST_CASE("RolloutStorage")
         generator->next();
     }
 
+    SUBCASE("Generators spread uneven batches over the minibatches")
+    {
+        RolloutStorage storage(3, 5, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+
+        auto generator = storage.feed_forward_generator(torch::rand({3, 5, 1}), 4);
+        std::vector<int64_t> sizes;
+        while (!generator->done())
+        {
+            sizes.push_back(generator->next().observations.size(0));
+        }
+        CHECK(sizes == std::vector<int64_t>{4, 4, 4, 3});
+
+        generator = storage.recurrent_generator(torch::rand({3, 5, 1}), 2);
+        sizes.clear();
+        while (!generator->done())
+        {
+            sizes.push_back(generator->next().hidden_states.size(0));
+        }
+        CHECK(sizes == std::vector<int64_t>{3, 2});
+    }
+
+    SUBCASE("Generators can be given their minibatch sizes")
+    {
+        RolloutStorage storage(2, 5, {2}, ActionSpace{"Discrete", {3}}, 1, torch::kCPU);
+
+        auto generator = storage.feed_forward_generator(torch::rand({2, 5, 1}),
+                                                        split_by_size(10, 4), 0, 2);
+        std::vector<int64_t> sizes;
+        while (!generator->done())
+        {
+            sizes.push_back(generator->next().observations.size(0));
+        }
+        CHECK(sizes == std::vector<int64_t>{4, 4, 2});
+
+        generator = storage.recurrent_generator(torch::rand({2, 5, 1}),
+                                                split_by_size(5, 2), 0, 2);
+        sizes.clear();
+        while (!generator->done())
+        {
+            sizes.push_back(generator->next().hidden_states.size(0));
+        }
+        CHECK(sizes == std::vector<int64_t>{2, 2, 1});
+
+        CHECK_THROWS(storage.feed_forward_generator(torch::rand({2, 5, 1}),
+                                                    std::vector<int64_t>{4, 4}, 0, 2));
+    }
+
     SUBCASE("Can create recurrent generator")
     {
         RolloutStorage storage(3, 5, {5, 2}, ActionSpace{"Discrete", {3}}, 10, torch::kCPU);
@@ -501,6 +1068,77 @@ TEST_CASE("RolloutStorage")
         generator->next();
     }
 
+    SUBCASE("Can store byte observations")
+    {
+        RolloutStorage storage(3, 2, {1, 2, 2}, ActionSpace{"Discrete", {3}}, 1,
+                               torch::kCPU, torch::kByte);
+        auto observation = torch::randint(0, 256, {2, 1, 2, 2}).to(torch::kByte);
+        storage.insert(observation, torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::zeros({2, 1}));
+
+        CHECK(storage.get_observations().dtype() == torch::kByte);
+        CHECK(torch::equal(storage.get_observation(1), observation));
+        CHECK(torch::equal(storage.get_hidden_state(1), torch::ones({2, 1})));
+        CHECK(storage.get_mask(1).sum().item().toFloat() == 0);
+
+        RolloutStorage next_storage(3, 2, {1, 2, 2}, ActionSpace{"Discrete", {3}}, 1,
+                                    torch::kCPU, torch::kByte);
+        storage.insert(observation, torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::zeros({2, 1}));
+        storage.insert(observation + 1, torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::ones({2, 1}),
+                       torch::ones({2, 1}), torch::zeros({2, 1}));
+        next_storage.continue_from(storage);
+        CHECK(torch::equal(next_storage.get_observation(0), observation + 1));
+
+        auto generator = storage.feed_forward_generator(torch::rand({3, 2, 1}), 2);
+        CHECK(generator->next().observations.dtype() == torch::kByte);
+
+        CHECK_THROWS(RolloutStorage(3, 2, {4}, ActionSpace{"Discrete", {3}}, 1,
+                                    torch::kCPU, torch::kInt));
+    }
+
+    SUBCASE("Reports its memory usage")
+    {
+        RolloutStorage storage(3, 5, {4, 2}, ActionSpace{"Box", {2}}, 10, torch::kCPU);
+        auto usage = storage.get_memory_usage();
+
+        CHECK(usage[0].name == "observations");
+        CHECK(usage[0].bytes == 4 * 5 * 8 * 4);
+        CHECK(get_total_bytes(usage) ==
+              get_tensor_bytes(storage.get_returns()) + 4 * 5 * (8 + 10 + 1 + 2 + 3) * 4);
+
+        SUBCASE("Matching the estimate")
+        {
+            auto estimate = RolloutStorage::estimate_memory_usage(
+                3, 5, {4, 2}, ActionSpace{"Box", {2}}, 10);
+            REQUIRE(estimate.size() == usage.size());
+            for (unsigned int i = 0; i < usage.size(); ++i)
+            {
+                CHECK(estimate[i].name == usage[i].name);
+                CHECK(estimate[i].bytes == usage[i].bytes);
+            }
+        }
+
+        SUBCASE("With byte observations and incremental GAE")
+        {
+            RolloutStorage byte_storage(3, 5, {4, 2}, ActionSpace{"Discrete", {3}}, 10,
+                                        torch::kCPU, torch::kByte);
+            byte_storage.set_incremental_gae(true);
+            auto byte_usage = byte_storage.get_memory_usage();
+            auto estimate = RolloutStorage::estimate_memory_usage(
+                3, 5, {4, 2}, ActionSpace{"Discrete", {3}}, 10, torch::kByte, true);
+
+            CHECK(byte_usage[0].bytes == 4 * 5 * 8);
+            for (unsigned int i = 0; i < byte_usage.size(); ++i)
+            {
+                CHECK(estimate[i].bytes == byte_usage[i].bytes);
+            }
+        }
+    }
+
     SUBCASE("Can combine multiple storages into one")
     {
         std::vector<RolloutStorage> storages;
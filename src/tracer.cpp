@@ -0,0 +1,290 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <torch/csrc/autograd/profiler.h>
+#include <torch/torch.h>
+
+#include "cpprl/tracer.h"
+#include "third_party/doctest.h"
+
+namespace cpprl
+{
+namespace
+{
+std::string escape_json(const std::string &text)
+{
+    std::string escaped;
+    for (const auto character : text)
+    {
+        if (character == '"' || character == '\\')
+        {
+            escaped += '\\';
+            escaped += character;
+        }
+        else if (static_cast<unsigned char>(character) < 0x20)
+        {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x",
+                          static_cast<unsigned int>(static_cast<unsigned char>(character)));
+            escaped += buffer;
+        }
+        else
+        {
+            escaped += character;
+        }
+    }
+    return escaped;
+}
+
+int64_t to_microseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+}
+
+Tracer::Tracer()
+    : enabled(false),
+      tracing_aten_ops(false),
+      origin(std::chrono::steady_clock::now()) {}
+
+Tracer &Tracer::get()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+}
+
+int Tracer::get_thread_number(std::thread::id id)
+{
+    auto thread_number = thread_numbers.find(id);
+    if (thread_number == thread_numbers.end())
+    {
+        thread_number = thread_numbers.emplace(id, static_cast<int>(thread_numbers.size())).first;
+    }
+    return thread_number->second;
+}
+
+void Tracer::record(const std::string &name,
+                    const std::string &category,
+                    std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end)
+{
+    if (!is_enabled())
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back({name,
+                      category,
+                      to_microseconds(start - origin),
+                      to_microseconds(end - start),
+                      0,
+                      get_thread_number(std::this_thread::get_id())});
+}
+
+void Tracer::record_aten_ops()
+{
+    namespace profiler = torch::autograd::profiler;
+    auto thread_event_lists = profiler::disableProfiler();
+
+    // Profiler timestamps are relative to the mark it makes when enabled
+    const profiler::Event *profiler_start = nullptr;
+    for (const auto &event_list : thread_event_lists)
+    {
+        for (const auto &event : event_list)
+        {
+            if (std::string(event.name()) == "__start_profile")
+            {
+                profiler_start = &event;
+                break;
+            }
+        }
+    }
+    if (!profiler_start)
+    {
+        return;
+    }
+
+    auto start_us = to_microseconds(aten_start - origin);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &event_list : thread_event_lists)
+    {
+        std::vector<const profiler::Event *> open_ops;
+        for (const auto &event : event_list)
+        {
+            auto kind = std::string(event.kind());
+            if (kind == "push")
+            {
+                open_ops.push_back(&event);
+            }
+            else if (kind == "pop" && !open_ops.empty())
+            {
+                auto op = open_ops.back();
+                open_ops.pop_back();
+                events.push_back({op->name(),
+                                  "aten",
+                                  start_us + static_cast<int64_t>(profiler_start->cpu_elapsed_us(*op)),
+                                  static_cast<int64_t>(op->cpu_elapsed_us(event)),
+                                  1,
+                                  static_cast<int>(event.thread_id())});
+            }
+        }
+    }
+}
+
+void Tracer::save(const std::string &path) const
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Couldn't open " + path + " to save the trace");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    file << "{\"traceEvents\":[";
+    for (unsigned int i = 0; i < events.size(); ++i)
+    {
+        const auto &event = events[i];
+        file << (i > 0 ? ",\n" : "\n")
+             << "{\"name\":\"" << escape_json(event.name)
+             << "\",\"cat\":\"" << escape_json(event.category)
+             << "\",\"ph\":\"X\",\"ts\":" << event.start_us
+             << ",\"dur\":" << event.duration_us
+             << ",\"pid\":" << event.process
+             << ",\"tid\":" << event.thread << "}";
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void Tracer::start(bool trace_aten_ops)
+{
+    std::lock_guard<std::mutex> control_lock(control_mutex);
+    if (is_enabled())
+    {
+        return;
+    }
+    tracing_aten_ops = trace_aten_ops;
+    if (tracing_aten_ops)
+    {
+        namespace profiler = torch::autograd::profiler;
+        aten_start = std::chrono::steady_clock::now();
+        profiler::enableProfiler(profiler::ProfilerState::CPU);
+    }
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::stop()
+{
+    std::lock_guard<std::mutex> control_lock(control_mutex);
+    if (!is_enabled())
+    {
+        return;
+    }
+    enabled.store(false, std::memory_order_relaxed);
+    if (tracing_aten_ops)
+    {
+        record_aten_ops();
+        tracing_aten_ops = false;
+    }
+}
+
+TraceSpan::TraceSpan(const char *name, const char *category)
+    : name(name),
+      category(category),
+      active(Tracer::get().is_enabled())
+{
+    if (active)
+    {
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+TraceSpan::~TraceSpan()
+{
+    end();
+}
+
+void TraceSpan::end()
+{
+    if (active)
+    {
+        Tracer::get().record(name, category, start, std::chrono::steady_clock::now());
+        active = false;
+    }
+}
+
+TEST_CASE("Tracer")
+{
+    auto &tracer = Tracer::get();
+    tracer.stop();
+    tracer.clear();
+
+    SUBCASE("Doesn't record anything until started")
+    {
+        {
+            TraceSpan span("test");
+        }
+        CHECK(tracer.size() == 0);
+
+        tracer.start();
+        {
+            TraceSpan span("test");
+        }
+        tracer.stop();
+        CHECK(tracer.size() == 1);
+    }
+
+    SUBCASE("end() only records a span once")
+    {
+        tracer.start();
+        {
+            TraceSpan span("test");
+            span.end();
+        }
+        tracer.stop();
+        CHECK(tracer.size() == 1);
+    }
+
+    SUBCASE("Records ATen ops")
+    {
+        tracer.start(true);
+        {
+            TraceSpan span("matmul");
+            torch::mm(torch::rand({8, 8}), torch::rand({8, 8}));
+        }
+        tracer.stop();
+        CHECK(tracer.size() > 1);
+    }
+
+    SUBCASE("Saves valid looking JSON")
+    {
+        tracer.start();
+        {
+            TraceSpan span("with \"quotes\"");
+        }
+        tracer.stop();
+        tracer.save("cpprl_trace_test.json");
+
+        std::ifstream file("cpprl_trace_test.json");
+        std::string contents((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+        CHECK(contents.find("\"traceEvents\"") != std::string::npos);
+        CHECK(contents.find("with \\\"quotes\\\"") != std::string::npos);
+        std::remove("cpprl_trace_test.json");
+    }
+
+    tracer.clear();
+}
+}